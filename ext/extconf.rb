@@ -3,6 +3,16 @@ require 'mkmf'
 dir_config( "sqlite", "/usr/local", "/usr/local" )
 have_library( "sqlite" )
 
+# optional: used by the native REGEXP function (API.enable_regexp)
+have_header( "regex.h" )
+
+# optional: used to step read-ahead statements in a thread (API.read_ahead)
+have_header( "pthread.h" ) and have_library( "pthread", "pthread_create" )
+
+# optional: used by the native compress() and uncompress() functions
+# (API.enable_compression)
+have_header( "zlib.h" ) and have_library( "z", "compress" )
+
 if have_header( "sqlite.h" ) and have_library( "sqlite", "sqlite_open" )
   create_makefile( "sqlite_api" )
 end
@@ -1,13 +1,34 @@
 #include <stdarg.h>   /* for variable-arity methods */
 #include <stdlib.h>   /* malloc() */
+#include <string.h>   /* strcmp(), strdup() */
+#include <ctype.h>    /* toupper() */
+#include <errno.h>    /* errno, ERANGE */
+#include <math.h>     /* log(), for ranking full-text search results */
+#include <time.h>     /* localtime_r() */
+#include <sys/time.h> /* gettimeofday() */
 #include <sqlite.h>   /* for the SQLite API */
 #include "ruby.h"     /* for the Ruby API */
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>   /* dup(), dup2(), for capturing the VDBE trace */
+#endif
+
+#ifdef HAVE_REGEX_H
+#include <regex.h>    /* POSIX regular expressions, for the REGEXP function */
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>     /* for the compress() and uncompress() functions */
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>  /* for the read-ahead producer thread */
+#include <signal.h>   /* pthread_sigmask() */
+#endif
+
 /* TODO: methods not yet implemented:
  *   sqlite_set_authorizer
  *   sqlite_trace
- *   sqlite_encode_binary
- *   sqlite_decode_binary
  *
  *   sqlite_open_encrypted
  *   sqlite_rekey */
@@ -18,18 +39,42 @@
  * These are for performing frequently requested tasks.
  *>=-----------------------------------------------------------------------=<*/
 
-#define GetDB(var,val) \
-  Data_Get_Struct( val, sqlite, var ); \
-  if( var == NULL ) { \
+#define GetDBHandle(var,val) \
+  Data_Get_Struct( val, db_handle, var ); \
+  if( var->db == NULL ) { \
     static_raise_db_error( -1, "attempt to access a closed database" ); \
   }
 
-#define GetVM(var,val) \
-  Data_Get_Struct( val, sqlite_vm, var ); \
-  if( var == NULL ) { \
-    return Qnil; \
+#define GetDB(var,val) { \
+  db_handle *db_handle_; \
+  GetDBHandle( db_handle_, val ); \
+  var = db_handle_->db; \
+}
+
+/* Like GetDB, but also raises a MisuseException while a read-ahead thread
+ * is stepping one of the database's virtual machines; for the methods that
+ * call into SQLite, or register callbacks that SQLite would then invoke
+ * from that thread. */
+#define GetIdleDB(var,val) { \
+  db_handle *db_handle_; \
+  GetDBHandle( db_handle_, val ); \
+  static_check_reading_ahead( db_handle_ ); \
+  var = db_handle_->db; \
+}
+
+#define GetVMHandle(var,val) \
+  Data_Get_Struct( val, vm_handle, var ); \
+  if( var->vm == NULL ) { \
+    static_raise_db_error( SQLITE_MISUSE, \
+      "attempt to use a finalized virtual machine" ); \
   }
 
+#define GetVM(var,val) { \
+  vm_handle *vm_handle_; \
+  GetVMHandle( vm_handle_, val ); \
+  var = vm_handle_->vm; \
+}
+
 #define GetFunc(var,val) \
   Data_Get_Struct( val, sqlite_func, var )
 
@@ -46,6 +91,7 @@ NO_RDOC
 static VALUE mSQLite;
 static VALUE mAPI;
 static VALUE mExceptions;
+static VALUE cRawRow;
 
 static VALUE DatabaseException;
 
@@ -53,6 +99,20 @@ static ID    idRow;
 static ID    idColumns;
 static ID    idTypes;
 static ID    idCall;
+static ID    idRegexpCache;
+static ID    idConversions;
+static ID    idKinds;
+static ID    idInteger;
+static ID    idFloat;
+static ID    idTime;
+static ID    idTimeZone;
+static ID    idParse;
+static ID    idUtc;
+static ID    idInterns;
+static ID    idLazy;
+static ID    idCaller;
+static ID    idProgress;
+static ID    idBusy;
 
 static struct {
   const char *name;
@@ -117,6 +177,359 @@ static struct {
   x = rb_define_class_under( mExceptions, "NotADatabaseException", DatabaseException )
 #endif
 
+/*>=-----------------------------------------------------------------------=<*
+ * DATA STRUCTURES
+ * ------------------------------------------------------------------------
+ * These are the structures used internally by the extension library.
+ *>=-----------------------------------------------------------------------=<*/
+NO_RDOC
+
+typedef struct vm_handle vm_handle;
+
+/* The producer thread and row buffer of a read-ahead virtual machine. */
+typedef struct read_ahead read_ahead;
+
+/* The data behind a database handle. Each connection keeps a list of the
+ * virtual machines compiled against it that have not yet been finalized, so
+ * that they can be finalized when the connection is closed, and so that
+ * cursors left open (and the locks they hold) can be reported. */
+typedef struct db_handle db_handle;
+
+struct db_handle {
+  sqlite     *db;           /* NULL once the database has been closed */
+  vm_handle  *statements;
+  int         backtraces;   /* record where each vm is compiled */
+  long        lock_warning; /* in milliseconds, or 0 for no warnings */
+  int         functions;    /* Ruby functions have been registered */
+  int         busy_proc;    /* a Ruby busy handler is registered */
+  VALUE       busy;         /* the Ruby busy handler (see ivar) */
+  VALUE       progress;     /* the Ruby progress handler (see ivar) */
+  int         progress_interval; /* 0 if there is no progress handler */
+  int         reading_ahead;/* a vm is being stepped by a producer thread */
+  int         in_handler;   /* SQLite is calling the Ruby progress or busy
+                               handler, in the middle of a statement */
+  vm_handle  *deferred;     /* collected vms waiting to be finalized */
+  db_handle  *prev;
+  db_handle  *next;
+};
+
+/* The data behind a virtual machine handle. */
+struct vm_handle {
+  sqlite_vm  *vm;           /* NULL once the vm has been finalized */
+  db_handle  *db;           /* NULL once the vm or db has been finalized */
+  VALUE       sql;
+  VALUE       backtrace;
+  double      locked_at;    /* when the vm first returned a row, or 0 */
+  int         warned;
+  read_ahead *ahead;        /* the vm's producer thread, or NULL */
+  vm_handle  *prev;
+  vm_handle  *next;
+};
+
+/* all of the databases that are currently open */
+static db_handle *open_databases = NULL;
+
+#ifdef HAVE_REGEX_H
+
+/* The number of hash buckets used to look up cached patterns. This is fixed,
+ * since the cache is expected to stay small; the buckets only need to keep
+ * the chains short. */
+#define REGEXP_CACHE_BUCKETS 64
+
+typedef struct regexp_entry regexp_entry;
+
+struct regexp_entry {
+  char          *pattern;
+  unsigned long  hash;
+  regex_t        compiled;
+  regexp_entry  *prev;      /* more recently used */
+  regexp_entry  *next;      /* less recently used */
+  regexp_entry  *chain;     /* next entry in the same bucket */
+};
+
+typedef struct regexp_cache {
+  regexp_entry  *buckets[ REGEXP_CACHE_BUCKETS ];
+  regexp_entry  *head;      /* most recently used */
+  regexp_entry  *tail;      /* least recently used */
+  int            size;
+  int            capacity;
+  unsigned long  hits;
+  unsigned long  misses;
+  unsigned long  evictions;
+} regexp_cache;
+
+#endif
+
+/* The size of the buffer used when streaming text to a Ruby IO object. Output
+ * is accumulated here and handed to IO#write one buffer at a time. */
+#define OUTPUT_BUFFER_SIZE 65536
+
+typedef struct output_buffer {
+  VALUE  io;
+  long   length;
+  char   data[ OUTPUT_BUFFER_SIZE ];
+} output_buffer;
+
+typedef struct dump_state {
+  sqlite        *db;
+  sqlite_vm     *vm;
+  char          *insert;
+  int            began;
+  output_buffer  out;
+} dump_state;
+
+typedef struct restore_state {
+  sqlite *db;
+  VALUE   io;
+  int     batch_size;
+  int     in_transaction;
+  int     outer_transaction; /* a transaction was already active */
+  char   *sql;
+  long    length;
+  long    capacity;
+} restore_state;
+
+/* The storage classes used when results are converted or packed natively,
+ * based on the declared type of a column. */
+#define COLUMN_TEXT    0
+#define COLUMN_INTEGER 1
+#define COLUMN_REAL    2
+#define COLUMN_TIME    3
+
+/* The local time zone's offset from UTC, as last observed while converting
+ * the values of a result set. The offset is known to apply to every instant
+ * between +low+ and +high+, so times falling in that window need no further
+ * time zone lookups. */
+typedef struct time_zone_memo {
+  int    valid;
+  long   offset;        /* local time minus UTC, in seconds */
+  time_t low;
+  time_t high;
+} time_zone_memo;
+
+typedef struct columnar_state {
+  sqlite_vm  *vm;
+  int         columns;
+  int         pack;
+  int        *kinds;     /* storage class of each packed column */
+  char      **packed;    /* packed data of each column (NULL if unpacked) */
+  long       *lengths;   /* bytes used in each packed buffer */
+  long       *capacities;
+  VALUE       result;
+} columnar_state;
+
+/* Interning of repeated text values. Each distinct value seen in an interned
+ * column is kept (frozen) in a small open-addressing hash table keyed by its
+ * bytes, and handed out again whenever the same value recurs. */
+#define INTERN_INITIAL_SLOTS  64
+#define INTERN_MAX_ENTRIES    4096
+
+/* The number of rows an automatically interned column is sampled for before
+ * it is decided whether the column is worth interning. */
+#define INTERN_SAMPLE_ROWS    64
+
+#define INTERN_OFF      0
+#define INTERN_ON       1
+#define INTERN_SAMPLING 2
+
+typedef struct intern_slot {
+  unsigned long  hash;
+  VALUE          string;    /* 0 if the slot is empty */
+} intern_slot;
+
+typedef struct intern_table {
+  VALUE         spec;       /* true, or the columns to intern */
+  int           columns;    /* -1 until the first row has been seen */
+  char         *modes;      /* INTERN_xxx of each column */
+  long         *misses;     /* new values met in each column while sampling */
+  long          rows;
+  intern_slot  *slots;
+  long          capacity;   /* always a power of two */
+  long          size;
+} intern_table;
+
+/* A row whose values are kept as the raw text returned by SQLite, and only
+ * converted to Ruby objects when they are asked for. The values are copied
+ * (NUL-terminated) into +data+, following the offsets of each value. */
+typedef struct raw_row {
+  VALUE  vm;
+  VALUE  kinds;         /* storage class of each column, or Qfalse */
+  int    columns;
+  long  *offsets;       /* start of each value in data, -1 for NULL */
+  char  *data;
+} raw_row;
+
+/* A call of the Ruby busy handler, for rb_ensure. */
+typedef struct busy_call {
+  db_handle  *db;
+  const char *entity;
+  int         times;
+} busy_call;
+
+/* The state of a statement being profiled: the time at which each VDBE
+ * instruction was reached, as recorded by the progress handler, and what
+ * has to be put back once the statement has run. */
+typedef struct profile_state {
+  double     *times;
+  long        length;
+  long        capacity;
+  db_handle  *db;
+  sqlite_vm  *vm;
+  VALUE       sql;
+  FILE       *trace;
+  int         saved;      /* a duplicate of the original standard output */
+  int         traced;     /* vdbe_trace was on already */
+  int         restored;   /* static_profile_restore has been called */
+  double      start;
+  double      finish;
+} profile_state;
+
+typedef struct execute_state {
+  sqlite_vm  *vm;
+  VALUE       rows;
+} execute_state;
+
+#ifdef HAVE_PTHREAD_H
+/* A read-ahead virtual machine is stepped by a thread of its own, which
+ * copies each row into a bounded ring buffer for API.step to take from. The
+ * producer never touches Ruby objects, so it runs alongside the interpreter;
+ * when the buffer is full it waits for the consumer to make room. */
+struct read_ahead {
+  pthread_t        thread;
+  pthread_mutex_t  mutex;
+  pthread_cond_t   changed;   /* signalled whenever count or state changes */
+  sqlite_vm       *vm;
+  char           **slots;     /* packed rows (see static_read_ahead_pack) */
+  int              capacity;
+  int              head;      /* the slot holding the oldest row */
+  int              count;     /* the number of rows in the buffer */
+  int              columns;
+  const char     **metadata;
+  int              result;    /* the final result of sqlite_step */
+  int              finished;  /* the producer has stopped stepping */
+  int              cancelled; /* the producer has been asked to stop */
+  char            *current;   /* the row most recently handed out */
+  const char     **values;    /* the values of the current row */
+};
+#endif
+
+/* The states of the CSV parser used by API.import_csv. */
+#define CSV_FIELD_START   0   /* at the start of a field */
+#define CSV_UNQUOTED      1   /* within an unquoted field */
+#define CSV_QUOTED        2   /* within a quoted field */
+#define CSV_QUOTE         3   /* just after a quote within a quoted field */
+
+typedef struct csv_import_state {
+  sqlite     *db;
+  sqlite_vm  *vm;            /* the INSERT statement, once it is compiled */
+  VALUE       io;
+  VALUE       table;
+  char        separator;
+  int         header;        /* the first record names the columns */
+  int         batch_size;
+  int         in_transaction;
+  int         outer_transaction; /* a transaction was already active */
+  int         single;        /* one column is inserted, so a blank line is
+                                a record holding a NULL */
+  int         parse;         /* CSV_FIELD_START, CSV_UNQUOTED, ... */
+  int         quoted;        /* the current field was quoted */
+  char       *record;        /* the text of the fields of the current record */
+  long        length;
+  long        capacity;
+  long        start;         /* where the current field starts in record */
+  long       *offsets;       /* start of each field in record, -1 for NULL */
+  int         fields;
+  int         max_fields;
+  int         expected;      /* the number of fields in each record, or 0 */
+  long        line;
+  long        count;
+} csv_import_state;
+
+typedef struct csv_export_state {
+  sqlite        *db;
+  sqlite_vm     *vm;
+  char          *sql;
+  char           separator;
+  int            header;
+  output_buffer  out;
+} csv_export_state;
+
+/* The longest word kept by the full-text tokenizer; longer words are cut
+ * short. */
+#define FTS_MAX_TERM  64
+
+/* The most distinct words in a query given to the match() function. */
+#define FTS_MAX_QUERY 32
+
+/* The statements used by API.fts_sync. */
+#define FTS_PENDING      0   /* the documents to be indexed again */
+#define FTS_TEXT         1   /* the indexed columns of a document */
+#define FTS_OLD_WORDS    2   /* the words a document was last indexed under */
+#define FTS_PUT_DOC      3
+#define FTS_DELETE_DOC   4
+#define FTS_GET_TERM     5   /* the posting list of a word */
+#define FTS_PUT_TERM     6
+#define FTS_DELETE_TERM  7
+#define FTS_STATEMENTS   8
+
+/* A posting: the number of times a word occurs in a document. */
+typedef struct fts_posting {
+  long  doc;
+  long  freq;           /* 0 to take the document out of a posting list */
+} fts_posting;
+
+typedef struct fts_term fts_term;
+
+/* A word, with a list of postings in order of document. */
+struct fts_term {
+  char          *term;
+  unsigned long  hash;
+  fts_posting   *postings;
+  long           count;
+  long           capacity;
+  fts_term      *chain;     /* the next word in the same bucket */
+  fts_term      *next;      /* the next word in the set */
+};
+
+/* A set of words: those of a document or a query, or the changes to be made
+ * to the posting lists of an index. */
+typedef struct fts_terms {
+  fts_term     **buckets;
+  long           nbuckets;
+  long           size;
+  fts_term      *first;
+} fts_terms;
+
+/* A document found by API.fts_search, with its score. */
+typedef struct fts_hit {
+  long    doc;
+  double  score;
+} fts_hit;
+
+typedef struct fts_sync_state {
+  sqlite     *db;
+  VALUE       table;
+  VALUE       columns;
+  sqlite_vm  *vms[ FTS_STATEMENTS ];
+  fts_terms   changes;    /* the postings to add to (or remove from) each word */
+  fts_terms   words;      /* the words of the current document */
+  fts_term    existing;   /* a posting list, as read from the index */
+  fts_term    merged;     /* the same list, with the changes made to it */
+  long       *docs;
+  long        ndocs;
+  long        capacity;
+} fts_sync_state;
+
+typedef struct fts_search_state {
+  sqlite     *db;
+  VALUE       table;
+  VALUE       query;
+  sqlite_vm  *vm;
+  fts_terms   words;
+  fts_term  **lists;      /* the posting lists of the words, rarest first */
+  fts_hit    *hits;
+} fts_search_state;
+
 /*>=-----------------------------------------------------------------------=<*
  * PUBLIC FUNCTION DECLARATIONS
  * ------------------------------------------------------------------------
@@ -186,6 +599,83 @@ static_api_aggregate_context( VALUE module, VALUE func );
 static VALUE
 static_api_aggregate_count( VALUE module, VALUE func );
 
+static VALUE
+static_api_enable_regexp( VALUE module, VALUE db, VALUE capacity );
+
+static VALUE
+static_api_regexp_cache_stats( VALUE module, VALUE db );
+
+static VALUE
+static_api_copy_database( VALUE module, VALUE source, VALUE dest );
+
+static VALUE
+static_api_dump( VALUE module, VALUE db, VALUE io );
+
+static VALUE
+static_api_restore( VALUE module, VALUE db, VALUE io, VALUE batch_size );
+
+static VALUE
+static_api_execute_columnar( VALUE module, VALUE db, VALUE sql, VALUE pack );
+
+static VALUE
+static_api_set_conversions( VALUE module, VALUE vm, VALUE conversions );
+
+static VALUE
+static_api_intern_strings( VALUE module, VALUE vm, VALUE spec );
+
+static VALUE
+static_api_set_lazy_rows( VALUE module, VALUE vm, VALUE lazy );
+
+static VALUE
+static_raw_row_aref( VALUE self, VALUE index );
+
+static VALUE
+static_raw_row_length( VALUE self );
+
+static VALUE
+static_raw_row_to_a( VALUE self );
+
+static VALUE
+static_api_set_statement_backtraces( VALUE module, VALUE db, VALUE flag );
+
+static VALUE
+static_api_set_lock_warning( VALUE module, VALUE db, VALUE ms );
+
+static VALUE
+static_api_open_statements( VALUE module, VALUE db );
+
+static VALUE
+static_api_profile( VALUE module, VALUE db, VALUE sql );
+
+static VALUE
+static_api_execute( VALUE module, VALUE db, VALUE sql );
+
+static VALUE
+static_api_read_ahead( VALUE module, VALUE vm, VALUE capacity );
+
+static VALUE
+static_api_import_csv( VALUE module, VALUE db, VALUE table, VALUE io,
+  VALUE options );
+
+static VALUE
+static_api_export_csv( VALUE module, VALUE db, VALUE sql, VALUE io,
+  VALUE options );
+
+static VALUE
+static_api_progress_handler( VALUE module, VALUE db, VALUE n, VALUE handler );
+
+static VALUE
+static_api_enable_match( VALUE module, VALUE db );
+
+static VALUE
+static_api_fts_sync( VALUE module, VALUE db, VALUE table, VALUE columns );
+
+static VALUE
+static_api_fts_search( VALUE module, VALUE db, VALUE table, VALUE query );
+
+static VALUE
+static_api_enable_compression( VALUE module, VALUE db );
+
 /*>=-----------------------------------------------------------------------=<*
  * PRIVATE FUNCTION DECLARATIONS
  * ------------------------------------------------------------------------
@@ -203,7 +693,37 @@ static void
 static_raise_db_error2( int code, char **msg );
 
 static void
-static_free_vm( sqlite_vm *vm );
+static_free_db( db_handle *handle );
+
+static void
+static_close_db( db_handle *handle );
+
+static void
+static_mark_vm( vm_handle *handle );
+
+static void
+static_free_vm( vm_handle *handle );
+
+static int
+static_release_vm( vm_handle *handle, char **errmsg );
+
+static void
+static_defer_release( vm_handle *handle );
+
+static void
+static_finish_deferred( db_handle *db );
+
+static double
+static_now();
+
+static void
+static_check_locks();
+
+static VALUE
+static_busy_handler_body( VALUE call );
+
+static VALUE
+static_handler_cleanup( VALUE db );
 
 static int
 static_busy_handler( void* cookie, const char *entity, int times );
@@ -214,308 +734,685 @@ static_function_callback( sqlite_func *func, int argc, const char **argv );
 static void
 static_aggregate_finalize_callback( sqlite_func *func );
 
-/*>=-----------------------------------------------------------------------=<*
- * PRIVATE METHOD IMPLEMENTATIONS
- * ------------------------------------------------------------------------
- * Here are the implementations of the methods declared in the previous
- * section.
- *>=-----------------------------------------------------------------------=<*/
-NO_RDOC
+#ifdef HAVE_REGEX_H
+static void
+static_free_regexp_cache( regexp_cache *cache );
 
-/**
- * call-seq:
- *     open( file_name, mode ) -> db
- *
- * Open the named database file. Returns the opaque handle.
- */
-static VALUE
-static_api_open( VALUE module, VALUE file_name, VALUE mode )
-{
-  char   *s_file_name;
-  char   *errmsg;
-  int     i_mode;
-  sqlite *db;
+static void
+static_regexp_cache_trim( regexp_cache *cache, int capacity );
 
-  Check_Type( file_name, T_STRING );
-  Check_Type( mode,      T_FIXNUM );
+static regexp_entry*
+static_regexp_cache_fetch( regexp_cache *cache, const char *pattern,
+  char *errbuf, int errlen );
 
-  s_file_name = STR2CSTR( file_name );
-  i_mode      = FIX2INT( mode );
+static void
+static_regexp_function( sqlite_func *func, int argc, const char **argv );
+#endif
 
-  db = sqlite_open( s_file_name, i_mode, &errmsg );
-  if( db == NULL )
-  {
-    static_raise_db_error2( -1, &errmsg );
-    /* "raise" does not return */
-  }
+static int
+static_insert_sql( sqlite *src, const char *table, char **sql,
+  char **errmsg );
 
-  return Data_Wrap_Struct( rb_cData, NULL, sqlite_close, db );
-}
+static int
+static_finalize_vm( sqlite_vm *vm, int result, char **errmsg );
 
-/**
- * call-seq:
- *     close( db )
- *
- * Closes the given opaque database handle. The handle _must_ be one that was
- * returned by a call to #open.
- */
-static VALUE
-static_api_close( VALUE module, VALUE db )
-{
-  sqlite *handle;
+static int
+static_copy_table( sqlite *src, sqlite *dst, const char *table,
+  char **errmsg );
 
-  /* FIXME: should this be executed atomically? */
-  GetDB( handle, db );
-  sqlite_close( handle );
+static int
+static_read_schema( sqlite *db, VALUE schema, char **errmsg );
 
-  /* don't need to free the handle anymore */
-  RDATA(db)->dfree = NULL;
-  RDATA(db)->data = NULL;
+static int
+static_copy_database( sqlite *src, sqlite *dst, char **errmsg );
 
-  return Qnil;
-}
+static void
+static_buffer_flush( output_buffer *buffer );
+
+static void
+static_buffer_append( output_buffer *buffer, const char *text, long length );
+
+static void
+static_buffer_append_quoted( output_buffer *buffer, const char *value );
 
-/**
- * call-seq:
- *     compile( db, sql ) -> [ vm, remainder ]
- *
- * Compiles the given SQL statement and returns a new virtual machine handle
- * for executing it. Returns a tuple: [ vm, remainder ], where +remainder+ is
- * any text that follows the first complete SQL statement in the +sql+
- * parameter.
- */
 static VALUE
-static_api_compile( VALUE module, VALUE db, VALUE sql )
-{
-  sqlite     *handle;
-  sqlite_vm  *vm;
-  char       *errmsg;
-  const char *sql_tail;
-  int         result;
-  VALUE       tuple;
+static_dump_body( VALUE state );
 
-  GetDB( handle, db );
-  Check_Type( sql, T_STRING );
+static VALUE
+static_dump_cleanup( VALUE state );
 
-  result = sqlite_compile( handle,
-                           STR2CSTR( sql ),
-                           &sql_tail,
-                           &vm,
-                           &errmsg );
+static int
+static_is_transaction_control( const char *sql );
 
-  if( result != SQLITE_OK )
-  {
-    static_raise_db_error2( result, &errmsg );
-    /* "raise" does not return */
-  }
+static int
+static_begin_transaction( sqlite *db );
 
-  tuple = rb_ary_new();
-  rb_ary_push( tuple, Data_Wrap_Struct( rb_cData, NULL, static_free_vm, vm ) );
-  rb_ary_push( tuple, rb_str_new2( sql_tail ) );
+static void
+static_restore_exec( restore_state *state, const char *sql );
 
-  return tuple;
-}
+static VALUE
+static_restore_body( VALUE state );
 
-/**
- * call-seq:
- *     step( vm ) -> hash | nil
- *
- * Steps through a single result for the given virtual machine. Returns a
- * Hash object. If there was a valid row returned, the hash will contain
- * a <tt>:row</tt> key, which maps to an array of values for that row.
- * In addition, the hash will (nearly) always contain a <tt>:columns</tt>
- * key (naming the columns in the result) and a <tt>:types</tt> key
- * (giving the data types for each column).
- *
- * This will return +nil+ if there was an error previously.
- */
 static VALUE
-static_api_step( VALUE module, VALUE vm )
-{
-  sqlite_vm   *vm_ptr;
-  const char **values;
-  const char **metadata;
-  int          columns;
-  int          result;
-  int          index;
-  VALUE        hash;
-  VALUE        value;
+static_restore_cleanup( VALUE state );
 
-  GetVM( vm_ptr, vm );
-  hash = rb_hash_new();
+static int
+static_column_kind( const char *type );
 
-  result = sqlite_step( vm_ptr,
-                        &columns,
-                        &values,
-                        &metadata );
+static VALUE
+static_columnar_body( VALUE state );
 
-  switch( result )
-  {
-    case SQLITE_BUSY:
-      static_raise_db_error( result, "busy in step" );
+static VALUE
+static_columnar_cleanup( VALUE state );
 
-    case SQLITE_ROW:
-      value = rb_ary_new2( columns );
-      for( index = 0; index < columns; index++ )
-      {
-        VALUE entry = Qnil;
+static const char*
+static_vm_kinds( VALUE vm, int columns, const char **metadata );
 
-        if( values[index] != NULL )
-          entry = rb_str_new2( values[index] );
+static int
+static_parse_digits( const char **text, const char *end,
+  unsigned long long *number );
 
-        rb_ary_store( value, index, entry  );
-      }
-      rb_hash_aset( hash, ID2SYM(idRow), value );
-      
-    case SQLITE_DONE:
-      value = rb_ivar_get( vm, idColumns );
+static VALUE
+static_parse_integer( const char *text );
 
-      if( value == Qnil )
-      {
-        value = rb_ary_new2( columns );
-        for( index = 0; index < columns; index++ )
-        {
-          rb_ary_store( value, index, rb_str_new2( metadata[ index ] ) );
-        }
-        rb_ivar_set( vm, idColumns, value );
-      }
+static VALUE
+static_parse_real( const char *text );
 
-      rb_hash_aset( hash, ID2SYM(idColumns), value );
+static long long
+static_civil_seconds( long year, int month, int day, int hour, int minute,
+  int second );
 
-      value = rb_ivar_get( vm, idTypes );
+static long
+static_local_offset( time_t instant );
 
-      if( value == Qnil )
-      {
-        value = rb_ary_new2( columns );
-        for( index = 0; index < columns; index++ )
-        {
-          VALUE item = Qnil;
-          if( metadata[ index+columns ] )
-            item = rb_str_new2( metadata[ index+columns ] );
-          rb_ary_store( value, index, item );
-        }
-        rb_ivar_set( vm, idTypes, value );
-      }
+static time_t
+static_local_to_epoch( long long local, time_zone_memo *memo );
 
-      rb_hash_aset( hash, ID2SYM(idTypes), value );
-      break;
+static int
+static_parse_fixed( const char **text, int count );
 
-    case SQLITE_ERROR:
-    case SQLITE_MISUSE:
-      {
-        char *msg = NULL;
-        sqlite_finalize( vm_ptr, &msg );
-        RDATA(vm)->dfree = NULL;
-        RDATA(vm)->data = NULL;
-        static_raise_db_error2( result, &msg );
-      }
-      /* "raise" doesn't return */
+static VALUE
+static_parse_time( const char *text, time_zone_memo *memo );
 
-    default:
-      static_raise_db_error( -1, "[BUG] unknown result %d from sqlite_step",
-        result );
-      /* "raise" doesn't return */
-  }
+static VALUE
+static_convert_value( VALUE vm, int kind, const char *value,
+  time_zone_memo **memo );
 
-  return hash;
-}
+static void
+static_convert_row( VALUE vm, VALUE row, int columns, const char **values,
+  const char *kinds, intern_table *interns );
+
+static void
+static_mark_intern_table( intern_table *table );
+
+static void
+static_free_intern_table( intern_table *table );
+
+static intern_table*
+static_vm_interns( VALUE vm, int columns, const char **metadata );
+
+static void
+static_intern_grow( intern_table *table );
+
+static VALUE
+static_intern_value( intern_table *table, int column, const char *value );
+
+static void
+static_intern_row_done( intern_table *table );
+
+static VALUE
+static_raw_row_new( VALUE vm, int columns, const char **values );
+
+static void
+static_mark_raw_row( raw_row *row );
+
+static void
+static_free_raw_row( raw_row *row );
+
+static VALUE
+static_raw_row_value( raw_row *row, int index, time_zone_memo **memo );
+
+static int
+static_profile_progress( void *cookie );
+
+static int
+static_profile_flag( void *cookie, int columns, char **values,
+  char **names );
+
+static VALUE
+static_profile_report( FILE *trace, profile_state *state, double start,
+  double finish );
+
+#ifdef HAVE_UNISTD_H
+static int
+static_profile_restore( profile_state *state );
+
+static VALUE
+static_profile_body( VALUE state );
+
+static VALUE
+static_profile_cleanup( VALUE state );
+#endif
+
+static VALUE
+static_execute_body( VALUE state );
+
+static VALUE
+static_execute_cleanup( VALUE state );
+
+static void
+static_check_reading_ahead( db_handle *db );
+
+#ifdef HAVE_PTHREAD_H
+static void*
+static_read_ahead_producer( void *data );
+
+static char*
+static_read_ahead_pack( int columns, const char **values );
+
+static int
+static_read_ahead_next( read_ahead *ahead, int *columns,
+  const char ***values, const char ***metadata );
+
+static void
+static_stop_read_ahead( vm_handle *handle );
+#endif
+
+static void
+static_csv_exec( sqlite *db, const char *sql );
+
+static void
+static_csv_append( csv_import_state *state, char c );
+
+static void
+static_csv_end_field( csv_import_state *state );
+
+static void
+static_csv_end_record( csv_import_state *state );
+
+static void
+static_csv_prepare_insert( csv_import_state *state );
+
+static int
+static_csv_table_columns( csv_import_state *state );
+
+static VALUE
+static_csv_import_body( VALUE state );
+
+static VALUE
+static_csv_import_cleanup( VALUE state );
+
+static void
+static_buffer_append_csv( output_buffer *buffer, const char *value,
+  char separator );
+
+static VALUE
+static_csv_export_body( VALUE state );
+
+static VALUE
+static_csv_export_cleanup( VALUE state );
+
+static VALUE
+static_protected_progress_callback( VALUE handler );
+
+static int
+static_progress_handler( void *cookie );
+
+static int
+static_fts_next_word( const char **text, char *term );
+
+static unsigned long
+static_fts_hash( const char *term );
+
+static void
+static_fts_rehash( fts_terms *set );
+
+static fts_term*
+static_fts_term( fts_terms *set, const char *term, int create );
+
+static void
+static_fts_clear( fts_terms *set );
+
+static void
+static_fts_free( fts_terms *set );
+
+static void
+static_fts_add_posting( fts_term *term, long doc, long freq );
+
+static void
+static_fts_tokenize( fts_terms *set, const char *text, long doc );
+
+static void
+static_fts_encode_number( VALUE text, unsigned long n );
+
+static VALUE
+static_fts_encode( fts_term *list );
+
+static void
+static_fts_decode( fts_term *list, const char *text );
+
+static void
+static_fts_merge( fts_term *existing, fts_term *changes, fts_term *merged );
+
+static sqlite_vm*
+static_fts_compile( sqlite *db, char *sql );
+
+static const char**
+static_fts_step( sqlite_vm *vm, int count, const char **params );
+
+static void
+static_fts_reset( sqlite_vm *vm );
+
+static void
+static_fts_exec( sqlite *db, char *sql );
+
+static VALUE
+static_fts_sync_body( VALUE state );
+
+static VALUE
+static_fts_sync_cleanup( VALUE state );
+
+static int
+static_fts_compare_lists( const void *a, const void *b );
+
+static int
+static_fts_compare_hits( const void *a, const void *b );
+
+static VALUE
+static_fts_search_body( VALUE state );
+
+static VALUE
+static_fts_search_cleanup( VALUE state );
+
+static void
+static_fts_match_function( sqlite_func *func, int argc, const char **argv );
+
+#ifdef HAVE_ZLIB_H
+static void
+static_compress_function( sqlite_func *func, int argc, const char **argv );
+
+static void
+static_uncompress_function( sqlite_func *func, int argc, const char **argv );
+#endif
+
+/*>=-----------------------------------------------------------------------=<*
+ * PRIVATE METHOD IMPLEMENTATIONS
+ * ------------------------------------------------------------------------
+ * Here are the implementations of the methods declared in the previous
+ * section.
+ *>=-----------------------------------------------------------------------=<*/
+NO_RDOC
 
 /**
  * call-seq:
- *     finalize( vm ) -> nil
+ *     open( file_name, mode ) -> db
  *
- * Destroys the given virtual machine and releases any associated memory. Once
- * finalized, the VM should not be used.
+ * Open the named database file. Returns the opaque handle.
  */
 static VALUE
-static_api_finalize( VALUE module, VALUE vm )
+static_api_open( VALUE module, VALUE file_name, VALUE mode )
 {
-  sqlite_vm *vm_ptr;
-  int        result;
+  char      *s_file_name;
   char      *errmsg;
+  int        i_mode;
+  sqlite    *db;
+  db_handle *handle;
 
-  /* FIXME: should this be executed atomically? */
-  GetVM( vm_ptr, vm );
+  Check_Type( file_name, T_STRING );
+  Check_Type( mode,      T_FIXNUM );
 
-  result = sqlite_finalize( vm_ptr, &errmsg );
-  if( result != SQLITE_OK )
+  s_file_name = STR2CSTR( file_name );
+  i_mode      = FIX2INT( mode );
+
+  db = sqlite_open( s_file_name, i_mode, &errmsg );
+  if( db == NULL )
   {
-    static_raise_db_error2( result, &errmsg );
+    static_raise_db_error2( -1, &errmsg );
     /* "raise" does not return */
   }
 
-  /* don't need to free the handle anymore */
-  RDATA(vm)->dfree = NULL;
-  RDATA(vm)->data = NULL;
+  handle = ALLOC( db_handle );
+  MEMZERO( handle, db_handle, 1 );
+  handle->db = db;
 
-  return Qnil;
+  handle->next = open_databases;
+  if( open_databases != NULL )
+    open_databases->prev = handle;
+  open_databases = handle;
+
+  return Data_Wrap_Struct( rb_cData, NULL, static_free_db, handle );
 }
 
 /**
  * call-seq:
- *     last_insert_row_id( db ) -> fixnum
+ *     close( db )
  *
- * Returns the unique row ID of the last insert operation.
+ * Closes the given opaque database handle. The handle _must_ be one that was
+ * returned by a call to #open.
+ *
+ * Any virtual machines that are still open on the database are finalized
+ * first.
  */
 static VALUE
-static_api_last_insert_row_id( VALUE module, VALUE db )
+static_api_close( VALUE module, VALUE db )
 {
-  sqlite *handle;
+  db_handle *handle;
 
-  GetDB( handle, db );
+  /* FIXME: should this be executed atomically? */
+  GetDBHandle( handle, db );
+  if( handle->in_handler )
+    static_raise_db_error( SQLITE_MISUSE,
+      "the database is in the middle of a statement, in its progress or "
+      "busy handler" );
+  static_close_db( handle );
 
-  return INT2FIX( sqlite_last_insert_rowid( handle ) );
+  return Qnil;
 }
 
 /**
  * call-seq:
- *     changes( db ) -> fixnum
+ *     compile( db, sql ) -> [ vm, remainder ]
  *
- * Returns the number of changed rows affected by the last operation.
- * (Note: doing a "delete from table" without a where clause does not affect
- * the result of this method--see the documentation for SQLite itself for
- * the reason behind this.)
+ * Compiles the given SQL statement and returns a new virtual machine handle
+ * for executing it. Returns a tuple: [ vm, remainder ], where +remainder+ is
+ * any text that follows the first complete SQL statement in the +sql+
+ * parameter.
  */
 static VALUE
-static_api_changes( VALUE module, VALUE db )
+static_api_compile( VALUE module, VALUE db, VALUE sql )
 {
-  sqlite *handle;
+  db_handle  *handle;
+  vm_handle  *statement;
+  sqlite_vm  *vm;
+  char       *errmsg;
+  const char *sql_tail;
+  int         result;
+  VALUE       tuple;
+  VALUE       backtrace = Qnil;
 
-  GetDB( handle, db );
+  GetDBHandle( handle, db );
+  Check_Type( sql, T_STRING );
+  static_check_reading_ahead( handle );
 
-  return INT2FIX( sqlite_changes( handle ) );
-}
+  static_check_locks();
 
-/**
- * call-seq:
- *     interrupt( db ) -> nil
- *
- * Interrupts the currently executing operation.
- */
-static VALUE
-static_api_interrupt( VALUE module, VALUE db )
-{
-  sqlite *handle;
+  if( handle->backtraces )
+    backtrace = rb_funcall( rb_mKernel, idCaller, 0 );
 
-  GetDB( handle, db );
-  sqlite_interrupt( handle );
+  result = sqlite_compile( handle->db,
+                           STR2CSTR( sql ),
+                           &sql_tail,
+                           &vm,
+                           &errmsg );
 
-  return Qnil;
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  statement = ALLOC( vm_handle );
+  MEMZERO( statement, vm_handle, 1 );
+  statement->vm = vm;
+  statement->db = handle;
+  statement->sql = rb_str_new( RSTRING(sql)->ptr,
+                               sql_tail - RSTRING(sql)->ptr );
+  statement->backtrace = backtrace;
+
+  statement->next = handle->statements;
+  if( handle->statements != NULL )
+    handle->statements->prev = statement;
+  handle->statements = statement;
+
+  tuple = rb_ary_new();
+  rb_ary_push( tuple, Data_Wrap_Struct( rb_cData, static_mark_vm,
+    static_free_vm, statement ) );
+  rb_ary_push( tuple, rb_str_new2( sql_tail ) );
+
+  return tuple;
 }
 
 /**
  * call-seq:
- *     complete( sql ) -> true | false
+ *     step( vm ) -> hash | nil
  *
- * Returns +true+ if the given SQL text is complete (parsable), and
- * +false+ otherwise.
+ * Steps through a single result for the given virtual machine. Returns a
+ * Hash object. If there was a valid row returned, the hash will contain
+ * a <tt>:row</tt> key, which maps to an array of values for that row.
+ * In addition, the hash will (nearly) always contain a <tt>:columns</tt>
+ * key (naming the columns in the result) and a <tt>:types</tt> key
+ * (giving the data types for each column).
+ *
+ * If the virtual machine has been finalized (including when an error was
+ * raised by a previous step), this raises a MisuseException.
  */
 static VALUE
-static_api_complete( VALUE module, VALUE sql )
+static_api_step( VALUE module, VALUE vm )
 {
-  Check_Type( sql, T_STRING );
-  return ( sqlite_complete( STR2CSTR( sql ) ) ? Qtrue : Qfalse );
-}
+  vm_handle     *handle;
+  const char   **values;
+  const char   **metadata;
+  const char    *kinds;
+  intern_table  *interns;
+  int            columns;
+  int            result;
+  int            index;
+  VALUE          hash;
+  VALUE          value;
+
+  GetVMHandle( handle, vm );
+  hash = rb_hash_new();
+
+#ifdef HAVE_PTHREAD_H
+  if( handle->ahead != NULL )
+  {
+    result = static_read_ahead_next( handle->ahead, &columns, &values,
+      &metadata );
+    if( result != SQLITE_ROW )
+      static_stop_read_ahead( handle );
+  }
+  else
+#endif
+  {
+    static_check_reading_ahead( handle->db );
+    result = sqlite_step( handle->vm,
+                          &columns,
+                          &values,
+                          &metadata );
+  }
+
+  switch( result )
+  {
+    case SQLITE_BUSY:
+      static_check_locks();
+      static_raise_db_error( result, "busy in step" );
+
+    case SQLITE_ROW:
+      if( handle->locked_at == 0 )
+        handle->locked_at = static_now();
+
+      kinds = static_vm_kinds( vm, columns, metadata );
+      interns = static_vm_interns( vm, columns, metadata );
+      if( rb_ivar_get( vm, idLazy ) == Qtrue )
+      {
+        value = static_raw_row_new( vm, columns, values );
+      }
+      else if( kinds != NULL || interns != NULL )
+      {
+        value = rb_ary_new2( columns );
+        static_convert_row( vm, value, columns, values, kinds, interns );
+      }
+      else
+      {
+        value = rb_ary_new2( columns );
+        for( index = 0; index < columns; index++ )
+        {
+          VALUE entry = Qnil;
+
+          if( values[index] != NULL )
+            entry = rb_str_new2( values[index] );
+
+          rb_ary_store( value, index, entry  );
+        }
+      }
+      rb_hash_aset( hash, ID2SYM(idRow), value );
+      
+    case SQLITE_DONE:
+      if( result == SQLITE_DONE )
+        handle->locked_at = 0;
+
+      value = rb_ivar_get( vm, idColumns );
+
+      if( value == Qnil )
+      {
+        value = rb_ary_new2( columns );
+        for( index = 0; index < columns; index++ )
+        {
+          rb_ary_store( value, index, rb_str_new2( metadata[ index ] ) );
+        }
+        rb_ivar_set( vm, idColumns, value );
+      }
+
+      rb_hash_aset( hash, ID2SYM(idColumns), value );
+
+      value = rb_ivar_get( vm, idTypes );
+
+      if( value == Qnil )
+      {
+        value = rb_ary_new2( columns );
+        for( index = 0; index < columns; index++ )
+        {
+          VALUE item = Qnil;
+          if( metadata[ index+columns ] )
+            item = rb_str_new2( metadata[ index+columns ] );
+          rb_ary_store( value, index, item );
+        }
+        rb_ivar_set( vm, idTypes, value );
+      }
+
+      rb_hash_aset( hash, ID2SYM(idTypes), value );
+      break;
+
+    case SQLITE_ERROR:
+    case SQLITE_MISUSE:
+    case SQLITE_ABORT:
+    case SQLITE_INTERRUPT:
+      {
+        char *msg = NULL;
+        static_release_vm( handle, &msg );
+        static_raise_db_error2( result, &msg );
+      }
+      /* "raise" doesn't return */
+
+    default:
+      static_raise_db_error( -1, "[BUG] unknown result %d from sqlite_step",
+        result );
+      /* "raise" doesn't return */
+  }
+
+  return hash;
+}
+
+/**
+ * call-seq:
+ *     finalize( vm ) -> nil
+ *
+ * Destroys the given virtual machine and releases any associated memory. Once
+ * finalized, the VM may not be used, though finalizing it again does nothing.
+ * Closing the database finalizes all of its virtual machines.
+ */
+static VALUE
+static_api_finalize( VALUE module, VALUE vm )
+{
+  vm_handle *handle;
+  int        result;
+  char      *errmsg;
+
+  /* FIXME: should this be executed atomically? */
+  Data_Get_Struct( vm, vm_handle, handle );
+  if( handle->vm == NULL )
+    return Qnil;
+
+  /* a statement's own read-ahead thread is stopped by releasing it, but no
+   * other statement may be finalized while that thread is stepping */
+  if( handle->ahead == NULL )
+    static_check_reading_ahead( handle->db );
+
+  result = static_release_vm( handle, &errmsg );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     last_insert_row_id( db ) -> fixnum
+ *
+ * Returns the unique row ID of the last insert operation.
+ */
+static VALUE
+static_api_last_insert_row_id( VALUE module, VALUE db )
+{
+  sqlite *handle;
+
+  GetDB( handle, db );
+
+  return INT2FIX( sqlite_last_insert_rowid( handle ) );
+}
+
+/**
+ * call-seq:
+ *     changes( db ) -> fixnum
+ *
+ * Returns the number of changed rows affected by the last operation.
+ * (Note: doing a "delete from table" without a where clause does not affect
+ * the result of this method--see the documentation for SQLite itself for
+ * the reason behind this.)
+ */
+static VALUE
+static_api_changes( VALUE module, VALUE db )
+{
+  sqlite *handle;
+
+  GetDB( handle, db );
+
+  return INT2FIX( sqlite_changes( handle ) );
+}
+
+/**
+ * call-seq:
+ *     interrupt( db ) -> nil
+ *
+ * Interrupts the currently executing operation.
+ */
+static VALUE
+static_api_interrupt( VALUE module, VALUE db )
+{
+  sqlite *handle;
+
+  GetDB( handle, db );
+  sqlite_interrupt( handle );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     complete( sql ) -> true | false
+ *
+ * Returns +true+ if the given SQL text is complete (parsable), and
+ * +false+ otherwise.
+ */
+static VALUE
+static_api_complete( VALUE module, VALUE sql )
+{
+  Check_Type( sql, T_STRING );
+  return ( sqlite_complete( STR2CSTR( sql ) ) ? Qtrue : Qfalse );
+}
 
 /**
  * call-seq:
@@ -535,9 +1432,13 @@ static_api_complete( VALUE module, VALUE sql )
 static VALUE
 static_api_busy_handler( VALUE module, VALUE db, VALUE handler )
 {
-  sqlite *handle;
+  db_handle *db_data;
+  sqlite    *handle;
+
+  GetDBHandle( db_data, db );
+  static_check_reading_ahead( db_data );
+  handle = db_data->db;
 
-  GetDB( handle, db );
   if( handler == Qnil )
   {
     sqlite_busy_handler( handle, NULL, NULL );
@@ -549,9 +1450,14 @@ static_api_busy_handler( VALUE module, VALUE db, VALUE handler )
       rb_raise( rb_eArgError, "handler must be a proc" );
     }
 
-    sqlite_busy_handler( handle, static_busy_handler, (void*)handler );
+    sqlite_busy_handler( handle, static_busy_handler, (void*)db_data );
   }
 
+  /* the ivar keeps the handler from being collected */
+  rb_ivar_set( db, idBusy, handler );
+  db_data->busy = handler;
+  db_data->busy_proc = ( handler != Qnil );
+
   return Qnil;
 }
 
@@ -566,12 +1472,15 @@ static_api_busy_handler( VALUE module, VALUE db, VALUE handler )
 static VALUE
 static_api_busy_timeout( VALUE module, VALUE db, VALUE ms )
 {
-  sqlite *handle;
+  db_handle *handle;
 
-  GetDB( handle, db );
+  GetDBHandle( handle, db );
+  static_check_reading_ahead( handle );
   Check_Type( ms, T_FIXNUM );
 
-  sqlite_busy_timeout( handle, FIX2INT( ms ) );
+  /* this replaces any busy handler */
+  handle->busy_proc = 0;
+  sqlite_busy_timeout( handle->db, FIX2INT( ms ) );
 
   return Qnil;
 }
@@ -597,10 +1506,13 @@ static VALUE
 static_api_create_function( VALUE module, VALUE db, VALUE name, VALUE n,
   VALUE proc )
 {
-  sqlite *handle;
-  int     result;
+  db_handle *db_data;
+  sqlite    *handle;
+  int        result;
 
-  GetDB( handle, db );
+  GetDBHandle( db_data, db );
+  static_check_reading_ahead( db_data );
+  handle = db_data->db;
   Check_Type( name, T_STRING );
   Check_Type( n, T_FIXNUM );
   if( !rb_obj_is_kind_of( proc, rb_cProc ) )
@@ -608,6 +1520,7 @@ static_api_create_function( VALUE module, VALUE db, VALUE name, VALUE n,
     rb_raise( rb_eArgError, "handler must be a proc" );
   }
 
+  db_data->functions = 1;
   result = sqlite_create_function( handle,
               StringValueCStr(name),
               FIX2INT(n),
@@ -656,11 +1569,14 @@ static VALUE
 static_api_create_aggregate( VALUE module, VALUE db, VALUE name, VALUE n,
   VALUE step, VALUE finalize )
 {
-  sqlite *handle;
-  int     result;
-  VALUE   data;
+  db_handle *db_data;
+  sqlite    *handle;
+  int        result;
+  VALUE      data;
 
-  GetDB( handle, db );
+  GetDBHandle( db_data, db );
+  static_check_reading_ahead( db_data );
+  handle = db_data->db;
   Check_Type( name, T_STRING );
   Check_Type( n, T_FIXNUM );
   if( !rb_obj_is_kind_of( step, rb_cProc ) )
@@ -675,6 +1591,7 @@ static_api_create_aggregate( VALUE module, VALUE db, VALUE name, VALUE n,
   /* FIXME: will the GC kill this before it is used? */
   data = rb_ary_new3( 2, step, finalize );
 
+  db_data->functions = 1;
   result = sqlite_create_aggregate( handle,
               StringValueCStr(name),
               FIX2INT(n),
@@ -709,7 +1626,7 @@ static_api_function_type( VALUE module, VALUE db, VALUE name, VALUE type )
   sqlite *handle;
   int     result;
 
-  GetDB( handle, db );
+  GetIdleDB( handle, db );
   Check_Type( name, T_STRING );
   Check_Type( type, T_FIXNUM );
 
@@ -845,417 +1762,5187 @@ static_api_aggregate_count( VALUE module, VALUE func )
   return INT2FIX( sqlite_aggregate_count( func_ptr ) );
 }
 
-/*>=-----------------------------------------------------------------------=<*
- * PRIVATE FUNCTION IMPLEMENTATIONS
- * ------------------------------------------------------------------------
- * Here are the implementations of the functions declared previously.
- *>=-----------------------------------------------------------------------=<*/
-NO_RDOC
-
-/*
- * Document-class: SQLite::Exceptions
+/**
+ * call-seq:
+ *     enable_regexp( db, capacity ) -> nil
  *
- * This module contains all exceptions thrown by SQLite routines.
- */
-
-/*
- * Document-class: SQLite::Exceptions::DatabaseException
+ * Registers a native +regexp+ function with the given database. SQLite
+ * invokes this function for the <tt>x REGEXP y</tt> operator, and it may
+ * also be called directly as <tt>regexp( pattern, value )</tt>. Patterns
+ * are POSIX extended regular expressions; the function returns 1 if
+ * +value+ matches +pattern+, 0 if it does not, and NULL if either argument
+ * is NULL.
  *
- * This is the root of the SQLite exception hierarchy. This exception will
- * be thrown for any general errors, or for exceptions for which SQLite itself
- * did not declare a specific error code.
+ * Compiled patterns are kept in a per-connection cache holding at most
+ * +capacity+ patterns, with the least recently used pattern discarded
+ * first. Calling this again on the same database simply changes the
+ * capacity of the existing cache.
+ *
+ * See #regexp_cache_stats.
  */
+static VALUE
+static_api_enable_regexp( VALUE module, VALUE db, VALUE capacity )
+{
+#ifdef HAVE_REGEX_H
+  sqlite       *handle;
+  regexp_cache *cache;
+  VALUE         wrapper;
+  int           result;
+
+  GetIdleDB( handle, db );
+  Check_Type( capacity, T_FIXNUM );
+  if( FIX2INT( capacity ) < 1 )
+  {
+    rb_raise( rb_eArgError, "capacity must be positive" );
+  }
 
-/*
- * Document-class: SQLite::Exceptions::SQLException
- *
- * From the SQLite documentation:
+  wrapper = rb_ivar_get( db, idRegexpCache );
+  if( wrapper != Qnil )
+  {
+    Data_Get_Struct( wrapper, regexp_cache, cache );
+    cache->capacity = FIX2INT( capacity );
+    static_regexp_cache_trim( cache, cache->capacity );
+    return Qnil;
+  }
+
+  cache = ALLOC( regexp_cache );
+  MEMZERO( cache, regexp_cache, 1 );
+  cache->capacity = FIX2INT( capacity );
+
+  /* the cache lives exactly as long as the database handle does */
+  wrapper = Data_Wrap_Struct( rb_cData, NULL, static_free_regexp_cache,
+    cache );
+  rb_ivar_set( db, idRegexpCache, wrapper );
+
+  result = sqlite_create_function( handle, "regexp", 2,
+              static_regexp_function, (void*)cache );
+
+  if( result == SQLITE_OK )
+    result = sqlite_function_type( handle, "regexp", SQLITE_NUMERIC );
+
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error( result, "create function regexp(2)" );
+    /* "raise" does not return */
+  }
+
+  return Qnil;
+#else
+  rb_notimplement();
+  return Qnil;
+#endif
+}
+
+/**
+ * call-seq:
+ *     regexp_cache_stats( db ) -> hash | nil
  *
- * "This return value indicates that there was an error in the SQL that was
- * passed into the sqlite_exec."
+ * Returns a Hash describing the compiled-pattern cache installed by
+ * #enable_regexp, with the keys <tt>:hits</tt>, <tt>:misses</tt>,
+ * <tt>:evictions</tt>, <tt>:size</tt> and <tt>:capacity</tt>. Returns
+ * +nil+ if #enable_regexp has not been called for the database.
  */
+static VALUE
+static_api_regexp_cache_stats( VALUE module, VALUE db )
+{
+#ifdef HAVE_REGEX_H
+  db_handle    *handle;
+  regexp_cache *cache;
+  VALUE         wrapper;
+  VALUE         hash;
 
-/*
- * Document-class: SQLite::Exceptions::InternalException
+  GetDBHandle( handle, db );
+
+  wrapper = rb_ivar_get( db, idRegexpCache );
+  if( wrapper == Qnil )
+    return Qnil;
+
+  Data_Get_Struct( wrapper, regexp_cache, cache );
+
+  hash = rb_hash_new();
+  rb_hash_aset( hash, ID2SYM(rb_intern("hits")), ULONG2NUM( cache->hits ) );
+  rb_hash_aset( hash, ID2SYM(rb_intern("misses")),
+    ULONG2NUM( cache->misses ) );
+  rb_hash_aset( hash, ID2SYM(rb_intern("evictions")),
+    ULONG2NUM( cache->evictions ) );
+  rb_hash_aset( hash, ID2SYM(rb_intern("size")), INT2FIX( cache->size ) );
+  rb_hash_aset( hash, ID2SYM(rb_intern("capacity")),
+    INT2FIX( cache->capacity ) );
+
+  return hash;
+#else
+  return Qnil;
+#endif
+}
+
+/**
+ * call-seq:
+ *     copy_database( source, dest ) -> nil
  *
- * From the SQLite documentation:
+ * Copies the schema and contents of the +source+ database into the +dest+
+ * database. Both parameters must be opaque handles returned by #open. The
+ * destination should be empty; typically one of the two is a
+ * <tt>":memory:"</tt> database.
  *
- * "This value indicates that an internal consistency check within the SQLite
- * library failed. This can only happen if there is a bug in the SQLite library.
- * If you ever get an SQLITE_INTERNAL reply from an sqlite_exec call, please
- * report the problem on the SQLite mailing list."
- */
-
-/*
- * Document-class: SQLite::Exceptions::PermissionsException
- *
- * From the SQLite documentation:
- *
- * "This return value says that the access permissions on the database file are
- * such that the file cannot be opened."
+ * Tables are created and filled first, each through a single compiled
+ * INSERT statement that is rebound for every row. Indexes, views and
+ * triggers are created after the data is in place, so that they are built
+ * once rather than maintained row by row. The whole copy is done inside one
+ * transaction on each database; if anything fails, the destination is
+ * rolled back. Rows keep their rowids, even in tables without an INTEGER
+ * PRIMARY KEY.
  */
+static VALUE
+static_api_copy_database( VALUE module, VALUE source, VALUE dest )
+{
+  sqlite *src;
+  sqlite *dst;
+  char   *errmsg = NULL;
+  int     result;
 
-/*
- * Document-class: SQLite::Exceptions::AbortException
- *
- * From the SQLite documentation:
- *
- * "This value is returned if the callback function returns non-zero."
- */
+  GetIdleDB( src, source );
+  GetIdleDB( dst, dest );
 
-/*
- * Document-class: SQLite::Exceptions::BusyException
- *
- * From the SQLite documentation:
- *
- * "This return code indicates that another program or thread has the database
- * locked. SQLite allows two or more threads to read the database at the same
- * time, but only one thread can have the database open for writing at the same
- * time. Locking in SQLite is on the entire database."
- */
+  if( src == dst )
+  {
+    rb_raise( rb_eArgError, "cannot copy a database onto itself" );
+  }
 
-/*
- * Document-class: SQLite::Exceptions::LockedException
- *
- * From the SQLite documentation:
- *
- * "This return code is similar to SQLITE_BUSY in that it indicates that the
- * database is locked. But the source of the lock is a recursive call to
- * sqlite_exec. This return can only occur if you attempt to invoke sqlite_exec
- * from within a callback routine of a query from a prior invocation of
- * sqlite_exec. Recursive calls to sqlite_exec are allowed as long as they do
- * not attempt to write the same table."
- */
+  result = static_copy_database( src, dst, &errmsg );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
 
-/*
- * Document-class: SQLite::Exceptions::OutOfMemoryException
- *
- * From the SQLite documentation:
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     dump( db, io ) -> nil
  *
- * "This value is returned if a call to malloc fails."
+ * Writes the schema and contents of the given database to +io+ as SQL text,
+ * in the same form as the <tt>.dump</tt> command of the +sqlite+ shell. Each
+ * table is followed by one INSERT statement per row. Rows are quoted and
+ * buffered in C, and the buffer is handed to <tt>io.write</tt> whenever it
+ * fills, so memory use does not depend on the size of the database.
  */
+static VALUE
+static_api_dump( VALUE module, VALUE db, VALUE io )
+{
+  dump_state state;
 
-/*
- * Document-class: SQLite::Exceptions::ReadOnlyException
+  MEMZERO( &state, dump_state, 1 );
+  GetIdleDB( state.db, db );
+  state.out.io = io;
+
+  rb_ensure( static_dump_body, (VALUE)&state,
+             static_dump_cleanup, (VALUE)&state );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     restore( db, io, batch_size ) -> fixnum
  *
- * From the SQLite documentation:
+ * Executes the SQL statements read (line by line, via <tt>io.gets</tt>) from
+ * +io+, such as the output of #dump. Statements are executed inside
+ * transactions, committing after every +batch_size+ statements, or only at
+ * the end if +batch_size+ is zero. Any BEGIN, COMMIT or END statements in
+ * the input are skipped, since the transactions are managed here. If an
+ * error occurs, the current batch is rolled back. If a transaction is
+ * already active, the statements are simply executed within it, and it is
+ * neither committed nor rolled back here.
  *
- * "This return code indicates that an attempt was made to write to a database
- * file that is opened for reading only."
+ * Returns the number of statements executed.
  */
+static VALUE
+static_api_restore( VALUE module, VALUE db, VALUE io, VALUE batch_size )
+{
+  restore_state state;
 
-/*
- * Document-class: SQLite::Exceptions::InterruptException
+  MEMZERO( &state, restore_state, 1 );
+  GetIdleDB( state.db, db );
+  Check_Type( batch_size, T_FIXNUM );
+
+  state.io = io;
+  state.batch_size = FIX2INT( batch_size );
+
+  return rb_ensure( static_restore_body, (VALUE)&state,
+                    static_restore_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     execute_columnar( db, sql, pack ) -> [ columns, types, data ]
  *
- * From the SQLite documentation:
+ * Compiles and runs the given SQL statement, collecting the results by
+ * column rather than by row. Returns a tuple: the column names, their
+ * declared types, and an array holding one entry per column.
  *
- * "This value is returned if a call to sqlite_interrupt interrupts a database
- * operation in progress."
+ * Normally each entry is an array of the values in that column. If +pack+
+ * is true, columns declared with an integer type are instead returned as a
+ * String of native 64-bit integers (<tt>unpack("q*")</tt>), and columns
+ * declared with a floating point type as a String of native doubles
+ * (<tt>unpack("d*")</tt>). NULL values are packed as NaN in the latter;
+ * since no integer can stand for a NULL, a NULL in an integer column raises
+ * a MismatchException, as does any value that is not entirely a number of
+ * the column's kind.
  */
+static VALUE
+static_api_execute_columnar( VALUE module, VALUE db, VALUE sql, VALUE pack )
+{
+  sqlite        *handle;
+  columnar_state state;
+  char          *errmsg = NULL;
+  const char    *sql_tail;
+  int            result;
 
-/*
- * Document-class: SQLite::Exceptions::IOErrorException
+  GetIdleDB( handle, db );
+  Check_Type( sql, T_STRING );
+
+  MEMZERO( &state, columnar_state, 1 );
+  state.pack = RTEST( pack );
+
+  result = sqlite_compile( handle, STR2CSTR( sql ), &sql_tail, &state.vm,
+    &errmsg );
+
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  return rb_ensure( static_columnar_body, (VALUE)&state,
+                    static_columnar_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     set_conversions( vm, conversions ) -> nil
  *
- * From the SQLite documentation:
+ * Asks #step to convert values natively instead of returning them as
+ * strings. The +conversions+ parameter is a Hash that maps upper-case type
+ * names (without any parenthetical part, as in "INTEGER" or "REAL") to
+ * <tt>:integer</tt>, <tt>:float</tt> or <tt>:time</tt>. Each column whose
+ * declared type is found in the hash has its values returned as an Integer,
+ * a Float or a Time, converted exactly as String#to_i, String#to_f and
+ * Time.parse would; other columns are unaffected.
  *
- * "This value is returned if the operating system informs SQLite that it is
- * unable to perform some disk I/O operation. This could mean that there is no
- * more space left on the disk."
+ * Times in the forms SQLite stores them in ("YYYY-MM-DD",
+ * "YYYY-MM-DD HH:MM:SS[.ffffff]", "HH:MM:SS", with an optional "T"
+ * separator and "Z" or "+HH:MM" zone) are parsed natively, and anything
+ * else is handed to Time.parse.
+ *
+ * This must be called before the first call to #step for the VM.
  */
+static VALUE
+static_api_set_conversions( VALUE module, VALUE vm, VALUE conversions )
+{
+  vm_handle *handle;
 
-/*
- * Document-class: SQLite::Exceptions::CorruptException
- *
- * From the SQLite documentation:
+  GetVMHandle( handle, vm );
+  Check_Type( conversions, T_HASH );
+
+  rb_ivar_set( vm, idConversions, conversions );
+  rb_ivar_set( vm, idKinds, Qnil );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     intern_strings( vm, spec ) -> nil
  *
- * "This value is returned if SQLite detects that the database it is working on
- * has become corrupted. Corruption might occur due to a rogue process writing
- * to the database file or it might happen due to an perviously (sic) undetected
- * logic error in of SQLite. This value is also returned if a disk I/O error
- * occurs in such a way that SQLite is forced to leave the database file in a
- * corrupted state. The latter should only happen due to a hardware or operating
- * system malfunction."
+ * Causes the text values of some columns of the given virtual machine's
+ * result set to be interned: each repeated value is returned as the same
+ * frozen String. If +spec+ is +true+, every column is sampled for the first
+ * few rows and only those holding few distinct values remain interned.
+ * Otherwise +spec+ must be an array of column indexes and/or names. Passing
+ * +nil+ or +false+ turns interning off again. This must be called before the
+ * first row is fetched.
  */
+static VALUE
+static_api_intern_strings( VALUE module, VALUE vm, VALUE spec )
+{
+  vm_handle    *handle;
+  intern_table *table;
+  VALUE         wrapper;
 
-/*
- * Document-class: SQLite::Exceptions::NotFoundException
- *
- * From the SQLite documentation:
+  GetVMHandle( handle, vm );
+
+  if( !RTEST( spec ) )
+  {
+    rb_ivar_set( vm, idInterns, Qnil );
+    return Qnil;
+  }
+
+  if( spec != Qtrue )
+    Check_Type( spec, T_ARRAY );
+
+  table = ALLOC( intern_table );
+  MEMZERO( table, intern_table, 1 );
+  table->spec = spec;
+  table->columns = -1;
+
+  wrapper = Data_Wrap_Struct( rb_cData, static_mark_intern_table,
+    static_free_intern_table, table );
+  rb_ivar_set( vm, idInterns, wrapper );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     set_lazy_rows( vm, lazy ) -> nil
  *
- * "(Internal Only) Table or record not found."
+ * If +lazy+ is true, the rows returned by #step for the given virtual
+ * machine will be RawRow objects instead of arrays. A RawRow holds a copy of
+ * the row's text, and creates the Ruby object for a column (converting it as
+ * described by #set_conversions) only when the column is accessed. Interning
+ * (see #intern_strings) does not apply to such rows.
  */
+static VALUE
+static_api_set_lazy_rows( VALUE module, VALUE vm, VALUE lazy )
+{
+  vm_handle *handle;
 
-/*
- * Document-class: SQLite::Exceptions::FullException
- *
- * From the SQLite documentation:
+  GetVMHandle( handle, vm );
+  rb_ivar_set( vm, idLazy, RTEST( lazy ) ? Qtrue : Qnil );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     raw_row[ index ] -> value
  *
- * "This value is returned if an insertion failed because there is no space
- * left on the disk, or the database is too big to hold any more information.
- * The latter case should only occur for databases that are larger than 2GB in
- * size."
+ * Returns the value of the column at the given index (negative indexes
+ * count back from the last column), or +nil+ if there is no such column.
+ * Each call creates a new object.
  */
+static VALUE
+static_raw_row_aref( VALUE self, VALUE index )
+{
+  time_zone_memo *memo = NULL;
+  raw_row        *row;
+  int             i_index;
 
-/*
- * Document-class: SQLite::Exceptions::CantOpenException
- *
- * From the SQLite documentation:
+  Data_Get_Struct( self, raw_row, row );
+  i_index = NUM2INT( index );
+
+  if( i_index < 0 )
+    i_index += row->columns;
+
+  if( i_index < 0 || i_index >= row->columns )
+    return Qnil;
+
+  return static_raw_row_value( row, i_index, &memo );
+}
+
+/**
+ * call-seq:
+ *     raw_row.length -> integer
  *
- * "This value is returned if the database file could not be opened for some
- * reason."
+ * Returns the number of columns in the row.
  */
+static VALUE
+static_raw_row_length( VALUE self )
+{
+  raw_row *row;
 
-/*
- * Document-class: SQLite::Exceptions::ProtocolException
- *
- * From the SQLite documentation:
+  Data_Get_Struct( self, raw_row, row );
+  return INT2FIX( row->columns );
+}
+
+/**
+ * call-seq:
+ *     raw_row.to_a -> array
  *
- * "This value is returned if some other process is messing with file locks and
- * has violated the file locking protocol that SQLite uses on its rollback
- * journal files."
+ * Returns all of the values of the row, as #step would have returned them
+ * had lazy rows not been requested.
  */
+static VALUE
+static_raw_row_to_a( VALUE self )
+{
+  time_zone_memo *memo = NULL;
+  raw_row        *row;
+  VALUE           values;
+  int             index;
 
-/*
- * Document-class: SQLite::Exceptions::EmptyException
- *
- * From the SQLite documentation:
+  Data_Get_Struct( self, raw_row, row );
+
+  values = rb_ary_new2( row->columns );
+  for( index = 0; index < row->columns; index++ )
+    rb_ary_store( values, index, static_raw_row_value( row, index, &memo ) );
+
+  return values;
+}
+
+/**
+ * call-seq:
+ *     set_statement_backtraces( db, flag ) -> nil
  *
- * "(Internal Only) Database table is empty"
+ * If +flag+ is true, the backtrace of each call to #compile on the given
+ * database is recorded, and reported by #open_statements and by lock
+ * warnings (see #set_lock_warning).
  */
+static VALUE
+static_api_set_statement_backtraces( VALUE module, VALUE db, VALUE flag )
+{
+  db_handle *handle;
 
-/*
- * Document-class: SQLite::Exceptions::SchemaChangedException
- *
- * From the SQLite documentation:
+  GetDBHandle( handle, db );
+  handle->backtraces = RTEST( flag );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     set_lock_warning( db, ms ) -> nil
  *
- * "When the database first opened, SQLite reads the database schema into
- * memory and uses that schema to parse new SQL statements. If another process
- * changes the schema, the command currently being processed will abort because
- * the virtual machine code generated assumed the old schema. This is the
- * return code for such cases. Retrying the command usually will clear the
- * problem."
+ * Causes a warning to be issued for any virtual machine of the given database
+ * that has held a lock for more than +ms+ milliseconds (that is, that has
+ * returned a row, but has neither finished nor been finalized). The check is
+ * made whenever a statement is compiled, and whenever a lock is found to be
+ * busy. Passing +nil+ or zero turns the warnings off.
  */
+static VALUE
+static_api_set_lock_warning( VALUE module, VALUE db, VALUE ms )
+{
+  db_handle *handle;
 
-/*
- * Document-class: SQLite::Exceptions::TooBigException
- *
- * From the SQLite documentation:
+  GetDBHandle( handle, db );
+  handle->lock_warning = ( ms == Qnil ? 0 : NUM2LONG( ms ) );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     open_statements( db ) -> array
  *
- * "SQLite will not store more than about 1 megabyte of data in a single row of
- * a single table. If you attempt to store more than 1 megabyte in a single
- * row, this is the return code you get."
+ * Returns an array describing each virtual machine of the given database that
+ * has not been finalized, most recently compiled first. Each element is an
+ * array of [ sql, backtrace, ms ], where +backtrace+ is +nil+ unless
+ * backtraces were being recorded (see #set_statement_backtraces), and +ms+
+ * is the number of milliseconds the virtual machine has held a lock, or +nil+
+ * if it holds none.
  */
+static VALUE
+static_api_open_statements( VALUE module, VALUE db )
+{
+  db_handle *handle;
+  vm_handle *statement;
+  VALUE      result;
+  VALUE      locked;
+  double     now;
 
-/*
- * Document-class: SQLite::Exceptions::ConstraintException
+  GetDBHandle( handle, db );
+
+  now = static_now();
+  result = rb_ary_new();
+
+  for( statement = handle->statements;
+       statement != NULL;
+       statement = statement->next )
+  {
+    locked = Qnil;
+    if( statement->locked_at != 0 )
+      locked = LONG2NUM( (long)( now - statement->locked_at ) );
+
+    rb_ary_push( result, rb_ary_new3( 3, statement->sql,
+      statement->backtrace, locked ) );
+  }
+
+  return result;
+}
+
+/**
+ * call-seq:
+ *     profile( db, sql ) -> [ instructions, ms, entries ]
  *
- * From the SQLite documentation:
+ * Executes the given SQL statement once (discarding any rows it returns),
+ * with the +vdbe_trace+ pragma turned on and a progress handler invoked for
+ * every VDBE instruction. The trace (which SQLite writes to the standard
+ * output) is captured and matched up with the times recorded by the progress
+ * handler. Returns the number of instructions executed, the total time taken
+ * in milliseconds, and an array with an element of the form
+ * [ addr, opcode, count, ms ] for each instruction of the program that was
+ * executed at least once.
  *
- * "This constant is returned if the SQL statement would have violated a
- * database constraint."
+ * SQLite writes the trace to the standard output, so while the statement
+ * runs, file descriptor 1 of the whole process is redirected to a temporary
+ * file: anything written to the standard output in the meantime (by another
+ * thread, or by a busy handler) is captured and discarded along with the
+ * trace. The standard output, the database's progress handler and the
+ * +vdbe_trace+ pragma are put back as they were even if an exception is
+ * raised (by a busy handler, say) while the statement runs.
+ *
+ * The time of an instruction is measured from the time the previous
+ * instruction finished, so it includes the (small) overhead of tracing. If
+ * the SQLite library was compiled without tracing support, the array of
+ * entries will be empty.
  */
-
+static VALUE
+static_api_profile( VALUE module, VALUE db, VALUE sql )
+{
+#ifdef HAVE_UNISTD_H
+  db_handle     *db_data;
+  char          *errmsg = NULL;
+  int            result;
+  int            error;
+  profile_state  state;
+
+  GetDBHandle( db_data, db );
+  static_check_reading_ahead( db_data );
+  Check_Type( sql, T_STRING );
+
+  MEMZERO( &state, profile_state, 1 );
+  state.db = db_data;
+  state.sql = sql;
+
+  state.trace = tmpfile();
+  if( state.trace == NULL )
+    rb_sys_fail( "tmpfile" );
+
+  result = sqlite_exec( db_data->db, "PRAGMA vdbe_trace", static_profile_flag,
+    &state.traced, &errmsg );
+  if( result == SQLITE_OK && !state.traced )
+    result = sqlite_exec( db_data->db, "PRAGMA vdbe_trace=ON", NULL, NULL,
+      &errmsg );
+  if( result != SQLITE_OK )
+  {
+    fclose( state.trace );
+    static_raise_db_error2( result, &errmsg );
+  }
+
+  fflush( stdout );
+  state.saved = dup( 1 );
+  if( state.saved < 0 || dup2( fileno( state.trace ), 1 ) < 0 )
+  {
+    error = errno;
+    if( state.saved >= 0 )
+      close( state.saved );
+    if( !state.traced )
+      sqlite_exec( db_data->db, "PRAGMA vdbe_trace=OFF", NULL, NULL, NULL );
+    fclose( state.trace );
+    errno = error;
+    rb_sys_fail( state.saved < 0 ? "dup" : "dup2" );
+  }
+
+  /* stepping may call back into Ruby (a busy handler, say), which may
+   * raise, so everything is put back by the cleanup in any case */
+  return rb_ensure( static_profile_body, (VALUE)&state,
+                    static_profile_cleanup, (VALUE)&state );
+#else
+  rb_notimplement();
+  return Qnil;
+#endif
+}
+
+/**
+ * call-seq:
+ *     execute( db, sql ) -> [ row, ... ]
+ *
+ * Compiles the given SQL statement, runs it to completion and finalizes it,
+ * all in a single call, returning the rows as arrays of strings (or +nil+s).
+ * The rows carry no column names or types, and no conversions are applied
+ * to them. The virtual machine is finalized even if an exception is raised.
+ * Only the first statement in +sql+ is executed.
+ */
+static VALUE
+static_api_execute( VALUE module, VALUE db, VALUE sql )
+{
+  db_handle     *db_data;
+  sqlite        *handle;
+  execute_state  state;
+  char          *errmsg = NULL;
+  const char    *sql_tail;
+  int            result;
+
+  GetDBHandle( db_data, db );
+  static_check_reading_ahead( db_data );
+  handle = db_data->db;
+  Check_Type( sql, T_STRING );
+
+  MEMZERO( &state, execute_state, 1 );
+
+  result = sqlite_compile( handle, STR2CSTR( sql ), &sql_tail, &state.vm,
+    &errmsg );
+
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  return rb_ensure( static_execute_body, (VALUE)&state,
+                    static_execute_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     read_ahead( vm, capacity ) -> true | false
+ *
+ * Starts a native thread that steps the given virtual machine ahead of the
+ * caller, keeping up to +capacity+ rows in a buffer. Subsequent calls to
+ * #step take their rows from the buffer, so the work done by SQLite overlaps
+ * with whatever the caller does with each row. Finalizing the virtual
+ * machine stops the thread.
+ *
+ * While the thread is running, no other statement may be compiled or
+ * stepped on the same database (a MisuseException is raised). Since the
+ * thread may not call into Ruby, read-ahead is not started if any Ruby
+ * functions, busy handler or progress handler have been registered on the
+ * database, or if the extension was built without POSIX threads; +false+ is
+ * returned in those cases, and the virtual machine is stepped as usual.
+ */
+static VALUE
+static_api_read_ahead( VALUE module, VALUE vm, VALUE capacity )
+{
+  vm_handle  *handle;
+#ifdef HAVE_PTHREAD_H
+  read_ahead *ahead;
+  int         slots;
+#endif
+
+  GetVMHandle( handle, vm );
+
+#ifdef HAVE_PTHREAD_H
+  if( handle->ahead != NULL )
+    return Qtrue;
+
+  slots = NUM2INT( capacity );
+  if( slots < 1 )
+    rb_raise( rb_eArgError, "capacity must be at least 1" );
+
+  if( handle->db == NULL || handle->db->functions ||
+      handle->db->busy_proc || handle->db->progress_interval ||
+      handle->db->reading_ahead )
+    return Qfalse;
+
+  ahead = ALLOC( read_ahead );
+  MEMZERO( ahead, read_ahead, 1 );
+  ahead->vm = handle->vm;
+  ahead->capacity = slots;
+  ahead->slots = ALLOC_N( char*, slots );
+  pthread_mutex_init( &ahead->mutex, NULL );
+  pthread_cond_init( &ahead->changed, NULL );
+
+  if( pthread_create( &ahead->thread, NULL, static_read_ahead_producer,
+                      ahead ) != 0 )
+  {
+    pthread_mutex_destroy( &ahead->mutex );
+    pthread_cond_destroy( &ahead->changed );
+    xfree( ahead->slots );
+    xfree( ahead );
+    return Qfalse;
+  }
+
+  handle->ahead = ahead;
+  handle->db->reading_ahead = 1;
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+/**
+ * call-seq:
+ *     import_csv( db, table, io, options ) -> fixnum
+ *
+ * Reads delimited text from +io+ (via <tt>io.read</tt>, a block at a time)
+ * and inserts each record into the named table, using a single compiled
+ * INSERT statement. Fields may be quoted with double quotes (in which case
+ * they may contain separators, newlines, and doubled quotes); an empty
+ * unquoted field is inserted as NULL. Every record must have the same
+ * number of fields. Blank lines are skipped, except when a single column is
+ * inserted, in which case a blank line is a record holding a NULL.
+ *
+ * The +options+ hash may contain <tt>:separator</tt> (a one-character
+ * string, "," by default), <tt>:header</tt> (if true, the first record
+ * holds the names of the columns to insert into) and <tt>:batch_size</tt>
+ * (the number of records inserted per transaction, or 0 for a single
+ * transaction; 10000 by default). If an error occurs, the current batch is
+ * rolled back. If a transaction is already active, the records are simply
+ * inserted within it, and it is neither committed nor rolled back here.
+ *
+ * Returns the number of records inserted.
+ */
+static VALUE
+static_api_import_csv( VALUE module, VALUE db, VALUE table, VALUE io,
+  VALUE options )
+{
+  db_handle        *handle;
+  csv_import_state  state;
+  VALUE             value;
+
+  GetDBHandle( handle, db );
+  static_check_reading_ahead( handle );
+  Check_Type( table, T_STRING );
+  Check_Type( options, T_HASH );
+
+  MEMZERO( &state, csv_import_state, 1 );
+  state.db = handle->db;
+  state.io = io;
+  state.table = table;
+  state.separator = ',';
+  state.batch_size = 10000;
+  state.line = 1;
+
+  value = rb_hash_aref( options, ID2SYM( rb_intern( "separator" ) ) );
+  if( value != Qnil )
+    state.separator = *StringValuePtr( value );
+  state.header = RTEST( rb_hash_aref( options,
+    ID2SYM( rb_intern( "header" ) ) ) );
+  value = rb_hash_aref( options, ID2SYM( rb_intern( "batch_size" ) ) );
+  if( value != Qnil )
+    state.batch_size = NUM2INT( value );
+
+  return rb_ensure( static_csv_import_body, (VALUE)&state,
+                    static_csv_import_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     export_csv( db, sql, io, options ) -> fixnum
+ *
+ * Runs the given query and writes its rows to +io+ as delimited text, one
+ * record per line. The text is built in C and handed to <tt>io.write</tt>
+ * a buffer at a time, so no Ruby objects are created for the values, and
+ * memory use does not depend on the size of the result. Fields that contain
+ * the separator, a double quote or a newline (and empty strings) are
+ * quoted; NULLs are written as empty, unquoted fields.
+ *
+ * The +options+ hash may contain <tt>:separator</tt> (a one-character
+ * string, "," by default) and <tt>:header</tt> (if true, the first line
+ * holds the names of the columns).
+ *
+ * Returns the number of rows written.
+ */
+static VALUE
+static_api_export_csv( VALUE module, VALUE db, VALUE sql, VALUE io,
+  VALUE options )
+{
+  db_handle        *handle;
+  csv_export_state  state;
+  VALUE             value;
+
+  GetDBHandle( handle, db );
+  static_check_reading_ahead( handle );
+  Check_Type( sql, T_STRING );
+  Check_Type( options, T_HASH );
+
+  MEMZERO( &state, csv_export_state, 1 );
+  state.db = handle->db;
+  state.sql = STR2CSTR( sql );
+  state.out.io = io;
+  state.separator = ',';
+
+  value = rb_hash_aref( options, ID2SYM( rb_intern( "separator" ) ) );
+  if( value != Qnil )
+    state.separator = *StringValuePtr( value );
+  state.header = RTEST( rb_hash_aref( options,
+    ID2SYM( rb_intern( "header" ) ) ) );
+
+  return rb_ensure( static_csv_export_body, (VALUE)&state,
+                    static_csv_export_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     progress_handler( db, n, handler ) -> nil
+ *
+ * Registers a Proc to be invoked (with no arguments) every +n+ virtual
+ * machine instructions while a statement is being stepped. If the handler
+ * raises an exception, the statement is aborted (and an AbortException
+ * raised in its place). If +n+ is zero or +handler+ is +nil+, any existing
+ * progress handler is removed.
+ */
+static VALUE
+static_api_progress_handler( VALUE module, VALUE db, VALUE n, VALUE handler )
+{
+  db_handle *handle;
+  int        interval;
+
+  GetDBHandle( handle, db );
+  static_check_reading_ahead( handle );
+  interval = NUM2INT( n );
+
+  if( handler == Qnil || interval <= 0 )
+  {
+    sqlite_progress_handler( handle->db, 0, NULL, NULL );
+    handle->progress = Qnil;
+    handle->progress_interval = 0;
+    rb_ivar_set( db, idProgress, Qnil );
+    return Qnil;
+  }
+
+  if( !rb_obj_is_kind_of( handler, rb_cProc ) )
+  {
+    rb_raise( rb_eArgError, "handler must be a proc" );
+  }
+
+  /* the ivar keeps the handler from being collected */
+  rb_ivar_set( db, idProgress, handler );
+  handle->progress = handler;
+  handle->progress_interval = interval;
+  sqlite_progress_handler( handle->db, interval, static_progress_handler,
+    (void*)handle );
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     enable_match( db ) -> nil
+ *
+ * Registers a native <tt>match( text, query )</tt> function with the given
+ * database. Both arguments are split into words (runs of letters and
+ * digits, compared without regard to case). The function returns the
+ * number of times the words of +query+ occur in +text+ if every one of
+ * them does, and 0 otherwise (or NULL if either argument is NULL), so that
+ * it may be used both to filter rows and to rank them. It reads the text of
+ * every row it is given; see #fts_search for searching an index instead.
+ */
+static VALUE
+static_api_enable_match( VALUE module, VALUE db )
+{
+  sqlite *handle;
+  int     result;
+
+  GetIdleDB( handle, db );
+
+  result = sqlite_create_function( handle, "match", 2,
+              static_fts_match_function, NULL );
+
+  if( result == SQLITE_OK )
+    result = sqlite_function_type( handle, "match", SQLITE_NUMERIC );
+
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error( result, "create function match(2)" );
+    /* "raise" does not return */
+  }
+
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *     fts_sync( db, table, columns ) -> fixnum
+ *
+ * Brings the full-text index of the given table up to date, by indexing
+ * again each of the documents (rows) listed in the table's
+ * <tt>_fts_pending</tt> table, which is filled by the triggers that
+ * Database#create_fts_index creates. The words of the given columns of
+ * each document are merged into the posting lists of the
+ * <tt>_fts_terms</tt> table, and are recorded in the <tt>_fts_docs</tt>
+ * table so that they can be taken out of those lists again when the
+ * document changes. The caller should run this inside a transaction.
+ *
+ * Returns the number of documents that were indexed again.
+ */
+static VALUE
+static_api_fts_sync( VALUE module, VALUE db, VALUE table, VALUE columns )
+{
+  db_handle      *handle;
+  fts_sync_state  state;
+  int             index;
+
+  GetDBHandle( handle, db );
+  static_check_reading_ahead( handle );
+  Check_Type( table, T_STRING );
+  Check_Type( columns, T_ARRAY );
+
+  if( RARRAY(columns)->len == 0 )
+    rb_raise( rb_eArgError, "no columns given" );
+  for( index = 0; index < RARRAY(columns)->len; index++ )
+    Check_Type( RARRAY(columns)->ptr[index], T_STRING );
+
+  MEMZERO( &state, fts_sync_state, 1 );
+  state.db = handle->db;
+  state.table = table;
+  state.columns = columns;
+
+  return rb_ensure( static_fts_sync_body, (VALUE)&state,
+                    static_fts_sync_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     fts_search( db, table, query ) -> array
+ *
+ * Searches the full-text index of the given table for the documents that
+ * hold every word of +query+, and returns them as <tt>[ rowid, score ]</tt>
+ * pairs, best match first. The score of a document is the sum, over the
+ * words of the query, of <tt>(1 + log(occurrences)) * log(1 +
+ * documents / documents holding the word)</tt>, so that words that are
+ * repeated in the document, and words that are rare in the index, count
+ * for more. The index is searched as it is; see #fts_sync.
+ */
+static VALUE
+static_api_fts_search( VALUE module, VALUE db, VALUE table, VALUE query )
+{
+  db_handle        *handle;
+  fts_search_state  state;
+
+  GetDBHandle( handle, db );
+  static_check_reading_ahead( handle );
+  Check_Type( table, T_STRING );
+  Check_Type( query, T_STRING );
+
+  MEMZERO( &state, fts_search_state, 1 );
+  state.db = handle->db;
+  state.table = table;
+  state.query = query;
+
+  return rb_ensure( static_fts_search_body, (VALUE)&state,
+                    static_fts_search_cleanup, (VALUE)&state );
+}
+
+/**
+ * call-seq:
+ *     enable_compression( db ) -> nil
+ *
+ * Registers the native functions <tt>compress( text )</tt> and
+ * <tt>uncompress( text )</tt> with the given database. +compress+ deflates
+ * its argument with zlib, and encodes the result with
+ * +sqlite_encode_binary+ so that it can be stored as text; +uncompress+
+ * reverses this. Both return NULL for a NULL argument, and +uncompress+
+ * reports an error if its argument was not produced by +compress+.
+ *
+ * Raises NotImplementedError if the extension was built without zlib.
+ */
+static VALUE
+static_api_enable_compression( VALUE module, VALUE db )
+{
+#ifdef HAVE_ZLIB_H
+  sqlite *handle;
+  int     result;
+
+  GetIdleDB( handle, db );
+
+  result = sqlite_create_function( handle, "compress", 1,
+              static_compress_function, NULL );
+  if( result == SQLITE_OK )
+    result = sqlite_function_type( handle, "compress", SQLITE_TEXT );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error( result, "create function compress(1)" );
+    /* "raise" does not return */
+  }
+
+  result = sqlite_create_function( handle, "uncompress", 1,
+              static_uncompress_function, NULL );
+  if( result == SQLITE_OK )
+    result = sqlite_function_type( handle, "uncompress", SQLITE_TEXT );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error( result, "create function uncompress(1)" );
+    /* "raise" does not return */
+  }
+
+  return Qnil;
+#else
+  rb_notimplement();
+  return Qnil;
+#endif
+}
+
+/*>=-----------------------------------------------------------------------=<*
+ * PRIVATE FUNCTION IMPLEMENTATIONS
+ * ------------------------------------------------------------------------
+ * Here are the implementations of the functions declared previously.
+ *>=-----------------------------------------------------------------------=<*/
+NO_RDOC
+
 /*
- * Document-class: SQLite::Exceptions::MismatchException
+ * Document-class: SQLite::Exceptions
+ *
+ * This module contains all exceptions thrown by SQLite routines.
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::DatabaseException
+ *
+ * This is the root of the SQLite exception hierarchy. This exception will
+ * be thrown for any general errors, or for exceptions for which SQLite itself
+ * did not declare a specific error code.
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::SQLException
  *
  * From the SQLite documentation:
  *
- * "This error occurs when there is an attempt to insert non-integer data into
- * a column labeled INTEGER PRIMARY KEY. For most columns, SQLite ignores the
- * data type and allows any kind of data to be stored. But an INTEGER PRIMARY
- * KEY column is only allowed to store integer data."
+ * "This return value indicates that there was an error in the SQL that was
+ * passed into the sqlite_exec."
  */
 
 /*
- * Document-class: SQLite::Exceptions::MisuseException
+ * Document-class: SQLite::Exceptions::InternalException
  *
  * From the SQLite documentation:
  *
- * "This error might occur if one or more of the SQLite API routines is used
- * incorrectly. Examples of incorrect usage include calling sqlite_exec after
- * the database has been closed using sqlite_close or calling sqlite_exec with
- * the same database pointer simultaneously from two separate threads."
+ * "This value indicates that an internal consistency check within the SQLite
+ * library failed. This can only happen if there is a bug in the SQLite library.
+ * If you ever get an SQLITE_INTERNAL reply from an sqlite_exec call, please
+ * report the problem on the SQLite mailing list."
  */
 
 /*
- * Document-class: SQLite::Exceptions::UnsupportedOSFeatureException
+ * Document-class: SQLite::Exceptions::PermissionsException
  *
  * From the SQLite documentation:
  *
- * "This error means that you have attempts to create or access a file
- * database file that is larger that 2GB on a legacy Unix machine that
- * lacks large file support."
+ * "This return value says that the access permissions on the database file are
+ * such that the file cannot be opened."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::AbortException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if the callback function returns non-zero."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::BusyException
+ *
+ * From the SQLite documentation:
+ *
+ * "This return code indicates that another program or thread has the database
+ * locked. SQLite allows two or more threads to read the database at the same
+ * time, but only one thread can have the database open for writing at the same
+ * time. Locking in SQLite is on the entire database."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::LockedException
+ *
+ * From the SQLite documentation:
+ *
+ * "This return code is similar to SQLITE_BUSY in that it indicates that the
+ * database is locked. But the source of the lock is a recursive call to
+ * sqlite_exec. This return can only occur if you attempt to invoke sqlite_exec
+ * from within a callback routine of a query from a prior invocation of
+ * sqlite_exec. Recursive calls to sqlite_exec are allowed as long as they do
+ * not attempt to write the same table."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::OutOfMemoryException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if a call to malloc fails."
  */
 
-/*
- * Document-class: SQLite::Exceptions::AuthorizationException
- *
- * From the SQLite documentation:
- *
- * "This error indicates that the authorizer callback has disallowed the SQL
- * you are attempting to execute."
- */
+/*
+ * Document-class: SQLite::Exceptions::ReadOnlyException
+ *
+ * From the SQLite documentation:
+ *
+ * "This return code indicates that an attempt was made to write to a database
+ * file that is opened for reading only."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::InterruptException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if a call to sqlite_interrupt interrupts a database
+ * operation in progress."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::IOErrorException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if the operating system informs SQLite that it is
+ * unable to perform some disk I/O operation. This could mean that there is no
+ * more space left on the disk."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::CorruptException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if SQLite detects that the database it is working on
+ * has become corrupted. Corruption might occur due to a rogue process writing
+ * to the database file or it might happen due to an perviously (sic) undetected
+ * logic error in of SQLite. This value is also returned if a disk I/O error
+ * occurs in such a way that SQLite is forced to leave the database file in a
+ * corrupted state. The latter should only happen due to a hardware or operating
+ * system malfunction."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::NotFoundException
+ *
+ * From the SQLite documentation:
+ *
+ * "(Internal Only) Table or record not found."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::FullException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if an insertion failed because there is no space
+ * left on the disk, or the database is too big to hold any more information.
+ * The latter case should only occur for databases that are larger than 2GB in
+ * size."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::CantOpenException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if the database file could not be opened for some
+ * reason."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::ProtocolException
+ *
+ * From the SQLite documentation:
+ *
+ * "This value is returned if some other process is messing with file locks and
+ * has violated the file locking protocol that SQLite uses on its rollback
+ * journal files."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::EmptyException
+ *
+ * From the SQLite documentation:
+ *
+ * "(Internal Only) Database table is empty"
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::SchemaChangedException
+ *
+ * From the SQLite documentation:
+ *
+ * "When the database first opened, SQLite reads the database schema into
+ * memory and uses that schema to parse new SQL statements. If another process
+ * changes the schema, the command currently being processed will abort because
+ * the virtual machine code generated assumed the old schema. This is the
+ * return code for such cases. Retrying the command usually will clear the
+ * problem."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::TooBigException
+ *
+ * From the SQLite documentation:
+ *
+ * "SQLite will not store more than about 1 megabyte of data in a single row of
+ * a single table. If you attempt to store more than 1 megabyte in a single
+ * row, this is the return code you get."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::ConstraintException
+ *
+ * From the SQLite documentation:
+ *
+ * "This constant is returned if the SQL statement would have violated a
+ * database constraint."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::MismatchException
+ *
+ * From the SQLite documentation:
+ *
+ * "This error occurs when there is an attempt to insert non-integer data into
+ * a column labeled INTEGER PRIMARY KEY. For most columns, SQLite ignores the
+ * data type and allows any kind of data to be stored. But an INTEGER PRIMARY
+ * KEY column is only allowed to store integer data."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::MisuseException
+ *
+ * From the SQLite documentation:
+ *
+ * "This error might occur if one or more of the SQLite API routines is used
+ * incorrectly. Examples of incorrect usage include calling sqlite_exec after
+ * the database has been closed using sqlite_close or calling sqlite_exec with
+ * the same database pointer simultaneously from two separate threads."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::UnsupportedOSFeatureException
+ *
+ * From the SQLite documentation:
+ *
+ * "This error means that you have attempts to create or access a file
+ * database file that is larger that 2GB on a legacy Unix machine that
+ * lacks large file support."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::AuthorizationException
+ *
+ * From the SQLite documentation:
+ *
+ * "This error indicates that the authorizer callback has disallowed the SQL
+ * you are attempting to execute."
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::FormatException
+ *
+ * From the SQLite documentation:
+ *
+ * "Auxiliary database format error"
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::RangeException
+ *
+ * From the SQLite documentation:
+ *
+ * "2nd parameter to sqlite_bind out of range"
+ */
+
+/*
+ * Document-class: SQLite::Exceptions::NotADatabaseException
+ *
+ * From the SQLite documentation:
+ *
+ * "File opened that is not a database file"
+ */
+
+static void
+static_configure_exception_classes()
+{
+  int i;
+
+  for( i = 1; g_sqlite_exceptions[ i ].name != NULL; i++ )
+  {
+    char name[ 128 ];
+
+    sprintf( name, "%sException", g_sqlite_exceptions[ i ].name );
+    g_sqlite_exceptions[ i ].object = rb_define_class_under( mExceptions, name, DatabaseException );
+  }
+}
+
+static void
+static_raise_db_error( int code, char *msg, ... )
+{
+  va_list args;
+  char message[ 2048 ];
+  VALUE exc;
+
+  va_start( args, msg );
+  vsnprintf( message, sizeof( message ), msg, args );
+  va_end( args );
+
+  exc = ( code <= 0 ? DatabaseException : g_sqlite_exceptions[ code ].object );
+
+  rb_raise( exc, message );
+}
+
+static void
+static_raise_db_error2( int code, char **msg )
+{
+  VALUE err = rb_str_new2( *msg ? *msg : "(no message)" );
+  if( *msg ) free( *msg );
+  *msg = NULL;
+
+  static_raise_db_error( code, "%s", STR2CSTR( err ) );
+}
+
+static void
+static_free_db( db_handle *handle )
+{
+  static_close_db( handle );
+  xfree( handle );
+}
+
+/* Finalizes any virtual machines still open on the given database, and then
+ * closes it. The handles of those machines are detached from the database,
+ * so that it does not matter which of them is garbage collected first. */
+static void
+static_close_db( db_handle *handle )
+{
+  vm_handle *statement;
+
+  if( handle->db == NULL )
+    return;
+
+#ifdef HAVE_PTHREAD_H
+  /* stop any read-ahead thread before anything else touches the database,
+   * since the statements are finalized newest first */
+  for( statement = handle->statements;
+       statement != NULL;
+       statement = statement->next )
+  {
+    if( statement->ahead != NULL )
+      static_stop_read_ahead( statement );
+  }
+#endif
+
+  static_finish_deferred( handle );
+
+  while( handle->statements != NULL )
+  {
+    statement = handle->statements;
+    static_release_vm( statement, NULL );
+  }
+
+  sqlite_close( handle->db );
+  handle->db = NULL;
+
+  if( handle->prev != NULL )
+    handle->prev->next = handle->next;
+  else
+    open_databases = handle->next;
+
+  if( handle->next != NULL )
+    handle->next->prev = handle->prev;
+}
+
+static void
+static_mark_vm( vm_handle *handle )
+{
+  rb_gc_mark( handle->sql );
+  rb_gc_mark( handle->backtrace );
+}
+
+static void
+static_free_vm( vm_handle *handle )
+{
+  if( handle->vm != NULL )
+  {
+    /* finalizing would touch the connection while a producer thread is
+     * stepping another of its machines, so that is left until the producer
+     * has stopped */
+    if( handle->ahead == NULL && handle->db != NULL &&
+        handle->db->reading_ahead )
+    {
+      static_defer_release( handle );
+      return;
+    }
+
+    static_release_vm( handle, NULL );
+  }
+
+  xfree( handle );
+}
+
+/* Removes the (garbage collected) handle from the list of its database's
+ * open statements, and puts it on the database's list of handles whose
+ * vms are to be finalized by static_finish_deferred. */
+static void
+static_defer_release( vm_handle *handle )
+{
+  db_handle *db = handle->db;
+
+  if( handle->prev != NULL )
+    handle->prev->next = handle->next;
+  else
+    db->statements = handle->next;
+
+  if( handle->next != NULL )
+    handle->next->prev = handle->prev;
+
+  handle->prev = NULL;
+  handle->next = db->deferred;
+  db->deferred = handle;
+}
+
+/* Finalizes the vms of the handles deferred by static_defer_release, and
+ * frees the handles. */
+static void
+static_finish_deferred( db_handle *db )
+{
+  vm_handle *handle;
+
+  while( db->deferred != NULL )
+  {
+    handle = db->deferred;
+    db->deferred = handle->next;
+
+    sqlite_finalize( handle->vm, NULL );
+    xfree( handle );
+  }
+}
+
+/* Finalizes the vm of the given handle, and removes it from the list of
+ * its database's open statements. If +errmsg+ is NULL, any error message is
+ * discarded. */
+static int
+static_release_vm( vm_handle *handle, char **errmsg )
+{
+  db_handle *db = handle->db;
+  char      *msg = NULL;
+  int        result;
+
+#ifdef HAVE_PTHREAD_H
+  if( handle->ahead != NULL )
+    static_stop_read_ahead( handle );
+#endif
+
+  result = sqlite_finalize( handle->vm, &msg );
+  handle->vm = NULL;
+
+  if( errmsg != NULL )
+    *errmsg = msg;
+  else if( msg != NULL )
+    sqlite_freemem( msg );
+
+  if( handle->prev != NULL )
+    handle->prev->next = handle->next;
+  else if( db != NULL )
+    db->statements = handle->next;
+
+  if( handle->next != NULL )
+    handle->next->prev = handle->prev;
+
+  handle->db = NULL;
+  handle->prev = handle->next = NULL;
+
+  return result;
+}
+
+static double
+static_now()
+{
+  struct timeval now;
+
+  gettimeofday( &now, NULL );
+  return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+/* Warns (once) about each cursor, on any open database that has a lock
+ * warning set, that has been holding its lock for longer than allowed. This
+ * is called whenever a statement is compiled, and whenever a lock could not
+ * be obtained. */
+static void
+static_check_locks()
+{
+  db_handle *db;
+  vm_handle *statement;
+  double     now = 0;
+
+  for( db = open_databases; db != NULL; db = db->next )
+  {
+    if( db->lock_warning <= 0 )
+      continue;
+
+    for( statement = db->statements;
+         statement != NULL;
+         statement = statement->next )
+    {
+      if( statement->locked_at == 0 || statement->warned )
+        continue;
+
+      if( now == 0 )
+        now = static_now();
+
+      if( now - statement->locked_at < db->lock_warning )
+        continue;
+
+      statement->warned = 1;
+      if( statement->backtrace != Qnil &&
+          RARRAY(statement->backtrace)->len > 0 )
+      {
+        rb_warn( "SQLite cursor has held a lock for %ld ms: %s (from %s)",
+          (long)( now - statement->locked_at ),
+          STR2CSTR( statement->sql ),
+          STR2CSTR( RARRAY(statement->backtrace)->ptr[0] ) );
+      }
+      else
+      {
+        rb_warn( "SQLite cursor has held a lock for %ld ms: %s",
+          (long)( now - statement->locked_at ),
+          STR2CSTR( statement->sql ) );
+      }
+    }
+  }
+}
+
+static VALUE
+static_busy_handler_body( VALUE data )
+{
+  busy_call *call = (busy_call*)data;
+
+  return rb_funcall( call->db->busy, idCall, 2, rb_str_new2( call->entity ),
+    INT2FIX( call->times ) );
+}
+
+static VALUE
+static_handler_cleanup( VALUE data )
+{
+  db_handle *db = (db_handle*)data;
+
+  db->in_handler--;
+  return Qnil;
+}
+
+/* Invokes the Ruby busy handler. The database is marked as being in a
+ * handler meanwhile (see static_check_reading_ahead), since the handler may
+ * let another thread run while SQLite is in the middle of a statement. */
+static int
+static_busy_handler( void* cookie, const char *entity, int times )
+{
+  busy_call call;
+  VALUE     result;
+
+  static_check_locks();
+
+  call.db = (db_handle*)cookie;
+  call.entity = entity;
+  call.times = times;
+
+  call.db->in_handler++;
+  result = rb_ensure( static_busy_handler_body, (VALUE)&call,
+                      static_handler_cleanup, (VALUE)call.db );
+
+  if( result == Qnil || result == Qfalse )
+    return 0;
+
+  return 1;
+}
+
+static VALUE
+static_protected_function_callback( VALUE args )
+{
+  VALUE proc;
+  VALUE proc_args;
+
+  proc = rb_ary_entry( args, 0 );
+  proc_args = rb_ary_entry( args, 1 );
+
+  rb_apply( proc, idCall, proc_args );
+  
+  return Qnil;
+}
+
+static void
+static_function_callback( sqlite_func *func, int argc, const char **argv )
+{
+  VALUE proc;
+  VALUE args;
+  VALUE protect_args;
+  int   index;
+  int   exception = 0;
+
+  proc = (VALUE)sqlite_user_data( func );
+  if( TYPE(proc) == T_ARRAY )
+    proc = rb_ary_entry( proc, 0 );
+
+  args = rb_ary_new2( argc + 1 );
+  rb_ary_push( args, Data_Wrap_Struct( rb_cData, NULL, NULL, func ) );
+
+  for( index = 0; index < argc; index++ )
+  {
+    VALUE entry = Qnil;
+
+    if( argv[index] )
+      entry = rb_str_new2( argv[index] );
+
+    rb_ary_push( args, entry );
+  }
+
+  protect_args = rb_ary_new3( 2, proc, args );
+  rb_protect( static_protected_function_callback,
+              protect_args,
+              &exception );
+
+  if( exception )
+  {
+    sqlite_set_result_error( func, "error occurred while processing function", -1 );
+  }
+}
+
+static void
+static_aggregate_finalize_callback( sqlite_func *func )
+{
+  VALUE  proc;
+  VALUE  args;
+  VALUE  protect_args;
+  int    exception = 0;
+
+  proc = rb_ary_entry( (VALUE)sqlite_user_data( func ), 1 );
+  args = rb_ary_new3( 1, Data_Wrap_Struct( rb_cData, NULL, NULL, func ) );
+
+  protect_args = rb_ary_new3( 2, proc, args );
+
+  rb_protect( static_protected_function_callback,
+              protect_args,
+              &exception );
+
+  if( exception )
+  {
+    sqlite_set_result_error( func, "error occurred while processing aggregate finalize", -1 );
+  }
+}
+
+#ifdef HAVE_REGEX_H
+
+static unsigned long
+static_regexp_hash( const char *pattern )
+{
+  unsigned long hash = 5381;
+
+  while( *pattern )
+    hash = ( ( hash << 5 ) + hash ) + (unsigned char)*pattern++;
+
+  return hash;
+}
+
+static void
+static_regexp_cache_unlink( regexp_cache *cache, regexp_entry *entry )
+{
+  if( entry->prev ) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+
+  if( entry->next ) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+
+  entry->prev = entry->next = NULL;
+}
+
+static void
+static_regexp_cache_push( regexp_cache *cache, regexp_entry *entry )
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+
+  if( cache->head ) cache->head->prev = entry;
+  cache->head = entry;
+
+  if( cache->tail == NULL ) cache->tail = entry;
+}
+
+static void
+static_regexp_cache_remove( regexp_cache *cache, regexp_entry *entry )
+{
+  regexp_entry **link;
+
+  link = &cache->buckets[ entry->hash % REGEXP_CACHE_BUCKETS ];
+  while( *link != entry )
+    link = &(*link)->chain;
+  *link = entry->chain;
+
+  static_regexp_cache_unlink( cache, entry );
+
+  regfree( &entry->compiled );
+  free( entry->pattern );
+  free( entry );
+
+  cache->size--;
+}
+
+static void
+static_regexp_cache_trim( regexp_cache *cache, int capacity )
+{
+  while( cache->size > capacity )
+  {
+    static_regexp_cache_remove( cache, cache->tail );
+    cache->evictions++;
+  }
+}
+
+static void
+static_free_regexp_cache( regexp_cache *cache )
+{
+  static_regexp_cache_trim( cache, 0 );
+  free( cache );
+}
+
+static regexp_entry*
+static_regexp_cache_fetch( regexp_cache *cache, const char *pattern,
+  char *errbuf, int errlen )
+{
+  regexp_entry  *entry;
+  unsigned long  hash;
+  int            result;
+
+  hash = static_regexp_hash( pattern );
+
+  for( entry = cache->buckets[ hash % REGEXP_CACHE_BUCKETS ];
+       entry != NULL;
+       entry = entry->chain )
+  {
+    if( entry->hash == hash && strcmp( entry->pattern, pattern ) == 0 )
+    {
+      cache->hits++;
+      if( entry != cache->head )
+      {
+        static_regexp_cache_unlink( cache, entry );
+        static_regexp_cache_push( cache, entry );
+      }
+      return entry;
+    }
+  }
+
+  cache->misses++;
+
+  entry = (regexp_entry*)malloc( sizeof( regexp_entry ) );
+  if( entry == NULL )
+  {
+    snprintf( errbuf, errlen, "out of memory" );
+    return NULL;
+  }
+
+  result = regcomp( &entry->compiled, pattern, REG_EXTENDED | REG_NOSUB );
+  if( result != 0 )
+  {
+    regerror( result, &entry->compiled, errbuf, errlen );
+    free( entry );
+    return NULL;
+  }
+
+  entry->pattern = strdup( pattern );
+  if( entry->pattern == NULL )
+  {
+    regfree( &entry->compiled );
+    free( entry );
+    snprintf( errbuf, errlen, "out of memory" );
+    return NULL;
+  }
+
+  entry->hash = hash;
+  entry->chain = cache->buckets[ hash % REGEXP_CACHE_BUCKETS ];
+  cache->buckets[ hash % REGEXP_CACHE_BUCKETS ] = entry;
+
+  static_regexp_cache_push( cache, entry );
+  cache->size++;
+
+  static_regexp_cache_trim( cache, cache->capacity );
+
+  return entry;
+}
+
+static void
+static_regexp_function( sqlite_func *func, int argc, const char **argv )
+{
+  regexp_cache *cache;
+  regexp_entry *entry;
+  char          errbuf[ 256 ];
+
+  if( argv[0] == NULL || argv[1] == NULL )
+  {
+    sqlite_set_result_string( func, NULL, -1 );
+    return;
+  }
+
+  cache = (regexp_cache*)sqlite_user_data( func );
+  entry = static_regexp_cache_fetch( cache, argv[0], errbuf, sizeof(errbuf) );
+
+  if( entry == NULL )
+  {
+    sqlite_set_result_error( func, errbuf, -1 );
+    return;
+  }
+
+  sqlite_set_result_int( func,
+    regexec( &entry->compiled, argv[1], 0, NULL, 0 ) == 0 );
+}
+
+#endif
+
+/* Builds the statement used to copy rows of +table+, naming the rowid
+ * followed by every column reported by "PRAGMA table_info" on +src+, so that
+ * tables without an INTEGER PRIMARY KEY keep their rowids too. On success
+ * +sql+ must be released with sqlite_freemem. */
+static int
+static_insert_sql( sqlite *src, const char *table, char **sql,
+  char **errmsg )
+{
+  sqlite_vm   *vm = NULL;
+  const char **values;
+  const char **metadata;
+  const char  *tail;
+  char        *names;
+  char        *placeholders;
+  char        *text;
+  int          columns;
+  int          result;
+
+  *sql = NULL;
+  names = sqlite_mprintf( "_ROWID_" );
+  placeholders = sqlite_mprintf( "?" );
+
+  text = sqlite_mprintf( "PRAGMA table_info('%q')", table );
+  result = sqlite_compile( src, text, &tail, &vm, errmsg );
+  sqlite_freemem( text );
+
+  while( result == SQLITE_OK && names != NULL && placeholders != NULL )
+  {
+    result = sqlite_step( vm, &columns, &values, &metadata );
+    if( result != SQLITE_ROW )
+      break;
+
+    text = sqlite_mprintf( "%s,'%q'", names, values[1] );
+    sqlite_freemem( names );
+    names = text;
+
+    text = sqlite_mprintf( "%s,?", placeholders );
+    sqlite_freemem( placeholders );
+    placeholders = text;
+
+    result = SQLITE_OK;
+  }
+
+  if( result == SQLITE_DONE )
+    result = SQLITE_OK;
+  if( result == SQLITE_OK && ( names == NULL || placeholders == NULL ) )
+    result = SQLITE_NOMEM;
+
+  result = static_finalize_vm( vm, result, errmsg );
+
+  if( result == SQLITE_OK )
+  {
+    *sql = sqlite_mprintf( "INSERT INTO '%q' (%s) VALUES(%s)",
+      table, names, placeholders );
+    if( *sql == NULL )
+      result = SQLITE_NOMEM;
+  }
+
+  if( names != NULL )
+    sqlite_freemem( names );
+  if( placeholders != NULL )
+    sqlite_freemem( placeholders );
+
+  return result;
+}
+
+/* Finalizes the given VM (if any). If +result+ indicates an error that has
+ * not been described yet, the message reported by the VM is stored in
+ * +errmsg+. Returns the (possibly updated) result code. */
+static int
+static_finalize_vm( sqlite_vm *vm, int result, char **errmsg )
+{
+  char *msg = NULL;
+  int   code;
+
+  if( vm == NULL )
+    return result;
+
+  code = sqlite_finalize( vm, &msg );
+
+  if( result == SQLITE_OK || result == SQLITE_DONE || result == SQLITE_ROW )
+    result = code;
+
+  if( result != SQLITE_OK && *errmsg == NULL )
+    *errmsg = msg;
+  else if( msg != NULL )
+    free( msg );
+
+  return result;
+}
+
+static int
+static_copy_table( sqlite *src, sqlite *dst, const char *table,
+  char **errmsg )
+{
+  sqlite_vm   *reader = NULL;
+  sqlite_vm   *writer = NULL;
+  const char **values;
+  const char **metadata;
+  const char **ignored;
+  const char  *tail;
+  char        *sql;
+  int          columns;
+  int          count;
+  int          result;
+  int          index;
+
+  /* the rowid is copied explicitly: an INSERT without it would renumber
+   * tables that have no INTEGER PRIMARY KEY, and anything referring to
+   * those rows by rowid (such as a full-text index) would go stale */
+  sql = sqlite_mprintf( "SELECT _ROWID_, * FROM '%q'", table );
+  result = sqlite_compile( src, sql, &tail, &reader, errmsg );
+  sqlite_freemem( sql );
+
+  while( result == SQLITE_OK )
+  {
+    result = sqlite_step( reader, &columns, &values, &metadata );
+    if( result != SQLITE_ROW )
+      break;
+
+    if( writer == NULL )
+    {
+      result = static_insert_sql( src, table, &sql, errmsg );
+      if( result != SQLITE_OK )
+        break;
+
+      result = sqlite_compile( dst, sql, &tail, &writer, errmsg );
+      sqlite_freemem( sql );
+      if( result != SQLITE_OK )
+        break;
+    }
+
+    /* the reader's values stay valid until it is stepped again, so there
+     * is no need to have SQLite copy them */
+    for( index = 0, result = SQLITE_OK;
+         index < columns && result == SQLITE_OK;
+         index++ )
+    {
+      result = sqlite_bind( writer, index+1, values[index], -1, 0 );
+    }
+    if( result != SQLITE_OK )
+      break;
+
+    result = sqlite_step( writer, &count, &ignored, &metadata );
+    if( result != SQLITE_DONE )
+      break;
+
+    result = sqlite_reset( writer, errmsg );
+  }
+
+  if( result == SQLITE_DONE )
+    result = SQLITE_OK;
+
+  result = static_finalize_vm( writer, result, errmsg );
+  result = static_finalize_vm( reader, result, errmsg );
+
+  return result;
+}
+
+/* Reads the persistent schema of the given database into +schema+, as a flat
+ * array of [ type, name, sql ] triples in creation order. */
+static int
+static_read_schema( sqlite *db, VALUE schema, char **errmsg )
+{
+  sqlite_vm   *vm = NULL;
+  const char **values;
+  const char **metadata;
+  const char  *tail;
+  int          columns;
+  int          result;
+
+  result = sqlite_compile( db,
+    "SELECT type, name, sql FROM sqlite_master "
+    "WHERE sql NOT NULL AND name NOT LIKE 'sqlite_%' ORDER BY rowid",
+    &tail, &vm, errmsg );
+
+  while( result == SQLITE_OK )
+  {
+    result = sqlite_step( vm, &columns, &values, &metadata );
+    if( result != SQLITE_ROW )
+      break;
+
+    rb_ary_push( schema, rb_str_new2( values[0] ) );
+    rb_ary_push( schema, rb_str_new2( values[1] ) );
+    rb_ary_push( schema, rb_str_new2( values[2] ) );
+    result = SQLITE_OK;
+  }
+
+  if( result == SQLITE_DONE )
+    result = SQLITE_OK;
+
+  return static_finalize_vm( vm, result, errmsg );
+}
+
+static int
+static_copy_database( sqlite *src, sqlite *dst, char **errmsg )
+{
+  VALUE schema;
+  long  index;
+  int   began;
+  int   result;
+
+  schema = rb_ary_new();
+
+  /* reading inside a transaction gives a consistent snapshot, but the source
+   * may already be in a transaction of its own, which is just as good */
+  began = ( sqlite_exec( src, "BEGIN", NULL, NULL, NULL ) == SQLITE_OK );
+
+  result = sqlite_exec( dst, "BEGIN", NULL, NULL, errmsg );
+  if( result != SQLITE_OK )
+  {
+    if( began ) sqlite_exec( src, "COMMIT", NULL, NULL, NULL );
+    return result;
+  }
+
+  result = static_read_schema( src, schema, errmsg );
+
+  /* tables and their data first... */
+  for( index = 0; result == SQLITE_OK && index < RARRAY(schema)->len;
+       index += 3 )
+  {
+    if( strcmp( STR2CSTR( RARRAY(schema)->ptr[index] ), "table" ) != 0 )
+      continue;
+
+    result = sqlite_exec( dst, STR2CSTR( RARRAY(schema)->ptr[index+2] ),
+      NULL, NULL, errmsg );
+    if( result == SQLITE_OK )
+      result = static_copy_table( src, dst,
+        STR2CSTR( RARRAY(schema)->ptr[index+1] ), errmsg );
+  }
+
+  /* ...then indexes, views and triggers, in their original order */
+  for( index = 0; result == SQLITE_OK && index < RARRAY(schema)->len;
+       index += 3 )
+  {
+    if( strcmp( STR2CSTR( RARRAY(schema)->ptr[index] ), "table" ) == 0 )
+      continue;
+
+    result = sqlite_exec( dst, STR2CSTR( RARRAY(schema)->ptr[index+2] ),
+      NULL, NULL, errmsg );
+  }
+
+  if( result == SQLITE_OK )
+    result = sqlite_exec( dst, "COMMIT", NULL, NULL, errmsg );
+  else
+    sqlite_exec( dst, "ROLLBACK", NULL, NULL, NULL );
+
+  if( began ) sqlite_exec( src, "COMMIT", NULL, NULL, NULL );
+
+  return result;
+}
+
+static void
+static_buffer_flush( output_buffer *buffer )
+{
+  static ID idWrite = 0;
+
+  if( buffer->length == 0 )
+    return;
+
+  if( !idWrite ) idWrite = rb_intern( "write" );
+
+  rb_funcall( buffer->io, idWrite, 1,
+    rb_str_new( buffer->data, buffer->length ) );
+  buffer->length = 0;
+}
+
+static void
+static_buffer_append( output_buffer *buffer, const char *text, long length )
+{
+  while( length > 0 )
+  {
+    long room = OUTPUT_BUFFER_SIZE - buffer->length;
+    long count = ( length < room ? length : room );
+
+    memcpy( buffer->data + buffer->length, text, count );
+    buffer->length += count;
+    text += count;
+    length -= count;
+
+    if( buffer->length == OUTPUT_BUFFER_SIZE )
+      static_buffer_flush( buffer );
+  }
+}
+
+/* Appends the given value as an SQL literal: NULL, a bare integer, or a
+ * single-quoted string with embedded quotes doubled. */
+static void
+static_buffer_append_quoted( output_buffer *buffer, const char *value )
+{
+  const char *p;
+  const char *start;
+
+  if( value == NULL )
+  {
+    static_buffer_append( buffer, "NULL", 4 );
+    return;
+  }
+
+  /* integers without leading zeros read back exactly, so they need no
+   * quoting */
+  p = value;
+  if( *p == '-' ) p++;
+  if( *p >= '1' && *p <= '9' )
+  {
+    while( *p >= '0' && *p <= '9' ) p++;
+  }
+  else if( *p == '0' )
+  {
+    p++;
+  }
+  else
+  {
+    p = NULL;
+  }
+
+  if( p != NULL && *p == '\0' )
+  {
+    static_buffer_append( buffer, value, p - value );
+    return;
+  }
+
+  static_buffer_append( buffer, "'", 1 );
+  for( start = p = value; *p; p++ )
+  {
+    if( *p == '\'' )
+    {
+      static_buffer_append( buffer, start, p - start + 1 );
+      start = p;
+    }
+  }
+  static_buffer_append( buffer, start, p - start );
+  static_buffer_append( buffer, "'", 1 );
+}
+
+static VALUE
+static_dump_body( VALUE data )
+{
+  dump_state  *state = (dump_state*)data;
+  VALUE        schema;
+  const char **values;
+  const char **metadata;
+  const char  *tail;
+  char        *errmsg = NULL;
+  char        *sql;
+  long         index;
+  int          columns;
+  int          column;
+  int          result;
+
+  state->began = ( sqlite_exec( state->db, "BEGIN", NULL, NULL, NULL )
+                   == SQLITE_OK );
+
+  schema = rb_ary_new();
+  result = static_read_schema( state->db, schema, &errmsg );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  static_buffer_append( &state->out, "BEGIN TRANSACTION;\n", 19 );
+
+  for( index = 0; index < RARRAY(schema)->len; index += 3 )
+  {
+    char *type = STR2CSTR( RARRAY(schema)->ptr[index] );
+    char *name = STR2CSTR( RARRAY(schema)->ptr[index+1] );
+
+    if( strcmp( type, "table" ) != 0 )
+      continue;
+
+    static_buffer_append( &state->out, STR2CSTR( RARRAY(schema)->ptr[index+2] ),
+      RSTRING( RARRAY(schema)->ptr[index+2] )->len );
+    static_buffer_append( &state->out, ";\n", 2 );
+
+    sql = sqlite_mprintf( "SELECT * FROM '%q'", name );
+    result = sqlite_compile( state->db, sql, &tail, &state->vm, &errmsg );
+    sqlite_freemem( sql );
+    if( result != SQLITE_OK )
+    {
+      static_raise_db_error2( result, &errmsg );
+      /* "raise" does not return */
+    }
+
+    state->insert = sqlite_mprintf( "INSERT INTO '%q' VALUES(", name );
+
+    while( ( result = sqlite_step( state->vm, &columns, &values, &metadata ) )
+           == SQLITE_ROW )
+    {
+      static_buffer_append( &state->out, state->insert,
+        strlen( state->insert ) );
+      for( column = 0; column < columns; column++ )
+      {
+        if( column > 0 )
+          static_buffer_append( &state->out, ",", 1 );
+        static_buffer_append_quoted( &state->out, values[column] );
+      }
+      static_buffer_append( &state->out, ");\n", 3 );
+    }
+
+    sqlite_freemem( state->insert );
+    state->insert = NULL;
+
+    result = static_finalize_vm( state->vm, result, &errmsg );
+    state->vm = NULL;
+    if( result != SQLITE_OK )
+    {
+      static_raise_db_error2( result, &errmsg );
+      /* "raise" does not return */
+    }
+  }
+
+  for( index = 0; index < RARRAY(schema)->len; index += 3 )
+  {
+    if( strcmp( STR2CSTR( RARRAY(schema)->ptr[index] ), "table" ) == 0 )
+      continue;
+
+    static_buffer_append( &state->out, STR2CSTR( RARRAY(schema)->ptr[index+2] ),
+      RSTRING( RARRAY(schema)->ptr[index+2] )->len );
+    static_buffer_append( &state->out, ";\n", 2 );
+  }
+
+  static_buffer_append( &state->out, "COMMIT;\n", 8 );
+  static_buffer_flush( &state->out );
+
+  return Qnil;
+}
+
+static VALUE
+static_dump_cleanup( VALUE data )
+{
+  dump_state *state = (dump_state*)data;
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  if( state->insert != NULL )
+    sqlite_freemem( state->insert );
+
+  if( state->began )
+    sqlite_exec( state->db, "COMMIT", NULL, NULL, NULL );
+
+  return Qnil;
+}
+
+/* Returns true if the given (complete) statement only begins or ends a
+ * transaction. */
+static int
+static_is_transaction_control( const char *sql )
+{
+  static const char *keywords[] = { "BEGIN", "COMMIT", "END", NULL };
+  int i;
+  int length;
+
+  while( ISSPACE( *sql ) ) sql++;
+
+  for( i = 0; keywords[i] != NULL; i++ )
+  {
+    length = strlen( keywords[i] );
+    if( strncasecmp( sql, keywords[i], length ) == 0 &&
+        !ISALNUM( sql[length] ) && sql[length] != '_' )
+      break;
+  }
+  if( keywords[i] == NULL )
+    return 0;
+
+  sql += length;
+  while( ISSPACE( *sql ) ) sql++;
+
+  if( strncasecmp( sql, "TRANSACTION", 11 ) == 0 )
+  {
+    sql += 11;
+    while( ISSPACE( *sql ) ) sql++;
+  }
+
+  return ( *sql == ';' || *sql == '\0' );
+}
+
+/* Begins a transaction, returning true, or returns false if a transaction
+ * is already active (in which case the caller's work becomes part of it, and
+ * it is the caller's to commit or roll back). Any other failure is raised. */
+static int
+static_begin_transaction( sqlite *db )
+{
+  char *errmsg = NULL;
+  int   result;
+
+  result = sqlite_exec( db, "BEGIN", NULL, NULL, &errmsg );
+  if( result == SQLITE_OK )
+    return 1;
+
+  if( result == SQLITE_ERROR && errmsg != NULL &&
+      strstr( errmsg, "within a transaction" ) != NULL )
+  {
+    sqlite_freemem( errmsg );
+    return 0;
+  }
+
+  static_raise_db_error2( result, &errmsg );
+  /* "raise" does not return */
+  return 0;
+}
+
+static void
+static_restore_exec( restore_state *state, const char *sql )
+{
+  char *errmsg = NULL;
+  int   result;
+
+  result = sqlite_exec( state->db, sql, NULL, NULL, &errmsg );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+}
+
+static VALUE
+static_restore_body( VALUE data )
+{
+  restore_state *state = (restore_state*)data;
+  static ID      idGets = 0;
+  VALUE          line;
+  long           count = 0;
+  long           length;
+  char          *text;
+
+  if( !idGets ) idGets = rb_intern( "gets" );
+
+  state->in_transaction = static_begin_transaction( state->db );
+  state->outer_transaction = !state->in_transaction;
+
+  for( ;; )
+  {
+    line = rb_funcall( state->io, idGets, 0 );
+    if( line == Qnil && state->length == 0 )
+      break;
+
+    if( line != Qnil )
+    {
+      text = StringValuePtr( line );
+      length = RSTRING(line)->len;
+
+      if( state->length + length + 1 > state->capacity )
+      {
+        state->capacity = ( state->length + length + 1 ) * 2;
+        REALLOC_N( state->sql, char, state->capacity );
+      }
+      memcpy( state->sql + state->length, text, length );
+      state->length += length;
+      state->sql[ state->length ] = '\0';
+
+      /* a statement can only be complete if the line ends with a semicolon,
+       * so most lines never need to be run through sqlite_complete */
+      while( length > 0 && ISSPACE( text[length-1] ) ) length--;
+      if( length == 0 || text[length-1] != ';' ||
+          !sqlite_complete( state->sql ) )
+      {
+        continue;
+      }
+    }
+
+    if( !static_is_transaction_control( state->sql ) )
+    {
+      static_restore_exec( state, state->sql );
+      count++;
+
+      if( !state->outer_transaction && state->batch_size > 0 &&
+          count % state->batch_size == 0 )
+      {
+        state->in_transaction = 0;
+        static_restore_exec( state, "COMMIT" );
+        static_restore_exec( state, "BEGIN" );
+        state->in_transaction = 1;
+      }
+    }
+
+    state->length = 0;
+    if( line == Qnil )
+      break;
+  }
+
+  if( state->in_transaction )
+  {
+    state->in_transaction = 0;
+    static_restore_exec( state, "COMMIT" );
+  }
+
+  return INT2FIX( count );
+}
+
+static VALUE
+static_restore_cleanup( VALUE data )
+{
+  restore_state *state = (restore_state*)data;
+
+  if( state->in_transaction )
+    sqlite_exec( state->db, "ROLLBACK", NULL, NULL, NULL );
+
+  if( state->sql != NULL )
+    xfree( state->sql );
+
+  return Qnil;
+}
+
+/* Returns the storage class (COLUMN_TEXT, COLUMN_INTEGER or COLUMN_REAL) for
+ * the given declared type, using the same type names as the default
+ * translators of SQLite::Translator. Any parenthetical part of the type
+ * ("DECIMAL(10,2)") and the surrounding whitespace are ignored, as they are
+ * by Translator#type_name. */
+static int
+static_column_kind( const char *type )
+{
+  static const struct {
+    const char *name;
+    int         kind;
+  } kinds[] = {
+    { "INTEGER", COLUMN_INTEGER }, { "SMALLINT", COLUMN_INTEGER },
+    { "MEDIUMINT", COLUMN_INTEGER }, { "INT", COLUMN_INTEGER },
+    { "BIGINT", COLUMN_INTEGER },
+    { "DECIMAL", COLUMN_REAL }, { "FLOAT", COLUMN_REAL },
+    { "NUMERIC", COLUMN_REAL }, { "DOUBLE", COLUMN_REAL },
+    { "REAL", COLUMN_REAL }, { "DEC", COLUMN_REAL }, { "FIXED", COLUMN_REAL },
+    { NULL, COLUMN_TEXT }
+  };
+  int length;
+  int i;
+
+  if( type == NULL )
+    return COLUMN_TEXT;
+
+  while( ISSPACE( *type ) )
+    type++;
+  for( length = 0; type[length] && type[length] != '('; length++ )
+    ;
+  while( length > 0 && ISSPACE( type[length-1] ) )
+    length--;
+
+  for( i = 0; kinds[i].name != NULL; i++ )
+  {
+    if( (int)strlen( kinds[i].name ) == length &&
+        strncasecmp( kinds[i].name, type, length ) == 0 )
+      return kinds[i].kind;
+  }
+
+  return COLUMN_TEXT;
+}
+
+static VALUE
+static_columnar_body( VALUE data )
+{
+  columnar_state *state = (columnar_state*)data;
+  const char    **values;
+  const char    **metadata;
+  char           *errmsg = NULL;
+  VALUE           names;
+  VALUE           types;
+  VALUE           columns;
+  char           *end;
+  int             result;
+  int             index;
+
+  result = sqlite_step( state->vm, &state->columns, &values, &metadata );
+
+  if( result == SQLITE_ROW || result == SQLITE_DONE )
+  {
+    names = rb_ary_new2( state->columns );
+    types = rb_ary_new2( state->columns );
+    columns = rb_ary_new2( state->columns );
+
+    state->kinds = ALLOC_N( int, state->columns );
+    state->packed = ALLOC_N( char*, state->columns );
+    state->lengths = ALLOC_N( long, state->columns );
+    state->capacities = ALLOC_N( long, state->columns );
+
+    for( index = 0; index < state->columns; index++ )
+    {
+      const char *type = metadata[ index+state->columns ];
+
+      rb_ary_store( names, index, rb_str_new2( metadata[index] ) );
+      rb_ary_store( types, index, type ? rb_str_new2( type ) : Qnil );
+      rb_ary_store( columns, index, rb_ary_new() );
+
+      state->kinds[index] = ( state->pack ? static_column_kind( type )
+                                          : COLUMN_TEXT );
+      state->packed[index] = NULL;
+      state->lengths[index] = 0;
+      state->capacities[index] = 0;
+    }
+
+    state->result = rb_ary_new3( 3, names, types, columns );
+  }
+
+  while( result == SQLITE_ROW )
+  {
+    for( index = 0; index < state->columns; index++ )
+    {
+      const char *value = values[index];
+      long        length = state->lengths[index];
+
+      if( state->kinds[index] == COLUMN_TEXT )
+      {
+        rb_ary_push( RARRAY(columns)->ptr[index],
+          value ? rb_str_new2( value ) : Qnil );
+        continue;
+      }
+
+      if( length + 8 > state->capacities[index] )
+      {
+        state->capacities[index] = ( length + 8 ) * 2;
+        REALLOC_N( state->packed[index], char, state->capacities[index] );
+      }
+
+      if( state->kinds[index] == COLUMN_INTEGER )
+      {
+        long long number = 0;
+
+        if( value == NULL )
+          static_raise_db_error( SQLITE_MISMATCH,
+            "cannot pack NULL as an integer (column %s)", metadata[index] );
+
+        errno = 0;
+        number = strtoll( value, &end, 10 );
+        if( end == value || *end != '\0' || errno == ERANGE )
+          static_raise_db_error( SQLITE_MISMATCH,
+            "cannot pack '%.40s' as an integer (column %s)", value,
+            metadata[index] );
+
+        memcpy( state->packed[index] + length, &number, 8 );
+      }
+      else
+      {
+        double number = 0.0 / 0.0;
+
+        if( value != NULL )
+        {
+          number = strtod( value, &end );
+          if( end == value || *end != '\0' )
+            static_raise_db_error( SQLITE_MISMATCH,
+              "cannot pack '%.40s' as a number (column %s)", value,
+              metadata[index] );
+        }
+
+        memcpy( state->packed[index] + length, &number, 8 );
+      }
+
+      state->lengths[index] = length + 8;
+    }
+
+    result = sqlite_step( state->vm, &state->columns, &values, &metadata );
+  }
+
+  if( result != SQLITE_DONE )
+  {
+    sqlite_finalize( state->vm, &errmsg );
+    state->vm = NULL;
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  for( index = 0; index < state->columns; index++ )
+  {
+    if( state->kinds[index] != COLUMN_TEXT )
+      rb_ary_store( columns, index,
+        rb_str_new( state->packed[index], state->lengths[index] ) );
+  }
+
+  return state->result;
+}
+
+static VALUE
+static_columnar_cleanup( VALUE data )
+{
+  columnar_state *state = (columnar_state*)data;
+  int             index;
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  if( state->packed != NULL )
+  {
+    for( index = 0; index < state->columns; index++ )
+    {
+      if( state->packed[index] != NULL )
+        xfree( state->packed[index] );
+    }
+  }
+
+  if( state->kinds ) xfree( state->kinds );
+  if( state->packed ) xfree( state->packed );
+  if( state->lengths ) xfree( state->lengths );
+  if( state->capacities ) xfree( state->capacities );
+
+  return Qnil;
+}
+
+/* Returns the storage classes to use for the columns of the given VM, as a
+ * string with one byte (COLUMN_TEXT, COLUMN_INTEGER, ...) per column, or NULL
+ * if no column needs converting. The classes are worked out from the VM's
+ * conversions (see #set_conversions) on the first step, and remembered. */
+static const char*
+static_vm_kinds( VALUE vm, int columns, const char **metadata )
+{
+  VALUE conversions;
+  VALUE kinds;
+  VALUE kind;
+  char  name[ 64 ];
+  int   convert = 0;
+  int   index;
+  int   length;
+
+  kinds = rb_ivar_get( vm, idKinds );
+  if( kinds == Qnil )
+  {
+    conversions = rb_ivar_get( vm, idConversions );
+    if( conversions == Qnil )
+      return NULL;
+
+    kinds = rb_str_new( NULL, columns );
+    for( index = 0; index < columns; index++ )
+    {
+      const char *type = metadata[ index+columns ];
+
+      RSTRING(kinds)->ptr[index] = COLUMN_TEXT;
+      if( type == NULL )
+        continue;
+
+      /* the same "base" type name that Translator#type_name produces */
+      while( ISSPACE( *type ) )
+        type++;
+      for( length = 0;
+           type[length] && type[length] != '(' && length < (int)sizeof(name);
+           length++ )
+      {
+        name[length] = toupper( type[length] );
+      }
+      while( length > 0 && ISSPACE( name[length-1] ) )
+        length--;
+
+      kind = rb_hash_aref( conversions, rb_str_new( name, length ) );
+      if( kind == ID2SYM(idInteger) )
+        RSTRING(kinds)->ptr[index] = COLUMN_INTEGER;
+      else if( kind == ID2SYM(idFloat) )
+        RSTRING(kinds)->ptr[index] = COLUMN_REAL;
+      else if( kind == ID2SYM(idTime) )
+        RSTRING(kinds)->ptr[index] = COLUMN_TIME;
+      else
+        continue;
+
+      convert = 1;
+    }
+
+    if( !convert )
+      kinds = Qfalse;
+
+    rb_ivar_set( vm, idKinds, kinds );
+  }
+
+  return ( kinds == Qfalse ? NULL : RSTRING(kinds)->ptr );
+}
+
+/* Consumes a run of decimal digits starting at *text (stopping at +end+),
+ * accumulating them into *number. Returns the number of digits consumed.
+ * Runs of eight digits are validated and converted at once, using 64-bit
+ * arithmetic in place of a loop over the bytes. The caller is responsible
+ * for making sure *number cannot overflow. */
+static int
+static_parse_digits( const char **text, const char *end,
+  unsigned long long *number )
+{
+  const char         *p = *text;
+  unsigned long long  value = *number;
+  int                 digits;
+
+#ifndef WORDS_BIGENDIAN
+  while( end - p >= 8 )
+  {
+    unsigned long long chunk;
+
+    memcpy( &chunk, p, 8 );
+
+    /* all eight bytes must be in '0'..'9' */
+    if( ( chunk & 0xF0F0F0F0F0F0F0F0ULL ) != 0x3030303030303030ULL ||
+        ( ( chunk + 0x0606060606060606ULL ) & 0xF0F0F0F0F0F0F0F0ULL )
+          != 0x3030303030303030ULL )
+      break;
+
+    /* combine pairs, then quads, then the two halves */
+    chunk -= 0x3030303030303030ULL;
+    chunk = ( chunk * 10 ) + ( chunk >> 8 );
+    chunk = ( ( ( chunk & 0x000000FF000000FFULL ) *
+                ( 100 + ( 1000000ULL << 32 ) ) ) +
+              ( ( ( chunk >> 16 ) & 0x000000FF000000FFULL ) *
+                ( 1 + ( 10000ULL << 32 ) ) ) ) >> 32;
+
+    value = value * 100000000ULL + chunk;
+    p += 8;
+  }
+#endif
+
+  while( p < end && *p >= '0' && *p <= '9' )
+  {
+    value = value * 10 + ( *p - '0' );
+    p++;
+  }
+
+  *number = value;
+  digits = (int)( p - *text );
+  *text = p;
+
+  return digits;
+}
+
+/* Converts the given text to an Integer, exactly as String#to_i would. Plain
+ * integers of up to 18 digits are handled directly; anything else is left
+ * to Ruby. */
+static VALUE
+static_parse_integer( const char *text )
+{
+  const char         *p = text;
+  const char         *end;
+  unsigned long long  number = 0;
+  int                 negative = 0;
+  int                 digits;
+
+  end = text + strlen( text );
+  if( *p == '-' )
+  {
+    negative = 1;
+    p++;
+  }
+
+  if( end - p <= 18 )
+  {
+    digits = static_parse_digits( &p, end, &number );
+    if( digits > 0 && p == end )
+    {
+      long long value = ( negative ? -(long long)number : (long long)number );
+      return LL2NUM( value );
+    }
+  }
+
+  return rb_cstr_to_inum( text, 10, Qfalse );
+}
+
+/* Converts the given text to a Float, exactly as String#to_f would. Decimal
+ * numbers with at most 15 significant digits and a small exponent are
+ * converted with a single exactly rounded multiplication or division (which
+ * yields the same result as strtod); anything else is left to Ruby. */
+static VALUE
+static_parse_real( const char *text )
+{
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char         *p = text;
+  const char         *end;
+  unsigned long long  mantissa = 0;
+  int                 negative = 0;
+  int                 digits;
+  int                 fraction = 0;
+  int                 exponent = 0;
+  double              value;
+
+  end = text + strlen( text );
+  if( *p == '-' )
+  {
+    negative = 1;
+    p++;
+  }
+
+  if( end - p > 40 )
+    return rb_float_new( rb_cstr_to_dbl( text, Qfalse ) );
+
+  while( p < end && *p == '0' ) p++;
+  digits = static_parse_digits( &p, end, &mantissa );
+
+  if( p < end && *p == '.' )
+  {
+    const char *start = ++p;
+
+    if( digits == 0 )
+    {
+      while( p < end && *p == '0' ) p++;
+    }
+    digits += static_parse_digits( &p, end, &mantissa );
+    fraction = (int)( p - start );
+
+    if( p == start && p - text == 1 + negative )
+      goto slow;       /* a lone "." is not a number */
+  }
+
+  if( p < end && ( *p == 'e' || *p == 'E' ) )
+  {
+    int         exp_negative = 0;
+    int         exp_value = 0;
+    const char *start;
+
+    p++;
+    if( p < end && ( *p == '-' || *p == '+' ) )
+      exp_negative = ( *p++ == '-' );
+
+    for( start = p; p < end && *p >= '0' && *p <= '9' && p - start < 4; p++ )
+      exp_value = exp_value * 10 + ( *p - '0' );
+
+    if( p == start )
+      goto slow;
+
+    exponent = ( exp_negative ? -exp_value : exp_value );
+  }
+
+  if( p != end || digits > 15 || p == text + negative )
+    goto slow;
+
+  exponent -= fraction;
+  if( exponent < -22 || exponent > 22 )
+    goto slow;
+
+  value = (double)mantissa;
+  if( exponent < 0 )
+    value /= powers[ -exponent ];
+  else
+    value *= powers[ exponent ];
+
+  return rb_float_new( negative ? -value : value );
+
+slow:
+  return rb_float_new( rb_cstr_to_dbl( text, Qfalse ) );
+}
+
+/* Returns the number of seconds from the epoch to the given date and time,
+ * taken as UTC. The month and day may be out of range, in which case they
+ * roll over into the following month or year (as with mktime). */
+static long long
+static_civil_seconds( long year, int month, int day, int hour, int minute,
+  int second )
+{
+  long long era;
+  long long year_of_era;
+  long long day_of_year;
+  long long day_of_era;
+  long long days;
+
+  /* days from civil, counting years from March so leap days come last */
+  year += ( month - 1 ) / 12;
+  month = ( month - 1 ) % 12 + 1;
+  year -= ( month <= 2 );
+
+  era = ( year >= 0 ? year : year - 399 ) / 400;
+  year_of_era = year - era * 400;
+  day_of_year = ( 153 * ( month + ( month > 2 ? -3 : 9 ) ) + 2 ) / 5 + day - 1;
+  day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 +
+    day_of_year;
+  days = era * 146097 + day_of_era - 719468;
+
+  return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/* Returns the offset of local time from UTC at the given instant. */
+static long
+static_local_offset( time_t instant )
+{
+  struct tm tm;
+
+  localtime_r( &instant, &tm );
+
+  return (long)( static_civil_seconds( tm.tm_year + 1900, tm.tm_mon + 1,
+    tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec ) - instant );
+}
+
+/* Converts a local time (in seconds, as returned by static_civil_seconds) to
+ * an instant, reusing the memoized UTC offset where it is known to apply. */
+static time_t
+static_local_to_epoch( long long local, time_zone_memo *memo )
+{
+  time_t instant;
+  long   offset;
+
+  if( memo->valid )
+  {
+    instant = (time_t)( local - memo->offset );
+    if( instant >= memo->low && instant <= memo->high )
+      return instant;
+
+    /* the window only ever grows by a day at a time, and a zone never
+     * changes its offset twice in a day, so a transition cannot hide
+     * between two instants that were both checked */
+    if( static_local_offset( instant ) == memo->offset )
+    {
+      if( instant < memo->low && memo->low - instant <= 86400 )
+        memo->low = instant;
+      else if( instant > memo->high && instant - memo->high <= 86400 )
+        memo->high = instant;
+      else
+        memo->low = memo->high = instant;
+
+      return instant;
+    }
+  }
+
+  offset = static_local_offset( (time_t)local );
+  instant = (time_t)( local - offset );
+  offset = static_local_offset( instant );
+  instant = (time_t)( local - offset );
+
+  memo->valid = 1;
+  memo->offset = offset;
+  memo->low = memo->high = instant;
+
+  return instant;
+}
+
+/* Reads exactly +count+ digits from *text, returning -1 if they are not all
+ * there. */
+static int
+static_parse_fixed( const char **text, int count )
+{
+  const char *p = *text;
+  int         value = 0;
+
+  while( count-- > 0 )
+  {
+    if( *p < '0' || *p > '9' )
+      return -1;
+    value = value * 10 + ( *p++ - '0' );
+  }
+
+  *text = p;
+  return value;
+}
+
+/* Converts the given text to a Time, as Time.parse would. */
+static VALUE
+static_parse_time( const char *text, time_zone_memo *memo )
+{
+  const char *p = text;
+  long        year;
+  int         month;
+  int         day;
+  int         hour = 0;
+  int         minute = 0;
+  int         second = 0;
+  long        usec = 0;
+  int         zone = 0;
+  int         has_time = 0;
+  int         has_zone = 0;
+  int         utc = 0;
+  long long   local;
+  time_t      instant;
+  VALUE       result;
+
+  if( p[0] && p[1] && p[2] == ':' )
+  {
+    /* a time of day alone refers to today */
+    struct tm tm;
+
+    instant = time( NULL );
+    localtime_r( &instant, &tm );
+    year = tm.tm_year + 1900;
+    month = tm.tm_mon + 1;
+    day = tm.tm_mday;
+    has_time = 1;
+  }
+  else
+  {
+    year = static_parse_fixed( &p, 4 );
+    if( year < 0 || *p++ != '-' ) goto slow;
+    month = static_parse_fixed( &p, 2 );
+    if( month < 1 || month > 12 || *p++ != '-' ) goto slow;
+    day = static_parse_fixed( &p, 2 );
+    if( day < 1 || day > 31 ) goto slow;
+
+    if( *p == ' ' || *p == 'T' )
+    {
+      p++;
+      has_time = 1;
+    }
+  }
+
+  if( has_time )
+  {
+    hour = static_parse_fixed( &p, 2 );
+    if( hour < 0 || hour > 23 || *p++ != ':' ) goto slow;
+    minute = static_parse_fixed( &p, 2 );
+    if( minute < 0 || minute > 59 ) goto slow;
+
+    if( *p == ':' )
+    {
+      p++;
+      second = static_parse_fixed( &p, 2 );
+      if( second < 0 || second > 60 ) goto slow;
+
+      if( *p == '.' )
+      {
+        long scale = 100000;
+
+        for( p++; *p >= '0' && *p <= '9'; p++, scale /= 10 )
+          usec += ( *p - '0' ) * scale;
+      }
+    }
+
+    if( *p == 'Z' )
+    {
+      has_zone = 1;
+      utc = 1;
+      p++;
+    }
+    else if( *p == '+' || *p == '-' )
+    {
+      int sign = ( *p++ == '-' ? -1 : 1 );
+      int zone_hour;
+      int zone_minute;
+
+      zone_hour = static_parse_fixed( &p, 2 );
+      if( *p == ':' ) p++;
+      zone_minute = static_parse_fixed( &p, 2 );
+      if( zone_hour < 0 || zone_minute < 0 ) goto slow;
+
+      has_zone = 1;
+      zone = sign * ( zone_hour * 3600 + zone_minute * 60 );
+
+      /* Time.parse takes "-00:00" (but not "+00:00") to mean UTC, as
+       * RFC 2822 does */
+      utc = ( sign < 0 && zone == 0 );
+    }
+  }
+
+  if( *p != '\0' )
+    goto slow;
+
+  local = static_civil_seconds( year, month, day, hour, minute, second );
+
+  if( has_zone )
+    instant = (time_t)( local - zone );
+  else
+    instant = static_local_to_epoch( local, memo );
+
+  result = rb_time_new( instant, usec );
+  if( utc )
+    rb_funcall( result, idUtc, 0 );
+
+  return result;
+
+slow:
+  return rb_funcall( rb_cTime, idParse, 1, rb_str_new2( text ) );
+}
+
+/* Converts a single (non-NULL) value of the given storage class. The time
+ * zone memo of the vm is looked up the first time a time is converted, and
+ * kept in *memo for the values that follow. */
+static VALUE
+static_convert_value( VALUE vm, int kind, const char *value,
+  time_zone_memo **memo )
+{
+  VALUE wrapper;
+
+  switch( kind )
+  {
+    case COLUMN_INTEGER:
+      return static_parse_integer( value );
+
+    case COLUMN_REAL:
+      return static_parse_real( value );
+
+    case COLUMN_TIME:
+      if( *memo == NULL )
+      {
+        wrapper = rb_ivar_get( vm, idTimeZone );
+
+        if( wrapper == Qnil )
+        {
+          wrapper = Data_Make_Struct( rb_cData, time_zone_memo, NULL,
+            free, *memo );
+          rb_ivar_set( vm, idTimeZone, wrapper );
+        }
+        Data_Get_Struct( wrapper, time_zone_memo, *memo );
+      }
+      return static_parse_time( value, *memo );
+  }
+
+  return rb_str_new2( value );
+}
+
+static void
+static_convert_row( VALUE vm, VALUE row, int columns, const char **values,
+  const char *kinds, intern_table *interns )
+{
+  time_zone_memo *memo = NULL;
+  int             index;
+  int             kind;
+
+  for( index = 0; index < columns; index++ )
+  {
+    const char *value = values[index];
+    VALUE       entry;
+
+    kind = ( kinds != NULL ? kinds[index] : COLUMN_TEXT );
+
+    if( value == NULL )
+      entry = Qnil;
+    else if( kind == COLUMN_TEXT && interns != NULL &&
+             interns->modes[index] != INTERN_OFF )
+      entry = static_intern_value( interns, index, value );
+    else
+      entry = static_convert_value( vm, kind, value, &memo );
+
+    rb_ary_store( row, index, entry );
+  }
+
+  if( interns != NULL )
+    static_intern_row_done( interns );
+}
+
+static void
+static_mark_intern_table( intern_table *table )
+{
+  long index;
+
+  rb_gc_mark( table->spec );
+  for( index = 0; index < table->capacity; index++ )
+  {
+    if( table->slots[index].string )
+      rb_gc_mark( table->slots[index].string );
+  }
+}
+
+static void
+static_free_intern_table( intern_table *table )
+{
+  if( table->slots ) xfree( table->slots );
+  if( table->modes ) xfree( table->modes );
+  if( table->misses ) xfree( table->misses );
+  xfree( table );
+}
+
+/* Returns the intern table of the given vm, or NULL if none was requested.
+ * The first time through, this works out which columns are to be interned,
+ * since the column names are not known until the first row is fetched. */
+static intern_table*
+static_vm_interns( VALUE vm, int columns, const char **metadata )
+{
+  intern_table *table;
+  VALUE         wrapper;
+  VALUE         item;
+  long          index;
+  int           column;
+
+  wrapper = rb_ivar_get( vm, idInterns );
+  if( wrapper == Qnil )
+    return NULL;
+
+  Data_Get_Struct( wrapper, intern_table, table );
+  if( table->columns >= 0 )
+    return table;
+
+  table->modes = ALLOC_N( char, columns );
+  table->misses = ALLOC_N( long, columns );
+  MEMZERO( table->misses, long, columns );
+
+  for( column = 0; column < columns; column++ )
+    table->modes[column] = ( table->spec == Qtrue ? INTERN_SAMPLING
+                                                  : INTERN_OFF );
+
+  if( table->spec != Qtrue )
+  {
+    for( index = 0; index < RARRAY(table->spec)->len; index++ )
+    {
+      item = RARRAY(table->spec)->ptr[index];
+
+      if( FIXNUM_P( item ) )
+      {
+        column = FIX2INT( item );
+        if( column >= 0 && column < columns )
+          table->modes[column] = INTERN_ON;
+        continue;
+      }
+
+      for( column = 0; column < columns; column++ )
+      {
+        if( strcmp( metadata[column], STR2CSTR( item ) ) == 0 )
+          table->modes[column] = INTERN_ON;
+      }
+    }
+  }
+
+  table->slots = ALLOC_N( intern_slot, INTERN_INITIAL_SLOTS );
+  MEMZERO( table->slots, intern_slot, INTERN_INITIAL_SLOTS );
+  table->capacity = INTERN_INITIAL_SLOTS;
+  table->columns = columns;
+
+  return table;
+}
+
+static void
+static_intern_grow( intern_table *table )
+{
+  intern_slot *old_slots = table->slots;
+  long         old_capacity = table->capacity;
+  long         mask;
+  long         index;
+  long         probe;
+
+  table->slots = ALLOC_N( intern_slot, old_capacity * 2 );
+  MEMZERO( table->slots, intern_slot, old_capacity * 2 );
+  table->capacity = old_capacity * 2;
+  mask = table->capacity - 1;
+
+  for( index = 0; index < old_capacity; index++ )
+  {
+    if( !old_slots[index].string )
+      continue;
+
+    probe = old_slots[index].hash & mask;
+    while( table->slots[probe].string )
+      probe = ( probe + 1 ) & mask;
+
+    table->slots[probe] = old_slots[index];
+  }
+
+  xfree( old_slots );
+}
+
+/* Returns the interned copy of the given value, adding it to the table if
+ * it was not already there. Once the table is full, values that are not
+ * already present are simply returned as new strings. */
+static VALUE
+static_intern_value( intern_table *table, int column, const char *value )
+{
+  unsigned long  hash = 2166136261UL;
+  long           length;
+  long           mask = table->capacity - 1;
+  long           index;
+  intern_slot   *slot;
+  VALUE          string;
+
+  for( length = 0; value[length]; length++ )
+    hash = ( hash ^ (unsigned char)value[length] ) * 16777619UL;
+
+  for( index = hash & mask; ; index = ( index + 1 ) & mask )
+  {
+    slot = &table->slots[index];
+    if( !slot->string )
+      break;
+
+    if( slot->hash == hash && RSTRING(slot->string)->len == length &&
+        memcmp( RSTRING(slot->string)->ptr, value, length ) == 0 )
+    {
+      return slot->string;
+    }
+  }
+
+  if( table->modes[column] == INTERN_SAMPLING )
+    table->misses[column]++;
+
+  string = rb_str_new( value, length );
+  if( table->size >= INTERN_MAX_ENTRIES )
+    return string;
+
+  OBJ_FREEZE( string );
+
+  /* rb_str_new may have run the collector, but the table was not changed */
+  slot->hash = hash;
+  slot->string = string;
+  table->size++;
+
+  if( table->size * 2 > table->capacity )
+    static_intern_grow( table );
+
+  return string;
+}
+
+/* Called after each row has been converted. Once enough rows have been
+ * sampled, the automatically interned columns that turned out to hold many
+ * distinct values (more than one new value every four rows) are switched
+ * off. */
+static void
+static_intern_row_done( intern_table *table )
+{
+  int column;
+
+  if( ++table->rows != INTERN_SAMPLE_ROWS )
+    return;
+
+  for( column = 0; column < table->columns; column++ )
+  {
+    if( table->modes[column] != INTERN_SAMPLING )
+      continue;
+
+    if( table->misses[column] * 4 > table->rows )
+      table->modes[column] = INTERN_OFF;
+    else
+      table->modes[column] = INTERN_ON;
+  }
+}
+
+/* Creates a RawRow for the current row of the given vm. The offsets and the
+ * text of the row are kept together in a single allocation. */
+static VALUE
+static_raw_row_new( VALUE vm, int columns, const char **values )
+{
+  raw_row *row;
+  VALUE    kinds;
+  long     size = 0;
+  long     length;
+  int      index;
+
+  for( index = 0; index < columns; index++ )
+  {
+    if( values[index] != NULL )
+      size += strlen( values[index] ) + 1;
+  }
+
+  kinds = rb_ivar_get( vm, idKinds );
+
+  row = ALLOC( raw_row );
+  row->offsets = (long*)xmalloc( columns * sizeof( long ) + size );
+  row->data = (char*)( row->offsets + columns );
+  row->columns = columns;
+  row->vm = vm;
+  row->kinds = ( kinds == Qnil ? Qfalse : kinds );
+
+  size = 0;
+  for( index = 0; index < columns; index++ )
+  {
+    if( values[index] == NULL )
+    {
+      row->offsets[index] = -1;
+      continue;
+    }
+
+    length = strlen( values[index] ) + 1;
+    memcpy( row->data + size, values[index], length );
+    row->offsets[index] = size;
+    size += length;
+  }
+
+  return Data_Wrap_Struct( cRawRow, static_mark_raw_row, static_free_raw_row,
+    row );
+}
+
+static void
+static_mark_raw_row( raw_row *row )
+{
+  rb_gc_mark( row->vm );
+  rb_gc_mark( row->kinds );
+}
+
+static void
+static_free_raw_row( raw_row *row )
+{
+  xfree( row->offsets );
+  xfree( row );
+}
+
+static VALUE
+static_raw_row_value( raw_row *row, int index, time_zone_memo **memo )
+{
+  int kind = COLUMN_TEXT;
+
+  if( row->offsets[index] < 0 )
+    return Qnil;
+
+  if( row->kinds != Qfalse )
+    kind = RSTRING(row->kinds)->ptr[index];
+
+  return static_convert_value( row->vm, kind, row->data + row->offsets[index],
+    memo );
+}
+
+/* The progress handler used while profiling. SQLite invokes it before each
+ * instruction but the first, so each time recorded here is the time at which
+ * the previous instruction finished. */
+static int
+static_profile_progress( void *cookie )
+{
+  profile_state *state = (profile_state*)cookie;
+  double        *times;
+
+  if( state->length == state->capacity )
+  {
+    times = (double*)realloc( state->times,
+              ( state->capacity + 4096 ) * sizeof( double ) );
+    if( times == NULL )
+      return 0;
+
+    state->times = times;
+    state->capacity += 4096;
+  }
+
+  state->times[ state->length++ ] = static_now();
+  return 0;
+}
+
+/* The callback used to read the current value of the vdbe_trace pragma. */
+static int
+static_profile_flag( void *cookie, int columns, char **values,
+  char **names )
+{
+  if( columns > 0 && values[0] != NULL )
+    *(int*)cookie = atoi( values[0] );
+  return 0;
+}
+
+#ifdef HAVE_UNISTD_H
+/* Puts back the database's own progress handler, the standard output and
+ * the vdbe_trace pragma, as they were before profiling. Only the first call
+ * does anything. Returns 0, or the errno of the failure if the standard
+ * output could not be restored. */
+static int
+static_profile_restore( profile_state *state )
+{
+  db_handle *db = state->db;
+  int        error = 0;
+
+  if( state->restored )
+    return 0;
+  state->restored = 1;
+
+  fflush( stdout );
+  if( dup2( state->saved, 1 ) < 0 )
+    error = errno;
+  close( state->saved );
+
+  if( db->db != NULL )
+  {
+    if( db->progress_interval > 0 )
+      sqlite_progress_handler( db->db, db->progress_interval,
+        static_progress_handler, (void*)db );
+    else
+      sqlite_progress_handler( db->db, 0, NULL, NULL );
+
+    if( !state->traced )
+      sqlite_exec( db->db, "PRAGMA vdbe_trace=OFF", NULL, NULL, NULL );
+  }
+
+  return error;
+}
+
+static VALUE
+static_profile_body( VALUE data )
+{
+  profile_state *state = (profile_state*)data;
+  sqlite        *handle = state->db->db;
+  const char   **values;
+  const char   **metadata;
+  const char    *tail;
+  char          *errmsg = NULL;
+  int            columns;
+  int            result;
+  int            error;
+
+  result = sqlite_compile( handle, STR2CSTR( state->sql ), &tail,
+    &state->vm, &errmsg );
+  if( result == SQLITE_OK )
+  {
+    sqlite_progress_handler( handle, 1, static_profile_progress, state );
+    state->start = static_now();
+
+    do {
+      result = sqlite_step( state->vm, &columns, &values, &metadata );
+    } while( result == SQLITE_ROW );
+
+    state->finish = static_now();
+    result = static_finalize_vm( state->vm, result, &errmsg );
+    state->vm = NULL;
+  }
+
+  error = static_profile_restore( state );
+  if( error != 0 )
+  {
+    if( errmsg != NULL )
+      sqlite_freemem( errmsg );
+    errno = error;
+    rb_sys_fail( "dup2" );
+  }
+
+  if( result != SQLITE_OK )
+    static_raise_db_error2( result, &errmsg );
+
+  return static_profile_report( state->trace, state, state->start,
+    state->finish );
+}
+
+static VALUE
+static_profile_cleanup( VALUE data )
+{
+  profile_state *state = (profile_state*)data;
+
+  static_profile_restore( state );
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  fclose( state->trace );
+  free( state->times );
+
+  return Qnil;
+}
+#endif
+
+/* Reads back the captured trace, one line per executed instruction (lines
+ * that do not begin with an address, such as the stack dumps, are skipped),
+ * and totals the count and time of each address. */
+static VALUE
+static_profile_report( FILE *trace, profile_state *state, double start,
+  double finish )
+{
+  char    line[ 1024 ];
+  char    opcode[ 32 ];
+  long    executed = state->length + 1;
+  long    index = 0;
+  int     addr;
+  double  began;
+  double  ended;
+  VALUE   entries;
+  VALUE   entry;
+
+  entries = rb_ary_new();
+  rewind( trace );
+
+  while( index < executed && fgets( line, sizeof( line ), trace ) != NULL )
+  {
+    if( sscanf( line, "%d %31s", &addr, opcode ) != 2 || addr < 0 )
+      continue;
+
+    began = ( index == 0 ? start : state->times[ index-1 ] );
+    ended = ( index < state->length ? state->times[ index ] : finish );
+    index++;
+
+    while( RARRAY(entries)->len <= addr )
+      rb_ary_push( entries, Qnil );
+
+    entry = RARRAY(entries)->ptr[ addr ];
+    if( entry == Qnil )
+    {
+      entry = rb_ary_new3( 4, INT2FIX( addr ), rb_str_new2( opcode ),
+        INT2FIX( 0 ), rb_float_new( 0.0 ) );
+      rb_ary_store( entries, addr, entry );
+    }
+
+    RARRAY(entry)->ptr[2] = INT2FIX( FIX2INT( RARRAY(entry)->ptr[2] ) + 1 );
+    RARRAY(entry)->ptr[3] = rb_float_new( NUM2DBL( RARRAY(entry)->ptr[3] ) +
+                                          ( ended - began ) );
+  }
+
+  rb_funcall( entries, rb_intern( "compact!" ), 0 );
+
+  return rb_ary_new3( 3, LONG2NUM( executed ),
+    rb_float_new( finish - start ), entries );
+}
+
+static VALUE
+static_execute_body( VALUE data )
+{
+  execute_state  *state = (execute_state*)data;
+  const char    **values;
+  const char    **metadata;
+  char           *errmsg = NULL;
+  VALUE           row;
+  int             columns;
+  int             result;
+  int             index;
+
+  state->rows = rb_ary_new();
+
+  while( ( result = sqlite_step( state->vm, &columns, &values,
+                                 &metadata ) ) == SQLITE_ROW )
+  {
+    row = rb_ary_new2( columns );
+    for( index = 0; index < columns; index++ )
+    {
+      rb_ary_store( row, index,
+        values[index] ? rb_str_new2( values[index] ) : Qnil );
+    }
+    rb_ary_push( state->rows, row );
+  }
+
+  if( result != SQLITE_DONE )
+  {
+    sqlite_finalize( state->vm, &errmsg );
+    state->vm = NULL;
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  return state->rows;
+}
+
+static VALUE
+static_execute_cleanup( VALUE data )
+{
+  execute_state *state = (execute_state*)data;
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  return Qnil;
+}
+
+/* Raises a MisuseException if a virtual machine of the given database is
+ * being stepped by a read-ahead thread, or if SQLite is in the middle of a
+ * statement, calling the database's progress or busy handler (which may
+ * have let another thread run). */
+static void
+static_check_reading_ahead( db_handle *db )
+{
+  if( db != NULL && db->reading_ahead )
+    static_raise_db_error( SQLITE_MISUSE,
+      "the database is in use by a read-ahead statement" );
+
+  if( db != NULL && db->in_handler )
+    static_raise_db_error( SQLITE_MISUSE,
+      "the database is in the middle of a statement, in its progress or "
+      "busy handler" );
+}
+
+#ifdef HAVE_PTHREAD_H
+/* The body of a read-ahead thread: steps the virtual machine until it is
+ * done (or fails, or the thread is cancelled), packing each row into the
+ * ring buffer and waiting whenever the buffer is full. */
+static void*
+static_read_ahead_producer( void *data )
+{
+  read_ahead   *ahead = (read_ahead*)data;
+  const char  **values;
+  const char  **metadata;
+  char         *row;
+  sigset_t      signals;
+  int           columns;
+  int           result;
+
+  /* leave the interpreter's signals to the interpreter's thread */
+  sigfillset( &signals );
+  pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+  for( ;; )
+  {
+    pthread_mutex_lock( &ahead->mutex );
+    while( ahead->count == ahead->capacity && !ahead->cancelled )
+      pthread_cond_wait( &ahead->changed, &ahead->mutex );
+    if( ahead->cancelled )
+    {
+      ahead->finished = 1;
+      pthread_mutex_unlock( &ahead->mutex );
+      break;
+    }
+    pthread_mutex_unlock( &ahead->mutex );
+
+    result = sqlite_step( ahead->vm, &columns, &values, &metadata );
+    row = ( result == SQLITE_ROW ? static_read_ahead_pack( columns, values )
+                                 : NULL );
+
+    pthread_mutex_lock( &ahead->mutex );
+    ahead->columns = columns;
+    ahead->metadata = metadata;
+    if( row != NULL )
+    {
+      ahead->slots[ ( ahead->head + ahead->count ) % ahead->capacity ] = row;
+      ahead->count++;
+    }
+    else
+    {
+      ahead->result = result;
+      ahead->finished = 1;
+    }
+    pthread_cond_broadcast( &ahead->changed );
+    pthread_mutex_unlock( &ahead->mutex );
+
+    if( row == NULL )
+      break;
+  }
+
+  return NULL;
+}
+
+/* Copies the values of a row into a single block of memory: an array of
+ * offsets (-1 for NULL), followed by the NUL-terminated values. This runs
+ * on the producer thread, so it uses malloc rather than Ruby's allocator. */
+static char*
+static_read_ahead_pack( int columns, const char **values )
+{
+  long  *offsets;
+  char  *row;
+  long   size = columns * sizeof( long );
+  int    index;
+
+  for( index = 0; index < columns; index++ )
+  {
+    if( values[index] != NULL )
+      size += strlen( values[index] ) + 1;
+  }
+
+  row = (char*)malloc( size );
+  if( row == NULL )
+    return NULL;
+
+  offsets = (long*)row;
+  size = columns * sizeof( long );
+  for( index = 0; index < columns; index++ )
+  {
+    if( values[index] == NULL )
+    {
+      offsets[index] = -1;
+      continue;
+    }
+
+    offsets[index] = size;
+    strcpy( row + size, values[index] );
+    size += strlen( values[index] ) + 1;
+  }
+
+  return row;
+}
+
+/* Takes the next row from the buffer, waiting for the producer if it is
+ * empty, and returns SQLITE_ROW; once the producer has finished and the
+ * buffer is empty, returns the producer's final result instead. The values
+ * returned remain valid until the next call. */
+static int
+static_read_ahead_next( read_ahead *ahead, int *columns,
+  const char ***values, const char ***metadata )
+{
+  struct timespec  until;
+  struct timeval   now;
+  long            *offsets;
+  char            *row = NULL;
+  int              result;
+  int              index;
+
+  if( ahead->current != NULL )
+  {
+    free( ahead->current );
+    ahead->current = NULL;
+  }
+
+  pthread_mutex_lock( &ahead->mutex );
+  while( ahead->count == 0 && !ahead->finished )
+  {
+    if( rb_thread_alone() )
+    {
+      pthread_cond_wait( &ahead->changed, &ahead->mutex );
+      continue;
+    }
+
+    /* let the interpreter's other threads run while waiting */
+    gettimeofday( &now, NULL );
+    until.tv_sec = now.tv_sec;
+    until.tv_nsec = ( now.tv_usec + 1000 ) * 1000;
+    if( until.tv_nsec >= 1000000000 )
+    {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( &ahead->changed, &ahead->mutex, &until );
+
+    pthread_mutex_unlock( &ahead->mutex );
+    rb_thread_schedule();
+    pthread_mutex_lock( &ahead->mutex );
+  }
+
+  if( ahead->count > 0 )
+  {
+    row = ahead->slots[ ahead->head ];
+    ahead->head = ( ahead->head + 1 ) % ahead->capacity;
+    ahead->count--;
+    pthread_cond_broadcast( &ahead->changed );
+    result = SQLITE_ROW;
+  }
+  else
+  {
+    result = ahead->result;
+  }
+
+  *columns = ahead->columns;
+  *metadata = ahead->metadata;
+  pthread_mutex_unlock( &ahead->mutex );
+
+  if( result == SQLITE_ROW )
+  {
+    if( row == NULL )
+      rb_raise( rb_eNoMemError, "out of memory reading ahead" );
+
+    ahead->current = row;
+    REALLOC_N( ahead->values, const char*, *columns );
+    offsets = (long*)row;
+    for( index = 0; index < *columns; index++ )
+      ahead->values[index] = ( offsets[index] < 0 ? NULL
+                                                 : row + offsets[index] );
+    *values = ahead->values;
+  }
+
+  return result;
+}
+
+/* Stops the read-ahead thread of the given virtual machine (if it is still
+ * running), waits for it to finish, and releases the buffer. The virtual
+ * machine is left wherever the producer stopped stepping it. */
+static void
+static_stop_read_ahead( vm_handle *handle )
+{
+  read_ahead *ahead = handle->ahead;
+
+  pthread_mutex_lock( &ahead->mutex );
+  ahead->cancelled = 1;
+  pthread_cond_broadcast( &ahead->changed );
+  pthread_mutex_unlock( &ahead->mutex );
+  pthread_join( ahead->thread, NULL );
+
+  while( ahead->count > 0 )
+  {
+    free( ahead->slots[ ahead->head ] );
+    ahead->head = ( ahead->head + 1 ) % ahead->capacity;
+    ahead->count--;
+  }
+
+  if( ahead->current != NULL )
+    free( ahead->current );
+  if( ahead->values != NULL )
+    xfree( ahead->values );
+
+  pthread_mutex_destroy( &ahead->mutex );
+  pthread_cond_destroy( &ahead->changed );
+  xfree( ahead->slots );
+  xfree( ahead );
+
+  handle->ahead = NULL;
+  if( handle->db != NULL )
+  {
+    handle->db->reading_ahead = 0;
+    static_finish_deferred( handle->db );
+  }
+}
+#endif
+
+static void
+static_csv_exec( sqlite *db, const char *sql )
+{
+  char *errmsg = NULL;
+  int   result;
+
+  result = sqlite_exec( db, sql, NULL, NULL, &errmsg );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+}
+
+static void
+static_csv_append( csv_import_state *state, char c )
+{
+  if( state->length + 1 >= state->capacity )
+  {
+    state->capacity = ( state->capacity + 1 ) * 2;
+    REALLOC_N( state->record, char, state->capacity );
+  }
+  state->record[ state->length++ ] = c;
+}
+
+static void
+static_csv_end_field( csv_import_state *state )
+{
+  if( state->fields == state->max_fields )
+  {
+    state->max_fields = ( state->max_fields + 4 ) * 2;
+    REALLOC_N( state->offsets, long, state->max_fields );
+  }
+
+  if( state->length == state->start && !state->quoted )
+    state->offsets[ state->fields ] = -1;
+  else
+    state->offsets[ state->fields ] = state->start;
+
+  static_csv_append( state, '\0' );
+  state->fields++;
+  state->start = state->length;
+  state->quoted = 0;
+  state->parse = CSV_FIELD_START;
+}
+
+/* Compiles the INSERT statement for the records: into the columns named by
+ * the current record, if it is a header, or else into the first columns of
+ * the table, as many as the current record has fields. */
+static void
+static_csv_prepare_insert( csv_import_state *state )
+{
+  VALUE       sql;
+  const char *tail;
+  const char *name;
+  char       *errmsg = NULL;
+  char       *quoted;
+  int         result;
+  int         index;
+
+  quoted = sqlite_mprintf( "INSERT INTO '%q'", STR2CSTR( state->table ) );
+  sql = rb_str_new2( quoted );
+  sqlite_freemem( quoted );
+
+  if( state->header )
+  {
+    rb_str_cat2( sql, " (" );
+    for( index = 0; index < state->fields; index++ )
+    {
+      if( state->offsets[index] < 0 )
+        static_raise_db_error( -1, "line %ld: empty column name",
+          state->line );
+
+      name = state->record + state->offsets[index];
+      quoted = sqlite_mprintf( "%s'%q'", index > 0 ? "," : "", name );
+      rb_str_cat2( sql, quoted );
+      sqlite_freemem( quoted );
+    }
+    rb_str_cat2( sql, ")" );
+  }
+
+  rb_str_cat2( sql, " VALUES(" );
+  for( index = 0; index < state->fields; index++ )
+    rb_str_cat2( sql, index > 0 ? ",?" : "?" );
+  rb_str_cat2( sql, ")" );
+
+  result = sqlite_compile( state->db, STR2CSTR( sql ), &tail, &state->vm,
+    &errmsg );
+  if( result != SQLITE_OK )
+  {
+    state->vm = NULL;
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  state->expected = state->fields;
+  if( state->header )
+    state->single = ( state->fields == 1 );
+}
+
+/* Returns the number of columns of the table being imported into. */
+static int
+static_csv_table_columns( csv_import_state *state )
+{
+  sqlite_vm   *vm = NULL;
+  const char **values;
+  const char **metadata;
+  const char  *tail;
+  char        *errmsg = NULL;
+  char        *sql;
+  int          columns = 0;
+  int          result;
+
+  sql = sqlite_mprintf( "SELECT * FROM '%q' LIMIT 0",
+    STR2CSTR( state->table ) );
+  result = sqlite_compile( state->db, sql, &tail, &vm, &errmsg );
+  sqlite_freemem( sql );
+
+  if( result == SQLITE_OK )
+  {
+    result = sqlite_step( vm, &columns, &values, &metadata );
+    result = static_finalize_vm( vm, result, &errmsg );
+  }
+
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  return columns;
+}
+
+static void
+static_csv_end_record( csv_import_state *state )
+{
+  const char **values;
+  const char **metadata;
+  char        *errmsg = NULL;
+  int          columns;
+  int          result;
+  int          index;
+
+  if( state->vm == NULL )
+  {
+    static_csv_prepare_insert( state );
+    if( state->header )
+      goto next_record;
+  }
+
+  if( state->fields != state->expected )
+    static_raise_db_error( -1, "line %ld: expected %d fields, found %d",
+      state->line, state->expected, state->fields );
+
+  /* the record buffer is not touched again until the statement has been
+   * stepped, so there is no need to have SQLite copy the values */
+  for( index = 0, result = SQLITE_OK;
+       index < state->fields && result == SQLITE_OK;
+       index++ )
+  {
+    long offset = state->offsets[index];
+    result = sqlite_bind( state->vm, index+1,
+      offset < 0 ? NULL : state->record + offset, -1, 0 );
+  }
+
+  if( result == SQLITE_OK )
+    result = sqlite_step( state->vm, &columns, &values, &metadata );
+  if( result == SQLITE_DONE )
+    result = sqlite_reset( state->vm, &errmsg );
+
+  if( result != SQLITE_OK )
+  {
+    result = static_finalize_vm( state->vm, result, &errmsg );
+    state->vm = NULL;
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  state->count++;
+  if( !state->outer_transaction && state->batch_size > 0 &&
+      state->count % state->batch_size == 0 )
+  {
+    state->in_transaction = 0;
+    static_csv_exec( state->db, "COMMIT" );
+    static_csv_exec( state->db, "BEGIN" );
+    state->in_transaction = 1;
+  }
+
+next_record:
+  state->length = 0;
+  state->start = 0;
+  state->fields = 0;
+}
+
+static VALUE
+static_csv_import_body( VALUE data )
+{
+  csv_import_state *state = (csv_import_state*)data;
+  static ID         idRead = 0;
+  VALUE             chunk;
+  const char       *text;
+  long              length;
+  long              index;
+  char              c;
+
+  if( !idRead ) idRead = rb_intern( "read" );
+
+  /* without a header, the fields fill every column of the table */
+  if( !state->header )
+    state->single = ( static_csv_table_columns( state ) == 1 );
+
+  state->in_transaction = static_begin_transaction( state->db );
+  state->outer_transaction = !state->in_transaction;
+
+  while( ( chunk = rb_funcall( state->io, idRead, 1,
+                               INT2FIX( OUTPUT_BUFFER_SIZE ) ) ) != Qnil )
+  {
+    text = StringValuePtr( chunk );
+    length = RSTRING(chunk)->len;
+
+    for( index = 0; index < length; index++ )
+    {
+      c = text[index];
+
+      switch( state->parse )
+      {
+        case CSV_QUOTED:
+          if( c == '"' )
+            state->parse = CSV_QUOTE;
+          else
+            static_csv_append( state, c );
+          if( c == '\n' )
+            state->line++;
+          continue;
+
+        case CSV_QUOTE:
+          if( c == '"' )
+          {
+            static_csv_append( state, c );
+            state->parse = CSV_QUOTED;
+            continue;
+          }
+          break;
+
+        case CSV_FIELD_START:
+          if( c == '"' )
+          {
+            state->quoted = 1;
+            state->parse = CSV_QUOTED;
+            continue;
+          }
+          /* a blank line holds no record at all, unless there is only
+           * one column (when it is a NULL, as #export_csv writes it) */
+          if( c == '\n' && state->fields == 0 && !state->single )
+          {
+            state->line++;
+            continue;
+          }
+          break;
+      }
+
+      if( c == state->separator )
+      {
+        static_csv_end_field( state );
+      }
+      else if( c == '\n' )
+      {
+        static_csv_end_field( state );
+        static_csv_end_record( state );
+        state->line++;
+      }
+      else if( c != '\r' )
+      {
+        static_csv_append( state, c );
+        state->parse = CSV_UNQUOTED;
+      }
+    }
+  }
+
+  if( state->parse == CSV_QUOTED )
+    static_raise_db_error( -1, "line %ld: unterminated quoted field",
+      state->line );
+
+  /* the last record need not end with a newline */
+  if( state->parse != CSV_FIELD_START || state->fields > 0 )
+  {
+    static_csv_end_field( state );
+    static_csv_end_record( state );
+  }
+
+  if( state->in_transaction )
+  {
+    state->in_transaction = 0;
+    static_csv_exec( state->db, "COMMIT" );
+  }
+
+  return LONG2NUM( state->count );
+}
+
+static VALUE
+static_csv_import_cleanup( VALUE data )
+{
+  csv_import_state *state = (csv_import_state*)data;
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  if( state->in_transaction )
+    sqlite_exec( state->db, "ROLLBACK", NULL, NULL, NULL );
+
+  if( state->record != NULL )
+    xfree( state->record );
+  if( state->offsets != NULL )
+    xfree( state->offsets );
+
+  return Qnil;
+}
+
+/* Appends the given value as a CSV field, quoting it if it is empty or
+ * contains the separator, a quote, or a line break. NULL is appended as an
+ * empty (unquoted) field. */
+static void
+static_buffer_append_csv( output_buffer *buffer, const char *value,
+  char separator )
+{
+  const char *p;
+  const char *start;
+
+  if( value == NULL )
+    return;
+
+  for( p = value; *p; p++ )
+  {
+    if( *p == separator || *p == '"' || *p == '\n' || *p == '\r' )
+      break;
+  }
+
+  if( *p == '\0' && p != value )
+  {
+    static_buffer_append( buffer, value, p - value );
+    return;
+  }
+
+  static_buffer_append( buffer, "\"", 1 );
+  for( start = p = value; *p; p++ )
+  {
+    if( *p == '"' )
+    {
+      static_buffer_append( buffer, start, p - start + 1 );
+      start = p;
+    }
+  }
+  static_buffer_append( buffer, start, p - start );
+  static_buffer_append( buffer, "\"", 1 );
+}
+
+static VALUE
+static_csv_export_body( VALUE data )
+{
+  csv_export_state  *state = (csv_export_state*)data;
+  const char       **values;
+  const char       **metadata;
+  const char        *tail;
+  char              *errmsg = NULL;
+  long               count = 0;
+  int                columns;
+  int                column;
+  int                result;
+
+  result = sqlite_compile( state->db, state->sql, &tail, &state->vm,
+    &errmsg );
+  if( result != SQLITE_OK )
+  {
+    state->vm = NULL;
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  result = sqlite_step( state->vm, &columns, &values, &metadata );
+
+  if( state->header && ( result == SQLITE_ROW || result == SQLITE_DONE ) )
+  {
+    for( column = 0; column < columns; column++ )
+    {
+      if( column > 0 )
+        static_buffer_append( &state->out, &state->separator, 1 );
+      static_buffer_append_csv( &state->out, metadata[column],
+        state->separator );
+    }
+    static_buffer_append( &state->out, "\n", 1 );
+  }
+
+  while( result == SQLITE_ROW )
+  {
+    for( column = 0; column < columns; column++ )
+    {
+      if( column > 0 )
+        static_buffer_append( &state->out, &state->separator, 1 );
+      static_buffer_append_csv( &state->out, values[column],
+        state->separator );
+    }
+    static_buffer_append( &state->out, "\n", 1 );
+    count++;
+
+    result = sqlite_step( state->vm, &columns, &values, &metadata );
+  }
+
+  result = static_finalize_vm( state->vm, result, &errmsg );
+  state->vm = NULL;
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  static_buffer_flush( &state->out );
+
+  return LONG2NUM( count );
+}
+
+static VALUE
+static_csv_export_cleanup( VALUE data )
+{
+  csv_export_state *state = (csv_export_state*)data;
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  return Qnil;
+}
+
+static VALUE
+static_protected_progress_callback( VALUE handler )
+{
+  return rb_funcall( handler, idCall, 0 );
+}
+
+/* Invokes the Ruby progress handler. Since an exception may not propagate
+ * through SQLite, one raised by the handler aborts the statement instead.
+ * As for the busy handler, the database is marked as being in a handler
+ * meanwhile. */
+static int
+static_progress_handler( void *cookie )
+{
+  db_handle *db = (db_handle*)cookie;
+  int        exception = 0;
+
+  db->in_handler++;
+  rb_protect( static_protected_progress_callback, db->progress, &exception );
+  db->in_handler--;
+
+  return ( exception ? 1 : 0 );
+}
+
+/* Finds the next word in the text, starting at *text: a run of letters and
+ * digits (bytes above 0x7F are taken to be parts of UTF-8 encoded letters).
+ * The word is copied into +term+, in lower case and cut short at
+ * FTS_MAX_TERM bytes, and *text is moved past it. Returns the length of the
+ * word, or 0 if the text holds no more words. */
+static int
+static_fts_next_word( const char **text, char *term )
+{
+  const unsigned char *p = (const unsigned char*)*text;
+  int                  length = 0;
+
+  while( *p && !( *p > 0x7F || isalnum( *p ) ) )
+    p++;
+
+  while( *p && ( *p > 0x7F || isalnum( *p ) ) )
+  {
+    if( length < FTS_MAX_TERM )
+      term[ length++ ] = tolower( *p );
+    p++;
+  }
+
+  term[ length ] = '\0';
+  *text = (const char*)p;
+
+  return length;
+}
+
+static unsigned long
+static_fts_hash( const char *term )
+{
+  unsigned long hash = 5381;
+
+  while( *term )
+    hash = ( ( hash << 5 ) + hash ) + (unsigned char)*term++;
+
+  return hash;
+}
+
+static void
+static_fts_rehash( fts_terms *set )
+{
+  fts_term **buckets;
+  fts_term  *entry;
+  long       nbuckets;
+  long       index;
+
+  nbuckets = ( set->nbuckets > 0 ? set->nbuckets * 4 : 64 );
+  buckets = ALLOC_N( fts_term*, nbuckets );
+  MEMZERO( buckets, fts_term*, nbuckets );
+
+  for( entry = set->first; entry != NULL; entry = entry->next )
+  {
+    index = entry->hash % nbuckets;
+    entry->chain = buckets[ index ];
+    buckets[ index ] = entry;
+  }
+
+  if( set->buckets != NULL )
+    xfree( set->buckets );
+  set->buckets = buckets;
+  set->nbuckets = nbuckets;
+}
+
+/* Returns the entry for the given word in the set, adding it (with no
+ * postings) if there is none and +create+ is true. */
+static fts_term*
+static_fts_term( fts_terms *set, const char *term, int create )
+{
+  fts_term      *entry;
+  unsigned long  hash;
+  long           index;
+
+  hash = static_fts_hash( term );
+
+  if( set->nbuckets > 0 )
+  {
+    for( entry = set->buckets[ hash % set->nbuckets ];
+         entry != NULL;
+         entry = entry->chain )
+    {
+      if( entry->hash == hash && strcmp( entry->term, term ) == 0 )
+        return entry;
+    }
+  }
+
+  if( !create )
+    return NULL;
+
+  if( set->size >= set->nbuckets * 2 )
+    static_fts_rehash( set );
+
+  /* the entry is linked in before its word is copied, so that the set can
+   * always be freed */
+  entry = ALLOC( fts_term );
+  MEMZERO( entry, fts_term, 1 );
+  entry->hash = hash;
+  index = hash % set->nbuckets;
+  entry->chain = set->buckets[ index ];
+  set->buckets[ index ] = entry;
+  entry->next = set->first;
+  set->first = entry;
+  set->size++;
+
+  entry->term = ALLOC_N( char, strlen( term ) + 1 );
+  strcpy( entry->term, term );
+
+  return entry;
+}
+
+/* Removes every word from the set. */
+static void
+static_fts_clear( fts_terms *set )
+{
+  fts_term *entry;
+  fts_term *next;
+
+  for( entry = set->first; entry != NULL; entry = next )
+  {
+    next = entry->next;
+    if( entry->term != NULL )
+      xfree( entry->term );
+    if( entry->postings != NULL )
+      xfree( entry->postings );
+    xfree( entry );
+  }
+
+  if( set->buckets != NULL )
+    MEMZERO( set->buckets, fts_term*, set->nbuckets );
+  set->first = NULL;
+  set->size = 0;
+}
+
+static void
+static_fts_free( fts_terms *set )
+{
+  static_fts_clear( set );
+
+  if( set->buckets != NULL )
+    xfree( set->buckets );
+  set->buckets = NULL;
+  set->nbuckets = 0;
+}
+
+static void
+static_fts_add_posting( fts_term *term, long doc, long freq )
+{
+  if( term->count == term->capacity )
+  {
+    term->capacity = ( term->capacity + 4 ) * 2;
+    REALLOC_N( term->postings, fts_posting, term->capacity );
+  }
+
+  term->postings[ term->count ].doc = doc;
+  term->postings[ term->count ].freq = freq;
+  term->count++;
+}
+
+/* Adds the words of the text to the set, counting the occurrences of each
+ * in document +doc+. */
+static void
+static_fts_tokenize( fts_terms *set, const char *text, long doc )
+{
+  char      term[ FTS_MAX_TERM + 1 ];
+  fts_term *entry;
+
+  while( static_fts_next_word( &text, term ) > 0 )
+  {
+    entry = static_fts_term( set, term, 1 );
+    if( entry->count > 0 && entry->postings[ entry->count-1 ].doc == doc )
+      entry->postings[ entry->count-1 ].freq++;
+    else
+      static_fts_add_posting( entry, doc, 1 );
+  }
+}
+
+/* Posting lists are stored as text. Each number is written five bits at a
+ * time, most significant first, as one of the characters 0x40 to 0x5F,
+ * except for its last five bits, which are written as one of 0x60 to 0x7F.
+ * A list holds, for each posting, the difference between its document and
+ * the one before, followed by the number of occurrences; the first
+ * document is written with its sign in the lowest bit, since rowids may be
+ * negative. A posting usually takes two or three bytes. */
+static void
+static_fts_encode_number( VALUE text, unsigned long n )
+{
+  char digits[ 16 ];
+  char encoded[ 16 ];
+  int  count = 0;
+  int  index;
+
+  do {
+    digits[ count++ ] = (char)( n & 31 );
+    n >>= 5;
+  } while( n != 0 );
+
+  for( index = 0; index < count; index++ )
+    encoded[ index ] = ( index == count-1 ? 0x60 : 0x40 ) |
+      digits[ count-1-index ];
+
+  rb_str_cat( text, encoded, count );
+}
+
+static VALUE
+static_fts_encode( fts_term *list )
+{
+  VALUE text;
+  long  doc;
+  long  index;
+
+  text = rb_str_buf_new( list->count * 3 );
+
+  for( index = 0; index < list->count; index++ )
+  {
+    doc = list->postings[ index ].doc;
+    if( index == 0 )
+      static_fts_encode_number( text, doc < 0 ?
+        ( (unsigned long)-( doc + 1 ) << 1 ) | 1 : (unsigned long)doc << 1 );
+    else
+      static_fts_encode_number( text,
+        (unsigned long)( doc - list->postings[ index-1 ].doc ) );
+
+    static_fts_encode_number( text,
+      (unsigned long)list->postings[ index ].freq );
+  }
+
+  return text;
+}
+
+/* Replaces the postings of the list with those encoded in the text (which
+ * may be NULL, for an empty list). */
+static void
+static_fts_decode( fts_term *list, const char *text )
+{
+  const unsigned char *p;
+  unsigned long        n = 0;
+  long                 doc = 0;
+  int                  have_doc = 0;
+
+  list->count = 0;
+  if( text == NULL )
+    return;
+
+  for( p = (const unsigned char*)text; *p; p++ )
+  {
+    n = ( n << 5 ) | ( *p & 31 );
+    if( !( *p & 0x20 ) )
+      continue;
+
+    if( have_doc )
+      static_fts_add_posting( list, doc, (long)n );
+    else if( list->count == 0 )
+      doc = ( n & 1 ) ? -(long)( n >> 1 ) - 1 : (long)( n >> 1 );
+    else
+      doc += (long)n;
+
+    have_doc = !have_doc;
+    n = 0;
+  }
+}
+
+/* Makes the changes (ordered by document, with the removal of a document
+ * from the list before its addition to it) to the +existing+ posting list,
+ * leaving the result in +merged+. */
+static void
+static_fts_merge( fts_term *existing, fts_term *changes, fts_term *merged )
+{
+  long i = 0;
+  long j = 0;
+  long doc;
+  long freq;
+
+  merged->count = 0;
+
+  while( i < existing->count || j < changes->count )
+  {
+    if( j < changes->count && ( i == existing->count ||
+        changes->postings[j].doc <= existing->postings[i].doc ) )
+    {
+      /* the last change made to a document is the one that counts */
+      doc = changes->postings[j].doc;
+      for( freq = 0; j < changes->count && changes->postings[j].doc == doc; j++ )
+        freq = changes->postings[j].freq;
+
+      if( i < existing->count && existing->postings[i].doc == doc )
+        i++;
+      if( freq > 0 )
+        static_fts_add_posting( merged, doc, freq );
+    }
+    else
+    {
+      static_fts_add_posting( merged, existing->postings[i].doc,
+        existing->postings[i].freq );
+      i++;
+    }
+  }
+}
+
+/* Compiles the given SQL, which is released with sqlite_freemem. */
+static sqlite_vm*
+static_fts_compile( sqlite *db, char *sql )
+{
+  sqlite_vm  *vm = NULL;
+  const char *tail;
+  char       *errmsg = NULL;
+  int         result;
+
+  if( sql == NULL )
+    rb_raise( rb_eNoMemError, "out of memory" );
+
+  result = sqlite_compile( db, sql, &tail, &vm, &errmsg );
+  sqlite_freemem( sql );
+
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
+
+  return vm;
+}
 
-/*
- * Document-class: SQLite::Exceptions::FormatException
- *
- * From the SQLite documentation:
- *
- * "Auxiliary database format error"
- */
+/* Binds the given values to the parameters of the (reset) statement, and
+ * steps it. Returns the values of the row it produced, or NULL if it
+ * produced none. */
+static const char**
+static_fts_step( sqlite_vm *vm, int count, const char **params )
+{
+  const char **values;
+  const char **metadata;
+  char        *errmsg = NULL;
+  int          columns;
+  int          result = SQLITE_OK;
+  int          index;
 
-/*
- * Document-class: SQLite::Exceptions::RangeException
- *
- * From the SQLite documentation:
- *
- * "2nd parameter to sqlite_bind out of range"
- */
+  for( index = 0; index < count && result == SQLITE_OK; index++ )
+    result = sqlite_bind( vm, index+1, params[index], -1, 1 );
 
-/*
- * Document-class: SQLite::Exceptions::NotADatabaseException
- *
- * From the SQLite documentation:
- *
- * "File opened that is not a database file"
- */
+  if( result == SQLITE_OK )
+    result = sqlite_step( vm, &columns, &values, &metadata );
+
+  if( result == SQLITE_ROW )
+    return values;
+  if( result == SQLITE_DONE )
+    return NULL;
+
+  result = sqlite_reset( vm, &errmsg );
+  static_raise_db_error2( result == SQLITE_OK ? SQLITE_ERROR : result,
+    &errmsg );
+  /* "raise" does not return */
+  return NULL;
+}
 
 static void
-static_configure_exception_classes()
+static_fts_reset( sqlite_vm *vm )
 {
-  int i;
+  char *errmsg = NULL;
+  int   result;
 
-  for( i = 1; g_sqlite_exceptions[ i ].name != NULL; i++ )
+  result = sqlite_reset( vm, &errmsg );
+  if( result != SQLITE_OK )
   {
-    char name[ 128 ];
-
-    sprintf( name, "%sException", g_sqlite_exceptions[ i ].name );
-    g_sqlite_exceptions[ i ].object = rb_define_class_under( mExceptions, name, DatabaseException );
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
   }
 }
 
+/* Executes the given SQL, which is released with sqlite_freemem. */
 static void
-static_raise_db_error( int code, char *msg, ... )
+static_fts_exec( sqlite *db, char *sql )
 {
-  va_list args;
-  char message[ 2048 ];
-  VALUE exc;
+  char *errmsg = NULL;
+  int   result;
 
-  va_start( args, msg );
-  vsnprintf( message, sizeof( message ), msg, args );
-  va_end( args );
+  if( sql == NULL )
+    rb_raise( rb_eNoMemError, "out of memory" );
 
-  exc = ( code <= 0 ? DatabaseException : g_sqlite_exceptions[ code ].object );
+  result = sqlite_exec( db, sql, NULL, NULL, &errmsg );
+  sqlite_freemem( sql );
 
-  rb_raise( exc, message );
+  if( result != SQLITE_OK )
+  {
+    static_raise_db_error2( result, &errmsg );
+    /* "raise" does not return */
+  }
 }
 
-static void
-static_raise_db_error2( int code, char **msg )
+static VALUE
+static_fts_sync_body( VALUE data )
 {
-  VALUE err = rb_str_new2( *msg ? *msg : "(no message)" );
-  if( *msg ) free( *msg );
-  *msg = NULL;
+  fts_sync_state  *state = (fts_sync_state*)data;
+  const char      *table = STR2CSTR( state->table );
+  const char     **values;
+  const char      *params[ 3 ];
+  const char      *p;
+  char             doc[ 32 ];
+  char             count[ 32 ];
+  char             term[ FTS_MAX_TERM + 1 ];
+  fts_term        *entry;
+  VALUE            sql;
+  VALUE            words;
+  VALUE            text;
+  long             delta = 0;
+  long             index;
+  int              columns;
+  int              column;
+  int              indexed;
+
+  state->vms[ FTS_PENDING ] = static_fts_compile( state->db, sqlite_mprintf(
+    "SELECT doc FROM '%q_fts_pending' ORDER BY doc", table ) );
+
+  while( ( values = static_fts_step( state->vms[ FTS_PENDING ], 0,
+                                     NULL ) ) != NULL )
+  {
+    if( state->ndocs == state->capacity )
+    {
+      state->capacity = ( state->capacity + 16 ) * 2;
+      REALLOC_N( state->docs, long, state->capacity );
+    }
+    state->docs[ state->ndocs++ ] = atol( values[0] );
+  }
 
-  static_raise_db_error( code, "%s", STR2CSTR( err ) );
+  if( state->ndocs == 0 )
+    return INT2FIX( 0 );
+
+  /* the column names have been checked by Database#create_fts_index */
+  columns = RARRAY(state->columns)->len;
+  sql = rb_str_new2( "SELECT " );
+  for( column = 0; column < columns; column++ )
+  {
+    if( column > 0 )
+      rb_str_cat2( sql, ", " );
+    rb_str_cat2( sql, STR2CSTR( RARRAY(state->columns)->ptr[column] ) );
+  }
+  rb_str_cat2( sql, " FROM '%q' WHERE rowid = ?" );
+
+  state->vms[ FTS_TEXT ] = static_fts_compile( state->db,
+    sqlite_mprintf( STR2CSTR( sql ), table ) );
+  state->vms[ FTS_OLD_WORDS ] = static_fts_compile( state->db, sqlite_mprintf(
+    "SELECT words FROM '%q_fts_docs' WHERE doc = ?", table ) );
+  state->vms[ FTS_PUT_DOC ] = static_fts_compile( state->db, sqlite_mprintf(
+    "INSERT OR REPLACE INTO '%q_fts_docs' VALUES(?,?)", table ) );
+  state->vms[ FTS_DELETE_DOC ] = static_fts_compile( state->db, sqlite_mprintf(
+    "DELETE FROM '%q_fts_docs' WHERE doc = ?", table ) );
+  state->vms[ FTS_GET_TERM ] = static_fts_compile( state->db, sqlite_mprintf(
+    "SELECT postings FROM '%q_fts_terms' WHERE term = ?", table ) );
+  state->vms[ FTS_PUT_TERM ] = static_fts_compile( state->db, sqlite_mprintf(
+    "INSERT OR REPLACE INTO '%q_fts_terms' VALUES(?,?,?)", table ) );
+  state->vms[ FTS_DELETE_TERM ] = static_fts_compile( state->db,
+    sqlite_mprintf( "DELETE FROM '%q_fts_terms' WHERE term = ?", table ) );
+
+  /* first, work out the changes to the posting lists: each document is taken
+   * out of the lists of the words it was indexed under before, and added to
+   * the lists of the words it holds now */
+  for( index = 0; index < state->ndocs; index++ )
+  {
+    snprintf( doc, sizeof( doc ), "%ld", state->docs[index] );
+    params[0] = doc;
+
+    indexed = 0;
+    values = static_fts_step( state->vms[ FTS_OLD_WORDS ], 1, params );
+    if( values != NULL && values[0] != NULL )
+    {
+      indexed = 1;
+      for( p = values[0]; static_fts_next_word( &p, term ) > 0; )
+        static_fts_add_posting( static_fts_term( &state->changes, term, 1 ),
+          state->docs[index], 0 );
+    }
+    static_fts_reset( state->vms[ FTS_OLD_WORDS ] );
+
+    static_fts_clear( &state->words );
+    values = static_fts_step( state->vms[ FTS_TEXT ], 1, params );
+    if( values != NULL )
+    {
+      for( column = 0; column < columns; column++ )
+      {
+        if( values[column] != NULL )
+          static_fts_tokenize( &state->words, values[column],
+            state->docs[index] );
+      }
+    }
+    static_fts_reset( state->vms[ FTS_TEXT ] );
+
+    if( state->words.size > 0 )
+    {
+      words = rb_str_buf_new( 0 );
+      for( entry = state->words.first; entry != NULL; entry = entry->next )
+      {
+        static_fts_add_posting(
+          static_fts_term( &state->changes, entry->term, 1 ),
+          state->docs[index], entry->postings[0].freq );
+        if( RSTRING(words)->len > 0 )
+          rb_str_cat( words, " ", 1 );
+        rb_str_cat2( words, entry->term );
+      }
+
+      params[1] = STR2CSTR( words );
+      static_fts_step( state->vms[ FTS_PUT_DOC ], 2, params );
+      static_fts_reset( state->vms[ FTS_PUT_DOC ] );
+      if( !indexed )
+        delta++;
+    }
+    else if( indexed )
+    {
+      static_fts_step( state->vms[ FTS_DELETE_DOC ], 1, params );
+      static_fts_reset( state->vms[ FTS_DELETE_DOC ] );
+      delta--;
+    }
+  }
+
+  /* then make the changes, one posting list at a time */
+  for( entry = state->changes.first; entry != NULL; entry = entry->next )
+  {
+    params[0] = entry->term;
+    values = static_fts_step( state->vms[ FTS_GET_TERM ], 1, params );
+    static_fts_decode( &state->existing, values != NULL ? values[0] : NULL );
+    static_fts_reset( state->vms[ FTS_GET_TERM ] );
+
+    static_fts_merge( &state->existing, entry, &state->merged );
+
+    if( state->merged.count > 0 )
+    {
+      text = static_fts_encode( &state->merged );
+      snprintf( count, sizeof( count ), "%ld", state->merged.count );
+      params[1] = count;
+      params[2] = STR2CSTR( text );
+      static_fts_step( state->vms[ FTS_PUT_TERM ], 3, params );
+      static_fts_reset( state->vms[ FTS_PUT_TERM ] );
+    }
+    else if( state->existing.count > 0 )
+    {
+      static_fts_step( state->vms[ FTS_DELETE_TERM ], 1, params );
+      static_fts_reset( state->vms[ FTS_DELETE_TERM ] );
+    }
+  }
+
+  static_fts_exec( state->db, sqlite_mprintf( "UPDATE '%q_fts_config' "
+    "SET value = value + %ld WHERE name = 'documents'", table, delta ) );
+  static_fts_exec( state->db, sqlite_mprintf(
+    "DELETE FROM '%q_fts_pending'", table ) );
+
+  return LONG2NUM( state->ndocs );
 }
 
-static void
-static_free_vm( sqlite_vm *vm )
+static VALUE
+static_fts_sync_cleanup( VALUE data )
 {
-  /* FIXME: can sqlite_finalize be called with a second parameter of NULL? */
-  sqlite_finalize( vm, NULL );
+  fts_sync_state *state = (fts_sync_state*)data;
+  int             index;
+
+  for( index = 0; index < FTS_STATEMENTS; index++ )
+  {
+    if( state->vms[index] != NULL )
+      sqlite_finalize( state->vms[index], NULL );
+  }
+
+  static_fts_free( &state->changes );
+  static_fts_free( &state->words );
+
+  if( state->existing.postings != NULL )
+    xfree( state->existing.postings );
+  if( state->merged.postings != NULL )
+    xfree( state->merged.postings );
+  if( state->docs != NULL )
+    xfree( state->docs );
+
+  return Qnil;
 }
 
 static int
-static_busy_handler( void* cookie, const char *entity, int times )
+static_fts_compare_lists( const void *a, const void *b )
 {
-  VALUE handler = (VALUE)cookie;
-  VALUE result;
+  long x = (*(fts_term**)a)->count;
+  long y = (*(fts_term**)b)->count;
 
-  result = rb_funcall( handler, idCall, 2, rb_str_new2( entity ),
-    INT2FIX( times ) );
+  return ( x < y ? -1 : x > y );
+}
 
-  if( result == Qnil || result == Qfalse )
-    return 0;
+static int
+static_fts_compare_hits( const void *a, const void *b )
+{
+  const fts_hit *x = (const fts_hit*)a;
+  const fts_hit *y = (const fts_hit*)b;
 
-  return 1;
+  if( x->score != y->score )
+    return ( x->score > y->score ? -1 : 1 );
+
+  return ( x->doc < y->doc ? -1 : x->doc > y->doc );
 }
 
 static VALUE
-static_protected_function_callback( VALUE args )
+static_fts_search_body( VALUE data )
 {
-  VALUE proc;
-  VALUE proc_args;
+  fts_search_state  *state = (fts_search_state*)data;
+  const char        *table = STR2CSTR( state->table );
+  const char       **values;
+  const char        *params[ 1 ];
+  fts_term          *entry;
+  fts_hit           *hits;
+  double             documents;
+  double             idf;
+  VALUE              result;
+  long               nlists = 0;
+  long               nhits;
+  long               index;
+  long               i, j, k;
+
+  result = rb_ary_new();
+
+  static_fts_tokenize( &state->words, STR2CSTR( state->query ), 0 );
+  if( state->words.size == 0 )
+    return result;
+
+  state->vm = static_fts_compile( state->db, sqlite_mprintf(
+    "SELECT value FROM '%q_fts_config' WHERE name = 'documents'", table ) );
+  values = static_fts_step( state->vm, 0, NULL );
+  documents = ( values != NULL && values[0] != NULL ? atof( values[0] ) : 0 );
+  sqlite_finalize( state->vm, NULL );
+  state->vm = NULL;
+
+  /* read the posting list of each word (in place of its postings in the
+   * query); a word that no document holds means there are no matches */
+  state->vm = static_fts_compile( state->db, sqlite_mprintf(
+    "SELECT postings FROM '%q_fts_terms' WHERE term = ?", table ) );
+  state->lists = ALLOC_N( fts_term*, state->words.size );
+
+  for( entry = state->words.first; entry != NULL; entry = entry->next )
+  {
+    params[0] = entry->term;
+    values = static_fts_step( state->vm, 1, params );
+    static_fts_decode( entry, values != NULL ? values[0] : NULL );
+    static_fts_reset( state->vm );
+
+    if( entry->count == 0 )
+      return result;
+    state->lists[ nlists++ ] = entry;
+  }
 
-  proc = rb_ary_entry( args, 0 );
-  proc_args = rb_ary_entry( args, 1 );
+  /* start from the rarest word, and keep only the documents that hold each
+   * of the others too */
+  qsort( state->lists, nlists, sizeof( fts_term* ), static_fts_compare_lists );
+
+  nhits = state->lists[0]->count;
+  hits = state->hits = ALLOC_N( fts_hit, nhits );
+  for( i = 0; i < nhits; i++ )
+  {
+    hits[i].doc = state->lists[0]->postings[i].doc;
+    hits[i].score = 0.0;
+  }
+
+  for( index = 0; index < nlists && nhits > 0; index++ )
+  {
+    entry = state->lists[index];
+    idf = log( 1.0 + documents / entry->count );
+
+    for( i = j = k = 0; i < nhits && j < entry->count; )
+    {
+      if( hits[i].doc < entry->postings[j].doc )
+        i++;
+      else if( hits[i].doc > entry->postings[j].doc )
+        j++;
+      else
+      {
+        hits[k].doc = hits[i].doc;
+        hits[k].score = hits[i].score +
+          ( 1.0 + log( (double)entry->postings[j].freq ) ) * idf;
+        i++, j++, k++;
+      }
+    }
+
+    nhits = k;
+  }
+
+  qsort( hits, nhits, sizeof( fts_hit ), static_fts_compare_hits );
+
+  for( i = 0; i < nhits; i++ )
+    rb_ary_push( result, rb_assoc_new( LONG2NUM( hits[i].doc ),
+      rb_float_new( hits[i].score ) ) );
+
+  return result;
+}
+
+static VALUE
+static_fts_search_cleanup( VALUE data )
+{
+  fts_search_state *state = (fts_search_state*)data;
+
+  if( state->vm != NULL )
+    sqlite_finalize( state->vm, NULL );
+
+  static_fts_free( &state->words );
+
+  if( state->lists != NULL )
+    xfree( state->lists );
+  if( state->hits != NULL )
+    xfree( state->hits );
 
-  rb_apply( proc, idCall, proc_args );
-  
   return Qnil;
 }
 
 static void
-static_function_callback( sqlite_func *func, int argc, const char **argv )
+static_fts_match_function( sqlite_func *func, int argc, const char **argv )
 {
-  VALUE proc;
-  VALUE args;
-  VALUE protect_args;
-  int   index;
-  int   exception = 0;
+  char        words[ FTS_MAX_QUERY ][ FTS_MAX_TERM + 1 ];
+  char        term[ FTS_MAX_TERM + 1 ];
+  long        counts[ FTS_MAX_QUERY ];
+  long        total = 0;
+  const char *p;
+  int         nwords = 0;
+  int         index;
+
+  if( argv[0] == NULL || argv[1] == NULL )
+  {
+    sqlite_set_result_string( func, NULL, -1 );
+    return;
+  }
 
-  proc = (VALUE)sqlite_user_data( func );
-  if( TYPE(proc) == T_ARRAY )
-    proc = rb_ary_entry( proc, 0 );
+  for( p = argv[1]; static_fts_next_word( &p, term ) > 0; )
+  {
+    for( index = 0; index < nwords; index++ )
+    {
+      if( strcmp( words[index], term ) == 0 )
+        break;
+    }
+    if( index < nwords )
+      continue;
 
-  args = rb_ary_new2( argc + 1 );
-  rb_ary_push( args, Data_Wrap_Struct( rb_cData, NULL, NULL, func ) );
+    if( nwords == FTS_MAX_QUERY )
+    {
+      sqlite_set_result_error( func, "too many words in match() query", -1 );
+      return;
+    }
+    strcpy( words[ nwords ], term );
+    counts[ nwords++ ] = 0;
+  }
 
-  for( index = 0; index < argc; index++ )
+  for( p = argv[0]; static_fts_next_word( &p, term ) > 0; )
   {
-    VALUE entry = Qnil;
+    for( index = 0; index < nwords; index++ )
+    {
+      if( strcmp( words[index], term ) == 0 )
+      {
+        counts[index]++;
+        break;
+      }
+    }
+  }
 
-    if( argv[index] )
-      entry = rb_str_new2( argv[index] );
+  for( index = 0; index < nwords; index++ )
+  {
+    if( counts[index] == 0 )
+    {
+      total = 0;
+      break;
+    }
+    total += counts[index];
+  }
 
-    rb_ary_push( args, entry );
+  sqlite_set_result_int( func, (int)total );
+}
+
+#ifdef HAVE_ZLIB_H
+
+/* A compressed value is the length of the original text, as four bytes
+ * (most significant first), followed by the zlib stream, all encoded with
+ * sqlite_encode_binary. */
+static void
+static_compress_function( sqlite_func *func, int argc, const char **argv )
+{
+  unsigned char *deflated;
+  unsigned char *encoded;
+  unsigned long  length;
+  uLongf         size;
+  int            result;
+
+  if( argv[0] == NULL )
+  {
+    sqlite_set_result_string( func, NULL, -1 );
+    return;
   }
 
-  protect_args = rb_ary_new3( 2, proc, args );
-  rb_protect( static_protected_function_callback,
-              protect_args,
-              &exception );
+  length = strlen( argv[0] );
+  size = compressBound( length );
 
-  if( exception )
+  deflated = (unsigned char*)malloc( size + 4 );
+  encoded = (unsigned char*)malloc( 2 + ( 257 * ( size + 4 ) ) / 254 + 1 );
+  if( deflated == NULL || encoded == NULL )
   {
-    sqlite_set_result_error( func, "error occurred while processing function", -1 );
+    free( deflated );
+    free( encoded );
+    sqlite_set_result_error( func, "out of memory", -1 );
+    return;
+  }
+
+  deflated[0] = (unsigned char)( length >> 24 );
+  deflated[1] = (unsigned char)( length >> 16 );
+  deflated[2] = (unsigned char)( length >> 8 );
+  deflated[3] = (unsigned char)length;
+
+  result = compress( deflated + 4, &size, (const Bytef*)argv[0], length );
+  if( result != Z_OK )
+  {
+    free( deflated );
+    free( encoded );
+    sqlite_set_result_error( func, zError( result ), -1 );
+    return;
   }
+
+  sqlite_encode_binary( deflated, (int)size + 4, encoded );
+  sqlite_set_result_string( func, (const char*)encoded, -1 );
+
+  free( deflated );
+  free( encoded );
 }
 
 static void
-static_aggregate_finalize_callback( sqlite_func *func )
+static_uncompress_function( sqlite_func *func, int argc, const char **argv )
 {
-  VALUE  proc;
-  VALUE  args;
-  VALUE  protect_args;
-  int    exception = 0;
+  unsigned char *decoded;
+  char          *inflated;
+  unsigned long  length;
+  uLongf         size;
+  int            count;
+  int            result;
+
+  if( argv[0] == NULL )
+  {
+    sqlite_set_result_string( func, NULL, -1 );
+    return;
+  }
 
-  proc = rb_ary_entry( (VALUE)sqlite_user_data( func ), 1 );
-  args = rb_ary_new3( 1, Data_Wrap_Struct( rb_cData, NULL, NULL, func ) );
+  decoded = (unsigned char*)malloc( strlen( argv[0] ) + 1 );
+  if( decoded == NULL )
+  {
+    sqlite_set_result_error( func, "out of memory", -1 );
+    return;
+  }
 
-  protect_args = rb_ary_new3( 2, proc, args );
+  count = sqlite_decode_binary( (const unsigned char*)argv[0], decoded );
+  if( count < 4 )
+  {
+    free( decoded );
+    sqlite_set_result_error( func, "uncompress: value is not compressed", -1 );
+    return;
+  }
 
-  rb_protect( static_protected_function_callback,
-              protect_args,
-              &exception );
+  length = ( (unsigned long)decoded[0] << 24 ) |
+           ( (unsigned long)decoded[1] << 16 ) |
+           ( (unsigned long)decoded[2] << 8 ) |
+           (unsigned long)decoded[3];
 
-  if( exception )
+  /* zlib cannot inflate data to more than about 1000 times its size, so a
+   * larger length means the value was not produced by compress() */
+  if( length > (unsigned long)( count - 4 ) * 1032 + 64 )
   {
-    sqlite_set_result_error( func, "error occurred while processing aggregate finalize", -1 );
+    free( decoded );
+    sqlite_set_result_error( func, "uncompress: value is not compressed", -1 );
+    return;
+  }
+
+  if( length == 0 )
+  {
+    free( decoded );
+    sqlite_set_result_string( func, "", 0 );
+    return;
+  }
+
+  inflated = (char*)malloc( length + 1 );
+  if( inflated == NULL )
+  {
+    free( decoded );
+    sqlite_set_result_error( func, "out of memory", -1 );
+    return;
+  }
+
+  size = length;
+  result = uncompress( (Bytef*)inflated, &size, decoded + 4, count - 4 );
+  free( decoded );
+
+  if( result != Z_OK || size != length )
+  {
+    free( inflated );
+    sqlite_set_result_error( func, result != Z_OK ? zError( result ) :
+      "uncompress: value is corrupt", -1 );
+    return;
   }
+
+  inflated[ length ] = '\0';
+  sqlite_set_result_string( func, inflated, (int)length );
+  free( inflated );
 }
 
+#endif
+
 /*>=-----------------------------------------------------------------------=<*
  * MODULE INITIALIZATION
  * ------------------------------------------------------------------------
@@ -1281,6 +6968,20 @@ void Init_sqlite_api()
   idColumns = rb_intern( "columns" );
   idTypes = rb_intern( "types" );
   idCall = rb_intern( "call" );
+  idRegexpCache = rb_intern( "regexp_cache" );
+  idConversions = rb_intern( "conversions" );
+  idKinds = rb_intern( "kinds" );
+  idInteger = rb_intern( "integer" );
+  idFloat = rb_intern( "float" );
+  idTime = rb_intern( "time" );
+  idTimeZone = rb_intern( "time_zone" );
+  idParse = rb_intern( "parse" );
+  idUtc = rb_intern( "utc" );
+  idInterns = rb_intern( "interns" );
+  idLazy = rb_intern( "lazy" );
+  idCaller = rb_intern( "caller" );
+  idProgress = rb_intern( "progress" );
+  idBusy = rb_intern( "busy" );
 
   mSQLite = rb_define_module( "SQLite" );
   mExceptions = rb_define_module_under( mSQLite, "Exceptions" );
@@ -1332,4 +7033,60 @@ void Init_sqlite_api()
     static_api_aggregate_context, 1 );
   rb_define_module_function( mAPI, "aggregate_count",
     static_api_aggregate_count, 1 );
+
+  rb_define_module_function( mAPI, "enable_regexp",
+    static_api_enable_regexp, 2 );
+  rb_define_module_function( mAPI, "regexp_cache_stats",
+    static_api_regexp_cache_stats, 1 );
+
+  rb_define_module_function( mAPI, "copy_database",
+    static_api_copy_database, 2 );
+
+  rb_define_module_function( mAPI, "dump", static_api_dump, 2 );
+  rb_define_module_function( mAPI, "restore", static_api_restore, 3 );
+
+  rb_define_module_function( mAPI, "execute_columnar",
+    static_api_execute_columnar, 3 );
+
+  rb_define_module_function( mAPI, "set_conversions",
+    static_api_set_conversions, 2 );
+
+  rb_define_module_function( mAPI, "intern_strings",
+    static_api_intern_strings, 2 );
+
+  rb_define_module_function( mAPI, "set_lazy_rows",
+    static_api_set_lazy_rows, 2 );
+
+  cRawRow = rb_define_class_under( mAPI, "RawRow", rb_cObject );
+  rb_undef_method( CLASS_OF( cRawRow ), "new" );
+  rb_define_method( cRawRow, "[]", static_raw_row_aref, 1 );
+  rb_define_method( cRawRow, "length", static_raw_row_length, 0 );
+  rb_define_method( cRawRow, "to_a", static_raw_row_to_a, 0 );
+
+  rb_define_module_function( mAPI, "set_statement_backtraces",
+    static_api_set_statement_backtraces, 2 );
+  rb_define_module_function( mAPI, "set_lock_warning",
+    static_api_set_lock_warning, 2 );
+  rb_define_module_function( mAPI, "open_statements",
+    static_api_open_statements, 1 );
+
+  rb_define_module_function( mAPI, "profile", static_api_profile, 2 );
+
+  rb_define_module_function( mAPI, "execute", static_api_execute, 2 );
+
+  rb_define_module_function( mAPI, "read_ahead", static_api_read_ahead, 2 );
+
+  rb_define_module_function( mAPI, "import_csv", static_api_import_csv, 4 );
+  rb_define_module_function( mAPI, "export_csv", static_api_export_csv, 4 );
+
+  rb_define_module_function( mAPI, "progress_handler",
+    static_api_progress_handler, 3 );
+
+  rb_define_module_function( mAPI, "enable_match",
+    static_api_enable_match, 1 );
+  rb_define_module_function( mAPI, "fts_sync", static_api_fts_sync, 3 );
+  rb_define_module_function( mAPI, "fts_search", static_api_fts_search, 3 );
+
+  rb_define_module_function( mAPI, "enable_compression",
+    static_api_enable_compression, 1 );
 }
@@ -1,2 +1,4 @@
 require 'sqlite/database'
+require 'sqlite/group_committer'
+require 'sqlite/shard_set'
 require 'sqlite/version'
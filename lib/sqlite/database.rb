@@ -1,6 +1,11 @@
 require 'base64'
 require 'sqlite_api'
 require 'sqlite/pragmas'
+require 'sqlite/index_advisor'
+require 'sqlite/materialized_aggregate'
+require 'sqlite/profile'
+require 'sqlite/query_cache'
+require 'sqlite/schema_catalog'
 require 'sqlite/statement'
 require 'sqlite/translator'
 
@@ -75,6 +80,18 @@ module SQLite
     # as hashes or not. By default, rows are returned as arrays.
     attr_accessor :results_as_hash
 
+    # A boolean that indicates whether the rows returned by #execute should
+    # carry their column names and types (as +fields+ and +types+). It is
+    # +true+ by default. When it is +false+, and neither #results_as_hash nor
+    # type translation is enabled, #execute runs statements that have no bind
+    # variables in a single call to the extension, which is considerably
+    # faster for short queries; the rows are then plain arrays of strings.
+    attr_accessor :decorate_rows
+
+    # The largest array that #execute binds to a single placeholder (see
+    # #execute), or +nil+ for no limit. The default is 500.
+    attr_accessor :in_list_limit
+
     # Create a new Database object that opens the given file. The mode
     # parameter has no meaning yet, and may be omitted. If the file does not
     # exist, it will be created if possible.
@@ -83,10 +100,18 @@ module SQLite
     # (#results_as_hash) and has type translation disabled (#type_translation=).
     def initialize( file_name, mode=0 )
       @handle = SQLite::API.open( file_name, mode )
+      @file_name = file_name
       @closed = false
       @results_as_hash = false
+      @decorate_rows = true
+      @in_list_limit = 500
       @type_translation = false
       @translator = nil
+      @workload = nil
+      @catalog = nil
+      @query_cache = nil
+      @cooperative_rows = nil
+      @compression_enabled = false
     end
 
     # Return the type translator employed by this database instance. Each
@@ -99,6 +124,19 @@ module SQLite
       @translator ||= Translator.new
     end
 
+    # Returns the SchemaCatalog for this database, which caches the schema
+    # (and the table and index pragmas) in memory.
+    def catalog
+      @catalog ||= SchemaCatalog.new( self )
+    end
+
+    # Discards the cached schema (see #catalog). This is done automatically
+    # whenever a CREATE or DROP statement is executed on this connection, and
+    # after #load_into_memory, #restore and #import_csv.
+    def schema_changed
+      @catalog.invalidate! if @catalog
+    end
+
     # Returns +true+ if type translation is enabled for this database, or
     # +false+ otherwise.
     def type_translation
@@ -110,9 +148,9 @@ module SQLite
       @type_translation = mode
     end
 
-    # Closes this database. No checks are done to ensure that a database is not
-    # closed more than once, and closing a database more than once can be
-    # catastrophic.
+    # Closes this database. Any result sets that are still open on it are
+    # closed (finalized) first. Closing a database more than once raises an
+    # exception.
     def close
       SQLite::API.close( @handle )
       @closed = true
@@ -123,10 +161,182 @@ module SQLite
       @closed
     end
 
+    # Describes a statement that is still open on a database; see
+    # #open_statements. +lock_held+ is the number of milliseconds for which the
+    # statement has held a lock, or +nil+.
+    OpenStatement = Struct.new( :sql, :backtrace, :lock_held )
+
+    # Returns an OpenStatement for each statement (typically a ResultSet) that
+    # has been executed on this database but not yet closed, most recent
+    # first. Such statements hold a lock on the database file for as long as
+    # they are open, which blocks writers on other connections. The
+    # backtraces are only available if #statement_backtraces= was set before
+    # the statements were executed.
+    def open_statements
+      SQLite::API.open_statements( @handle ).map do |sql, backtrace, held|
+        OpenStatement.new( sql, backtrace, held )
+      end
+    end
+
+    # If +flag+ is +true+, the place each statement is executed from is
+    # recorded, for reporting by #open_statements and #lock_warning=. This
+    # costs a backtrace per statement, so it is off by default.
+    def statement_backtraces=( flag )
+      SQLite::API.set_statement_backtraces( @handle, flag )
+    end
+
+    # Issue a warning (via +warn+) for each statement on this database that
+    # holds a lock for more than +ms+ milliseconds, which usually means a
+    # result set that was never closed. The check is made whenever another
+    # statement is executed, and whenever a busy lock is encountered. Set to
+    # +nil+ to turn the warnings off.
+    def lock_warning=( ms )
+      SQLite::API.set_lock_warning( @handle, ms )
+    end
+
+    # Copies the schema and contents of the database in the named file into
+    # this database, which is normally one opened on <tt>":memory:"</tt>. This
+    # lets read-heavy jobs pay for reading the file only once:
+    #
+    #   db = SQLite::Database.new( ":memory:" )
+    #   db.load_into_memory( "data.db" )
+    #
+    # The copy is done by the extension library in a single transaction, with
+    # one compiled INSERT statement reused for every row of a table. Rows keep
+    # their rowids, so full-text indexes remain valid. This database should
+    # be empty beforehand.
+    #
+    # See also #save_to.
+    def load_into_memory( file_name )
+      source = SQLite::API.open( file_name, 0 )
+      begin
+        SQLite::API.copy_database( source, @handle )
+      ensure
+        SQLite::API.close( source )
+        schema_changed
+      end
+      self
+    end
+
+    # Writes the schema and contents of this database into the named file,
+    # which will be created if necessary and should not already contain any
+    # of this database's tables. This is the counterpart of
+    # #load_into_memory, and is typically used to persist a
+    # <tt>":memory:"</tt> database.
+    def save_to( file_name )
+      dest = SQLite::API.open( file_name, 0 )
+      begin
+        SQLite::API.copy_database( @handle, dest )
+      ensure
+        SQLite::API.close( dest )
+      end
+      self
+    end
+
+    # Writes the schema and contents of this database to +io+ as SQL text,
+    # just like the <tt>.dump</tt> command of the +sqlite+ shell. The output
+    # is produced a table at a time and written in large chunks, so the size
+    # of the database does not affect memory use. +io+ may be any object
+    # that responds to +write+.
+    #
+    #   File.open( "backup.sql", "w" ) { |f| db.dump( f ) }
+    #
+    # See also #restore.
+    def dump( io )
+      SQLite::API.dump( @handle, io )
+      io
+    end
+
+    # Executes the SQL statements read from +io+ (which must respond to
+    # +gets+), such as the output of #dump or of the +sqlite+ shell's
+    # <tt>.dump</tt> command. The statements are run inside a transaction
+    # that is committed every +batch_size+ statements, or only once at the
+    # end if +batch_size+ is zero (the default). Transaction statements in
+    # the input itself are ignored. Within #transaction (or any other active
+    # transaction) the statements simply become part of that transaction,
+    # and +batch_size+ is ignored.
+    #
+    # Returns the number of statements that were executed.
+    def restore( io, batch_size=0 )
+      SQLite::API.restore( @handle, io, batch_size )
+    ensure
+      schema_changed
+    end
+
+    # Inserts the records read from +io+ (which must respond to +read+) as
+    # comma- or otherwise-delimited text into the given table, returning the
+    # number of records inserted. The text is parsed, and the records are
+    # inserted, entirely within the extension, so that files of any size are
+    # loaded quickly and in bounded memory. The options are:
+    #
+    # <tt>:separator</tt>::  the field separator (default ","; use "\t" for
+    #                        tab-separated text).
+    # <tt>:header</tt>::     if +true+, the first record names the columns
+    #                        the fields are inserted into. Otherwise the
+    #                        fields fill the table's columns in order.
+    # <tt>:batch_size</tt>:: the number of records inserted per transaction
+    #                        (default 10000), or 0 for a single transaction.
+    #
+    # Fields may be enclosed in double quotes (with any quotes inside them
+    # doubled). Empty fields that are not quoted are inserted as NULL. Blank
+    # lines are skipped, unless only one column is being filled, in which
+    # case each blank line is a NULL (as #export_csv writes it).
+    #
+    # Within #transaction or #bulk_load (or any other active transaction)
+    # the records simply become part of that transaction, and
+    # <tt>:batch_size</tt> is ignored.
+    #
+    #   File.open( "orders.csv" ) do |f|
+    #     db.import_csv( "orders", f, :header => true )
+    #   end
+    def import_csv( table, io, options={} )
+      SQLite::API.import_csv( @handle, table, io, csv_options( options ) )
+    ensure
+      schema_changed
+    end
+
+    # Writes the rows of the given query to +io+ (which must respond to
+    # +write+) as comma- or otherwise-delimited text, one row per line, and
+    # returns the number of rows written. The text is built directly from
+    # the query's results within the extension, without creating a String
+    # for each value. The options are:
+    #
+    # <tt>:separator</tt>::  the field separator (default ",").
+    # <tt>:header</tt>::     if +true+, a first line of column names is
+    #                        written.
+    #
+    # NULLs are written as empty fields, and empty strings as <tt>""</tt>,
+    # so that #import_csv reads them back as they were. Any +bind_vars+ are
+    # bound to the query first.
+    #
+    #   File.open( "orders.csv", "w" ) do |f|
+    #     db.export_csv( "select * from orders where year=?", f,
+    #       { :header => true }, 2005 )
+    #   end
+    def export_csv( sql, io, options={}, *bind_vars )
+      sql = ParsedStatement.new( sql ).bind_params( *bind_vars ).to_s
+      SQLite::API.export_csv( @handle, sql, io, csv_options( options ) )
+    end
+
+    # Checks the options for #import_csv and #export_csv.
+    def csv_options( options )
+      separator = options[:separator]
+      if separator && separator.to_s.length != 1
+        raise ArgumentError, "the separator must be a single character"
+      end
+      options
+    end
+    private :csv_options
+
     # Returns a Statement object representing the given SQL. This does not
     # execute the statement; it merely prepares the statement for execution.
-    def prepare( sql )
-      Statement.new( self, sql )
+    #
+    # The +options+ apply to the result sets the statement produces; see
+    # ResultSet.new for the options that are recognized.
+    #
+    #   stmt = db.prepare( "select * from orders", :intern => [ "status" ] )
+    def prepare( sql, options={} )
+      Statement.new( self, sql, options )
     end
 
     # Executes the given SQL statement. If additional parameters are given,
@@ -150,25 +360,192 @@ module SQLite
     # key/value pairs are each bound separately, with the key being used as
     # the name of the placeholder to bind the value to.
     #
+    # An array may be bound to the placeholder of an IN list, and is expanded
+    # into its elements:
+    #
+    #   db.execute( "select * from orders where id in (?)", [ 3, 5, 8 ] )
+    #
+    # If a (positional) array has more than #in_list_limit elements, the
+    # statement is executed once for each slice of that many (distinct)
+    # elements, and the rows of all the executions are returned together.
+    # Clauses that work on the whole result (ORDER BY, LIMIT, aggregates)
+    # therefore apply to each slice separately. This is only done when the
+    # WHERE clause combines its conditions with AND alone, so that no row
+    # can match more than one slice; otherwise (given an OR, or a NOT IN)
+    # the whole array is bound at once.
+    #
     # The block is optional. If given, it will be invoked for each row returned
     # by the query. Otherwise, any results are accumulated into an array and
     # returned wholesale.
     #
     # See also #execute2, #execute_batch and #query for additional ways of
     # executing statements.
-    def execute( sql, *bind_vars )
+    def execute( sql, *bind_vars, &block )
+      if bind_vars.empty? && !@decorate_rows && !@results_as_hash &&
+         !@type_translation && !@query_cache
+        return execute_plain( sql, &block )
+      end
+
+      if @in_list_limit && ( index = bind_vars.index { |value|
+          value.is_a?( Array ) && value.length > @in_list_limit } ) &&
+          sliceable?( sql, index )
+        return execute_slices( sql, bind_vars, index, &block )
+      end
+
       stmt = prepare( sql )
       stmt.bind_params( *bind_vars )
-      result = stmt.execute
+      started = Time.now if @workload
       begin
-        if block_given?
-          result.each { |row| yield row }
-        else
-          return result.inject( [] ) { |arr,row| arr << row; arr }
+        if @query_cache
+          rows = @query_cache.fetch( stmt.to_s ) { stmt.execute! }
+          return rows unless block_given?
+          rows.each { |row| yield row }
+          return nil
+        end
+
+        result = stmt.execute
+        begin
+          if block_given?
+            result.each { |row| yield row }
+          else
+            return result.inject( [] ) { |arr,row| arr << row; arr }
+          end
+        ensure
+          result.close
         end
       ensure
-        result.close
+        record_statement( sql, stmt.to_s, Time.now - started ) if started
+      end
+    end
+
+    # Executes the given SQL (which has no bind variables) through
+    # API.execute, returning (or yielding) undecorated rows.
+    def execute_plain( sql )
+      started = Time.now if @workload
+      begin
+        rows = API.execute( @handle, sql )
+      rescue Exceptions::SchemaChangedException
+        schema_changed
+        raise
+      ensure
+        record_statement( sql, sql, Time.now - started ) if started
+      end
+      schema_changed if sql =~ /\A\s*(create|drop)\b/i
+
+      return rows unless block_given?
+      rows.each { |row| yield row }
+      nil
+    end
+    private :execute_plain
+
+    # Returns true if the IN list bound to the positional placeholder
+    # +index+ of the given SQL can be executed in slices: the placeholder is
+    # a (not negated) <tt>IN (?)</tt> list in the WHERE clause, and the
+    # clause has no OR, so the slices select disjoint rows.
+    def sliceable?( sql, index )
+      text = sql.gsub( /'(?:[^']|'')*'/, "''" )
+      placeholder = -1
+      ( index + 1 ).times do
+        placeholder = text.index( "?", placeholder + 1 ) or return false
+      end
+
+      before = text[ 0, placeholder ]
+      where = before.rindex( /\bwhere\b/i ) or return false
+      return false unless before =~ /\bin\s*\(\s*\z/i
+      return false if before =~ /\bnot\s+in\s*\(\s*\z/i
+
+      clause = text[ where..-1 ].split( /\b(?:group|order)\s+by\b|\blimit\b/i ).first
+      clause !~ /\bor\b/i
+    end
+    private :sliceable?
+
+    # Executes the given SQL once for each #in_list_limit elements of the
+    # array in <tt>bind_vars[index]</tt>, returning (or yielding) the rows
+    # of every execution.
+    def execute_slices( sql, bind_vars, index, &block )
+      list = bind_vars[ index ].uniq
+      rows = [] unless block
+
+      0.step( list.length - 1, @in_list_limit ) do |start|
+        vars = bind_vars.dup
+        vars[ index ] = list[ start, @in_list_limit ]
+        if block
+          execute( sql, *vars, &block )
+        else
+          rows.concat( execute( sql, *vars ) )
+        end
       end
+
+      rows
+    end
+    private :execute_slices
+
+    # Turns on caching of query results for #execute (and so for
+    # #get_first_row and #get_first_value), keeping at most +max_bytes+
+    # (estimated) bytes of results. Cached results are returned frozen. See
+    # QueryCache for when the cache is discarded.
+    #
+    #   db.enable_query_cache( 1024 * 1024 )
+    #   db.execute( "select * from countries where code=?", "NZ" )
+    #   db.execute( "select * from countries where code=?", "NZ" ) # cached
+    #   db.query_cache_stats[:hit_rate]   # => 0.5
+    def enable_query_cache( max_bytes=4*1024*1024 )
+      @query_cache = QueryCache.new( self, @file_name, max_bytes )
+      self
+    end
+
+    # Turns off caching of query results, discarding anything cached.
+    def disable_query_cache
+      @query_cache = nil
+    end
+
+    # Returns a hash of statistics for the query result cache (see
+    # QueryCache#stats), or +nil+ if #enable_query_cache has not been called.
+    def query_cache_stats
+      @query_cache && @query_cache.stats
+    end
+
+    # One entry of the workload recorded by #record_workload=: the SQL text
+    # of a statement (before any values were bound), the number of times it
+    # was executed, the total time (in seconds) spent executing it, and the
+    # text of its most recent execution (with the values bound).
+    WorkloadEntry = Struct.new( :sql, :count, :time, :sample )
+
+    # If +flag+ is +true+, each statement run through #execute is recorded,
+    # for analysis by #suggest_indexes. Setting it to +false+ discards the
+    # recorded workload. The time recorded for a statement includes the time
+    # spent in the block, if one is given.
+    def record_workload=( flag )
+      @workload = ( flag ? {} : nil )
+    end
+
+    # Returns the workload recorded since #record_workload= was set, as an
+    # array of WorkloadEntry objects.
+    def workload
+      @workload ? @workload.values : []
+    end
+
+    # Records one execution of the given statement in the workload.
+    def record_statement( sql, sample, time )
+      entry = ( @workload[ sql ] ||= WorkloadEntry.new( sql, 0, 0.0 ) )
+      entry.count += 1
+      entry.time += time
+      entry.sample = sample
+    end
+    private :record_statement
+
+    # Analyzes the recorded workload (see #record_workload=) and returns an
+    # array of IndexAdvisor::Suggestion objects, each holding the
+    # <tt>CREATE INDEX</tt> statement of an index that would have helped,
+    # most beneficial first. Each suggestion is checked by replaying the
+    # queries it should help against a scratch copy of this database, so
+    # this can take a while on a large database.
+    #
+    #   db.record_workload = true
+    #   ... run the application ...
+    #   db.suggest_indexes.each { |s| puts "#{s.sql}  -- #{s.benefit}" }
+    def suggest_indexes
+      IndexAdvisor.new( self, workload ).suggestions
     end
 
     # Executes the given SQL statement, exactly as with #execute. However, the
@@ -197,6 +574,98 @@ module SQLite
       end
     end
 
+    # Executes the given SQL statement (binding variables as for #execute),
+    # but returns the results one column at a time instead of one row at a
+    # time: the result is an array with one element per column, each of
+    # which is an array of that column's values. The column names and types
+    # are available via the +fields+ and +types+ properties of the result.
+    #
+    #   names, ages = db.execute_columnar( "select name, age from people" )
+    #
+    # This avoids building an array for every row, which makes it a good fit
+    # for queries that return many rows of a few columns for aggregation.
+    #
+    # See also #execute_packed.
+    def execute_columnar( sql, *bind_vars )
+      columnar( sql, bind_vars, false )
+    end
+
+    # Works like #execute_columnar, except that columns declared with an
+    # integer type (+integer+, +int+, +bigint+, etc.) are returned as a
+    # String of native 64-bit integers, and columns declared with a floating
+    # point type (+real+, +float+, +double+, +numeric+, etc.) as a String of
+    # native doubles. These may be handed directly to native code, or
+    # unpacked with <tt>unpack("q*")</tt> and <tt>unpack("d*")</tt>. Other
+    # columns are returned as arrays.
+    #
+    # NULLs in floating point columns are packed as NaN. Since no integer can
+    # stand for a NULL, a NULL in an integer column raises a
+    # MismatchException, as does any value that is not entirely a number of
+    # the column's kind (such as "3.7" in an integer column).
+    def execute_packed( sql, *bind_vars )
+      columnar( sql, bind_vars, true )
+    end
+
+    # The implementation of #execute_columnar and #execute_packed.
+    def columnar( sql, bind_vars, pack )
+      sql = ParsedStatement.new( sql ).bind_params( *bind_vars ).to_s
+      columns, types, data = SQLite::API.execute_columnar( @handle, sql, pack )
+
+      if @type_translation
+        data = types.zip( data ).map do |type, values|
+          next values unless values.is_a?( Array )
+          values.map { |value| translator.translate( type, value ) }
+        end
+      end
+
+      data.extend ResultSet::FieldsContainer
+      data.fields = columns
+      data.extend ResultSet::TypesContainer
+      data.types = types
+
+      data
+    end
+    private :columnar
+
+    # A single instruction of a VDBE program, as returned by #explain.
+    Instruction = Struct.new( :addr, :opcode, :p1, :p2, :p3 )
+
+    # Returns the VDBE program that SQLite compiles the given statement to, as
+    # an array of Instruction objects in address order. The +p1+ and +p2+
+    # operands are integers; +p3+ is a string (or +nil+).
+    #
+    #   db.explain( "select * from A where name=?", "Juniper" ).each do |op|
+    #     puts "#{op.addr} #{op.opcode} #{op.p1} #{op.p2} #{op.p3}"
+    #   end
+    def explain( sql, *bind_vars )
+      sql = ParsedStatement.new( sql ).bind_params( *bind_vars ).to_s
+      columns, types, data = SQLite::API.execute_columnar( @handle,
+        "EXPLAIN #{sql}", false )
+
+      addrs, opcodes, p1s, p2s, p3s = data
+      ( 0...addrs.length ).map do |index|
+        Instruction.new( addrs[index].to_i, opcodes[index], p1s[index].to_i,
+          p2s[index].to_i, p3s[index] )
+      end
+    end
+
+    # Executes the given statement once, discarding any rows it returns, and
+    # returns a Profile of the execution: how many times each instruction of
+    # the statement's VDBE program ran, and how long each took. The Profile's
+    # string form is a summary of the hot spots.
+    #
+    # This relies on the +vdbe_trace+ pragma (see Pragmas#vdbe_trace=), which
+    # is only available if the SQLite library was compiled with debugging
+    # enabled; otherwise, only the totals are reported. Since SQLite writes
+    # the trace to the standard output, the process's standard output is
+    # redirected (and anything else written to it is lost) while the
+    # statement runs.
+    def profile( sql, *bind_vars )
+      sql = ParsedStatement.new( sql ).bind_params( *bind_vars ).to_s
+      program = explain( sql )
+      Profile.new( sql, SQLite::API.profile( @handle, sql ), program )
+    end
+
     # Executes all SQL statements in the given string. By contrast, the other
     # means of executing queries will only execute the first statement in the
     # string, ignoring all subsequent statements. This will execute each one
@@ -226,6 +695,100 @@ module SQLite
       stmt.execute( &block )
     end
 
+    # Runs a query page by page, yielding each page (an array of at most
+    # <tt>:page_size</tt> rows) in turn. Rather than using OFFSET, which
+    # makes SQLite step over every earlier row again, each page continues
+    # from the key of the last row of the previous one:
+    #
+    #   SELECT * FROM ( sql ) WHERE key > last ORDER BY key LIMIT page_size
+    #
+    # Since each page is read by a statement of its own, which is finalized
+    # before the page is yielded, no lock is held on the database between
+    # pages, and writers can get in. The options are:
+    #
+    # <tt>:key</tt>::       the name of the result column that orders the
+    #                       rows, or an array of names for a composite key.
+    #                       The key must be unique, and may not be NULL.
+    # <tt>:page_size</tt>:: the number of rows in a page (default 1000).
+    #
+    # The rows are returned in ascending order of the key. Any +bind_vars+
+    # are bound to the query first.
+    #
+    #   db.each_page( "select * from orders where status=?",
+    #       { :key => "id", :page_size => 500 }, "shipped" ) do |rows|
+    #     rows.each { |row| export( row ) }
+    #   end
+    def each_page( sql, options={}, *bind_vars ) # :yields: rows
+      keys = [ options[:key] ].flatten.compact
+      raise ArgumentError, "each_page needs a :key" if keys.empty?
+      page_size = ( options[:page_size] || 1000 ).to_i
+
+      sql = ParsedStatement.new( sql ).bind_params( *bind_vars ).to_s
+      order = keys.join( ", " )
+      last = nil
+
+      loop do
+        paged = "SELECT * FROM ( #{sql} )"
+        paged << " WHERE #{keyset_condition( keys, last )}" if last
+        paged << " ORDER BY #{order} LIMIT #{page_size}"
+
+        rows = nil
+        prepare( paged, :keep_raw => true ).execute do |result|
+          rows = result.to_a
+          if rows.length == page_size
+            last = key_literals( result, keys, result.raw_row )
+          end
+        end
+
+        break if rows.empty?
+        yield rows
+        break if rows.length < page_size
+      end
+
+      nil
+    end
+
+    # Returns the WHERE condition that selects the rows that come after the
+    # given key values (SQL literals) in the order of the given key columns.
+    def keyset_condition( keys, values )
+      terms = []
+      keys.each_with_index do |key, i|
+        term = ( 0...i ).map { |j| "#{keys[j]} = #{values[j]}" }
+        term << "#{key} > #{values[i]}"
+        terms << "( #{term.join( ' AND ' )} )"
+      end
+      terms.join( " OR " )
+    end
+    private :keyset_condition
+
+    # Returns the values of the key columns of the given (untranslated) row,
+    # as SQL literals. Values of columns with a numeric declared type are
+    # given as numbers, so that they compare as numbers. Key columns are also
+    # found by their qualified names ("t.id"), which are used when the
+    # +full_column_names+ pragma is on.
+    def key_literals( result, keys, row )
+      keys.map do |key|
+        key = key.to_s.downcase
+        name = result.columns.find do |column|
+          column = column.downcase
+          column == key || column[ -key.length-1..-1 ] == ".#{key}"
+        end
+        raise ArgumentError, "no column #{key.inspect} in the query" unless name
+
+        index = result.columns.index( name )
+        value = row[ index ]
+        raise Exceptions::MisuseException, "NULL value in key #{key}" if value.nil?
+
+        if result.types[ index ] !~ /blob|char|clob|text/i &&
+            value =~ /\A-?\d+(\.\d+)?\z/
+          value
+        else
+          "'#{value.gsub( /'/, "''" )}'"
+        end
+      end
+    end
+    private :key_literals
+
     # A convenience method for obtaining the first row of a result set, and
     # discarding all others. It is otherwise identical to #execute.
     #
@@ -287,6 +850,94 @@ module SQLite
       SQLite::API.busy_timeout( @handle, ms )
     end
 
+    # The scheduler used by #enable_cooperation when none is given: it
+    # passes control to another thread, or (while waiting for a lock) sleeps
+    # briefly, which also lets other threads run.
+    DEFAULT_SCHEDULER = lambda do |reason|
+      reason == :busy ? sleep( 0.01 ) : Thread.pass
+    end
+
+    # Makes the statements executed on this database give way to other work
+    # (such as other threads) now and then, so that a long query does not
+    # hold up everything else in the process. While enabled, the scheduler
+    # (any object that responds to +call+) is called with a reason:
+    #
+    # <tt>:progress</tt>:: every <tt>:instructions</tt> VDBE instructions
+    #                      (default 1000), from within SQLite;
+    # <tt>:row</tt>::      every <tt>:rows</tt> rows read from a result set
+    #                      (if that option is given);
+    # <tt>:busy</tt>::     whenever a lock is unavailable, before trying
+    #                      again, in place of SQLite's own waiting. If a
+    #                      <tt>:busy_timeout</tt> (in seconds) is given,
+    #                      a BusyException is raised once the lock has been
+    #                      waited for that long.
+    #
+    # This replaces any busy handler or busy timeout. If the scheduler raises
+    # an exception while called with <tt>:progress</tt>, the statement is
+    # aborted with an AbortException.
+    #
+    # When called with <tt>:progress</tt> or <tt>:busy</tt>, the scheduler
+    # runs while SQLite is in the middle of a statement, which cannot be
+    # interrupted by another use of the same connection. Until the scheduler
+    # returns, any other thread that tries to use the database gets a
+    # MisuseException; threads that share a connection should each wait for
+    # their turn rather than rely on the scheduler.
+    #
+    # If a block is given, cooperation is only enabled while it runs.
+    #
+    #   db.enable_cooperation( :instructions => 500, :rows => 100 ) do
+    #     db.execute( "select * from huge_table" ) { |row| ... }
+    #   end
+    def enable_cooperation( options={} )
+      scheduler = options[:scheduler] || DEFAULT_SCHEDULER
+      timeout = options[:busy_timeout]
+
+      @scheduler = scheduler
+      @cooperative_rows = options[:rows]
+      @rows_since_yield = 0
+
+      SQLite::API.progress_handler( @handle, options[:instructions] || 1000,
+        lambda { scheduler.call( :progress ) } )
+
+      waiting_since = nil
+      busy_handler do |resource, retries|
+        waiting_since = Time.now if retries <= 1 || waiting_since.nil?
+        if timeout && Time.now - waiting_since >= timeout
+          waiting_since = nil
+          false
+        else
+          scheduler.call( :busy )
+          true
+        end
+      end
+
+      return self unless block_given?
+      begin
+        yield self
+      ensure
+        disable_cooperation
+      end
+    end
+
+    # Stops statements from giving way to other work (see
+    # #enable_cooperation), and removes the busy handler.
+    def disable_cooperation
+      SQLite::API.progress_handler( @handle, 0, nil )
+      busy_handler
+      @scheduler = @cooperative_rows = nil
+    end
+
+    # Called by ResultSet for each row read, so that the scheduler can be
+    # called every so many rows (see #enable_cooperation).
+    def row_read # :nodoc:
+      return unless @cooperative_rows
+      @rows_since_yield += 1
+      if @rows_since_yield >= @cooperative_rows
+        @rows_since_yield = 0
+        @scheduler.call( :row )
+      end
+    end
+
     # Creates a new function for use in SQL statements. It will be added as
     # +name+, with the given +arity+. (For variable arity functions, use
     # -1 for the arity.) If +type+ is non-nil, it should either be an
@@ -522,6 +1173,36 @@ module SQLite
       self
     end
 
+    # Installs a native implementation of the +regexp+ function, which
+    # SQLite uses for the <tt>x REGEXP y</tt> operator. It may also be called
+    # directly, as <tt>regexp( pattern, value )</tt>. Patterns are POSIX
+    # extended regular expressions, and the function returns 1 when +value+
+    # matches +pattern+ and 0 when it does not.
+    #
+    # Compiled patterns are cached per database, keeping at most +capacity+
+    # of them (the least recently used pattern is discarded first). Calling
+    # this again just resizes the cache.
+    #
+    # Example:
+    #
+    #   db.enable_regexp
+    #   db.execute( "select * from events where regexp( ?, message )",
+    #     "^timeout (after|before) [0-9]+ms" )
+    #
+    # See also #regexp_cache_stats.
+    def enable_regexp( capacity=64 )
+      SQLite::API.enable_regexp( @handle, capacity )
+      self
+    end
+
+    # Returns a hash of statistics for the compiled-pattern cache used by the
+    # native +regexp+ function, with the keys <tt>:hits</tt>, <tt>:misses</tt>,
+    # <tt>:evictions</tt>, <tt>:size</tt> and <tt>:capacity</tt>. Returns
+    # +nil+ if #enable_regexp has not been called.
+    def regexp_cache_stats
+      SQLite::API.regexp_cache_stats( @handle )
+    end
+
     # Begins a new transaction. Note that nested transactions are not allowed
     # by SQLite, so attempting to nest a transaction will result in a runtime
     # exception.
@@ -579,6 +1260,260 @@ module SQLite
       @transaction_active
     end
 
+    # Runs the given block with the database configured for loading a large
+    # amount of data, and restores the previous configuration afterwards
+    # (even if the block raises an exception). For the duration of the
+    # block, #synchronous is set to +off+, #cache_size is raised, and
+    # #temp_store is set to +memory+. Unless a transaction is already
+    # active, the block is also run inside a transaction. The options are:
+    #
+    # <tt>:tables</tt>::      the tables being loaded. Their indexes are
+    #                         dropped before the block is run and created
+    #                         again afterwards, since building an index once
+    #                         is much faster than updating it for every row.
+    #                         (The indexes SQLite creates for UNIQUE and
+    #                         PRIMARY KEY constraints cannot be dropped, and
+    #                         are left alone.)
+    # <tt>:cache_size</tt>::  the number of pages to cache (default 10000).
+    # <tt>:transaction</tt>:: if +false+, no transaction is started.
+    #
+    #   db.bulk_load( :tables => [ "orders" ] ) do
+    #     rows.each { |row| db.execute( "insert into orders values (?,?)", *row ) }
+    #   end
+    def bulk_load( options={} )
+      saved = [ synchronous, cache_size, temp_store ]
+      self.synchronous = "off"
+      self.cache_size = options[:cache_size] || 10000
+      self.temp_store = "memory"
+
+      begin
+        indexes = droppable_indexes( options[:tables] || [] )
+        if transaction_active? || options[:transaction] == false
+          without_indexes( indexes ) { yield self }
+        else
+          transaction { without_indexes( indexes ) { yield self } }
+        end
+      ensure
+        self.synchronous, self.cache_size, self.temp_store = saved
+      end
+    end
+
+    # Returns the names and the CREATE statements of the indexes on the
+    # given tables that can be dropped, as an array of [ name, sql ] pairs.
+    def droppable_indexes( tables )
+      indexes = []
+      tables.each do |table|
+        index_list( table ) do |seq, name, unique|
+          sql = get_first_value( "select sql from sqlite_master " +
+            "where type='index' and name=?", name )
+          indexes << [ name, sql ] if sql
+        end
+      end
+      indexes
+    end
+    private :droppable_indexes
+
+    # Drops the given indexes, runs the block, and creates the indexes again.
+    def without_indexes( indexes )
+      indexes.each { |name, sql| execute( "DROP INDEX #{name}" ) }
+      begin
+        yield
+      ensure
+        indexes.each { |name, sql| execute( sql ) }
+      end
+    end
+    private :without_indexes
+
+    # Creates a summary table named +name+ holding the result of a
+    # <tt>GROUP BY</tt> query over the table +source+, along with the
+    # triggers that keep it up to date as +source+ changes, and returns the
+    # MaterializedAggregate object for it. The options are:
+    #
+    # <tt>:group_by</tt>::   the grouping column, or an array of them.
+    # <tt>:aggregates</tt>:: a hash mapping the name of each aggregate column
+    #                        to its expression (a +count+, +sum+, +total+,
+    #                        +min+ or +max+ of a column).
+    #
+    #   db.create_materialized_aggregate( "sales_by_region", "orders",
+    #     :group_by => "region",
+    #     :aggregates => { "revenue" => "sum(total)", "orders" => "count(*)" } )
+    #   db.execute( "select region, revenue from sales_by_region" )
+    def create_materialized_aggregate( name, source, options={} )
+      MaterializedAggregate.new( self, name, source, options ).create
+    end
+
+    # Creates a full-text index of the given columns of +table+, so that its
+    # rows can be found by the words they hold (see #search). The index is
+    # kept in four tables named after +table+:
+    #
+    # <tt>TABLE_fts_terms</tt>::   the posting list of each word: the rows
+    #                              that hold it, and how often, compactly
+    #                              encoded.
+    # <tt>TABLE_fts_docs</tt>::    the words each row was indexed under.
+    # <tt>TABLE_fts_pending</tt>:: the rows that have changed since the index
+    #                              was last brought up to date.
+    # <tt>TABLE_fts_config</tt>::  the indexed columns and the number of rows
+    #                              indexed.
+    #
+    # Triggers on +table+ record the rows that are inserted, updated or
+    # deleted in <tt>TABLE_fts_pending</tt>, and the posting lists are
+    # brought up to date (in C) by #sync_fts_index, which #search calls
+    # before it searches. The existing rows are indexed before this returns.
+    #
+    #   db.create_fts_index( "tickets", "subject", "body" )
+    #   db.search( "tickets", "printer jam", :limit => 20 )
+    def create_fts_index( table, *columns )
+      raise ArgumentError, "no columns given" if columns.empty?
+      columns.each do |column|
+        column.to_s =~ /\A[A-Za-z_]\w*\z/ or
+          raise ArgumentError, "bad column name #{column.inspect}"
+      end
+
+      create = lambda do
+        execute "CREATE TABLE #{table}_fts_config ( name PRIMARY KEY, value )"
+        execute "INSERT INTO #{table}_fts_config VALUES ( 'columns', ? )",
+          columns.join( "," )
+        execute "INSERT INTO #{table}_fts_config VALUES ( 'documents', 0 )"
+        execute "CREATE TABLE #{table}_fts_terms " +
+          "( term PRIMARY KEY, documents, postings )"
+        execute "CREATE TABLE #{table}_fts_docs ( doc INTEGER PRIMARY KEY, words )"
+        execute "CREATE TABLE #{table}_fts_pending ( doc INTEGER PRIMARY KEY )"
+
+        pending = "INSERT OR REPLACE INTO #{table}_fts_pending VALUES"
+        execute "CREATE TRIGGER #{table}_fts_insert AFTER INSERT ON #{table} " +
+          "BEGIN #{pending} ( new.rowid ); END"
+        execute "CREATE TRIGGER #{table}_fts_update AFTER UPDATE ON #{table} " +
+          "BEGIN #{pending} ( old.rowid ); #{pending} ( new.rowid ); END"
+        execute "CREATE TRIGGER #{table}_fts_delete AFTER DELETE ON #{table} " +
+          "BEGIN #{pending} ( old.rowid ); END"
+
+        execute "INSERT INTO #{table}_fts_pending SELECT rowid FROM #{table}"
+        sync_fts_index( table )
+      end
+
+      transaction_active? ? create.call : transaction { create.call }
+      self
+    end
+
+    # Drops the full-text index of the given table, and its triggers.
+    def drop_fts_index( table )
+      %w{insert update delete}.each do |event|
+        execute "DROP TRIGGER #{table}_fts_#{event}"
+      end
+      %w{config terms docs pending}.each do |name|
+        execute "DROP TABLE #{table}_fts_#{name}"
+      end
+    end
+
+    # Brings the full-text index of the given table (see #create_fts_index)
+    # up to date, indexing again the rows that have changed since it was
+    # last brought up to date. Returns the number of rows indexed again.
+    def sync_fts_index( table )
+      return 0 unless get_first_value( "SELECT doc FROM #{table}_fts_pending LIMIT 1" )
+
+      columns = get_first_value( "SELECT value FROM #{table}_fts_config " +
+        "WHERE name = 'columns'" ).split( "," )
+
+      if transaction_active?
+        API.fts_sync( @handle, table, columns )
+      else
+        count = nil
+        transaction { count = API.fts_sync( @handle, table, columns ) }
+        count
+      end
+    end
+
+    # Searches the full-text index of the given table (see #create_fts_index)
+    # for the rows that hold every word of +query+, and returns them best
+    # match first. (Words are runs of letters and digits, and are compared
+    # without regard to case.) Rows score higher for holding the words more
+    # often, and for holding words that few other rows hold. If a block is
+    # given, each row is yielded to it along with its score instead. The
+    # options are:
+    #
+    # <tt>:limit</tt>::  the most rows to return.
+    # <tt>:offset</tt>:: the number of (best matching) rows to skip.
+    #
+    # To filter rows by their words without an index, see #enable_match.
+    def search( table, query, options={} ) # :yields: row, score
+      sync_fts_index( table )
+
+      ranked = API.fts_search( @handle, table, query )
+      ranked = ranked[ options[:offset] || 0, options[:limit] || ranked.length ] || []
+
+      stmt = prepare( "SELECT * FROM #{table} WHERE rowid = ?" )
+      rows = []
+      ranked.each do |rowid, score|
+        row = stmt.execute!( rowid ).first or next
+        if block_given?
+          yield row, score
+        else
+          rows << row
+        end
+      end
+      rows
+    end
+
+    # Registers a native <tt>match( text, query )</tt> function with the
+    # database, which returns the number of times the words of +query+ occur
+    # in +text+ if every one of them does, and 0 otherwise. It reads the text
+    # of every row it is given, unlike #search, but needs no index:
+    #
+    #   db.enable_match
+    #   db.execute( "select id from tickets where match( body, ? ) " +
+    #     "order by match( body, ? ) desc", "printer jam", "printer jam" )
+    def enable_match
+      SQLite::API.enable_match( @handle )
+      self
+    end
+
+    # Registers the native functions <tt>compress( text )</tt> and
+    # <tt>uncompress( text )</tt> with the database. The text is deflated
+    # with zlib in C, and stored in a form that is safe for SQLite's text
+    # columns, so large payloads take fewer pages to store and to read:
+    #
+    #   db.enable_compression
+    #   db.execute( "insert into documents values ( ?, compress( ? ) )", id, json )
+    #   db.get_first_value( "select uncompress( body ) from documents where id = ?", id )
+    #
+    # Values may not contain NUL bytes; serialized objects should be passed
+    # through Database.encode first. Raises NotImplementedError if the
+    # extension was built without zlib. See also #store_compressed.
+    def enable_compression
+      SQLite::API.enable_compression( @handle )
+      @compression_enabled = true
+      self
+    end
+
+    # Inserts a row into +table+ (replacing any row it conflicts with), given
+    # a hash of column names and values, and compresses the values of the
+    # named +columns+ on the way in (see #enable_compression, which is called
+    # if it has not been already). If no columns are named, every String
+    # value is compressed. Keys may be Strings or Symbols, but naming the same
+    # column both ways raises an ArgumentError.
+    #
+    #   db.store_compressed( "documents", { "id" => 7, "body" => json } )
+    #   db.get_first_value( "select uncompress( body ) from documents where id = 7" )
+    def store_compressed( table, values, *columns )
+      enable_compression unless @compression_enabled
+      columns = columns.map { |column| column.to_s }
+
+      pairs = values.sort_by { |name,| name.to_s }
+      names = pairs.map { |name,| name.to_s }
+      row = pairs.map { |name, value| value }
+      if names.uniq.length != names.length
+        raise ArgumentError, "a column is named more than once"
+      end
+      placeholders = names.zip( row ).map do |name, value|
+        compressed = ( columns.empty? ? value.is_a?( String ) :
+          columns.include?( name ) )
+        compressed ? "compress(?)" : "?"
+      end
+
+      execute( "INSERT OR REPLACE INTO #{table} ( #{names.join( ', ' )} ) " +
+        "VALUES ( #{placeholders.join( ', ' )} )", *row )
+    end
+
     # A helper class for dealing with custom functions (see #create_function,
     # #create_aggregate, and #create_aggregate_handler). It encapsulates the
     # opaque function object that represents the current invocation. It also
@@ -0,0 +1,244 @@
+require 'thread'
+
+module SQLite
+
+  # A GroupCommitter collects write statements submitted by any number of
+  # threads and executes them in batches, each batch inside a single
+  # transaction. Since the cost of a small write is dominated by the
+  # journaling and syncing done when its transaction commits, this allows
+  # far more writes per second than executing each one on its own.
+  #
+  # A batch is executed once it holds +max_batch+ statements, or once the
+  # first statement in it has waited +max_delay+ seconds, whichever comes
+  # first.
+  #
+  #   committer = SQLite::GroupCommitter.new( db, :max_batch => 200 )
+  #
+  #   threads = (1..10).map do |n|
+  #     Thread.new do
+  #       100.times { |i| committer.execute( "insert into t values (?,?)", n, i ) }
+  #     end
+  #   end
+  #   threads.each { |t| t.join }
+  #
+  #   committer.close
+  #
+  # The database should be used only by the committer while it is running,
+  # since any statement executed on it by another thread would become part
+  # of the committer's current transaction.
+  class GroupCommitter
+
+    # The handle returned by GroupCommitter#submit, for obtaining the outcome
+    # of a single statement.
+    class Pending
+
+      # The SQL text of the statement.
+      attr_reader :sql
+
+      # The values to be bound to the statement.
+      attr_reader :bind_vars
+
+      def initialize( sql, bind_vars ) # :nodoc:
+        @sql = sql
+        @bind_vars = bind_vars
+        @done = false
+        @result = @error = nil
+        @mutex = Mutex.new
+        @finished = ConditionVariable.new
+      end
+
+      # Returns +true+ if the statement has been executed (successfully or
+      # not) and its transaction has been committed.
+      def done?
+        @done
+      end
+
+      # Waits for the statement to be executed and committed, and returns the
+      # rows it returned. If it failed, the exception it raised is raised
+      # again here.
+      def value
+        @mutex.synchronize do
+          @finished.wait( @mutex ) until @done
+        end
+        raise @error if @error
+        @result
+      end
+
+      # Waits for the statement to be executed and committed, and returns the
+      # exception it raised, or +nil+ if it succeeded.
+      def error
+        @mutex.synchronize do
+          @finished.wait( @mutex ) until @done
+        end
+        @error
+      end
+
+      # Records the outcome of the statement, and wakes up anyone waiting for
+      # it.
+      def finish( result, error ) # :nodoc:
+        @mutex.synchronize do
+          @result = result
+          @error = error
+          @done = true
+          @finished.broadcast
+        end
+      end
+
+    end
+
+    # The database the statements are executed on.
+    attr_reader :db
+
+    # Create a new GroupCommitter for the given Database, and start the
+    # thread that executes its batches. The options are:
+    #
+    # <tt>:max_batch</tt>:: the most statements in a batch (default 100).
+    # <tt>:max_delay</tt>:: the most time, in seconds, that a statement
+    #                       waits for others to join its batch (default
+    #                       0.01).
+    def initialize( db, options={} )
+      @db = db
+      @max_batch = options[:max_batch] || 100
+      @max_delay = options[:max_delay] || 0.01
+
+      @queue = []
+      @mutex = Mutex.new
+      @waiting = ConditionVariable.new
+      @closed = false
+
+      @thread = Thread.new { run }
+    end
+
+    # Queues the given statement for execution, and returns a Pending handle
+    # for its outcome.
+    def submit( sql, *bind_vars )
+      pending = Pending.new( sql, bind_vars )
+      @mutex.synchronize do
+        raise Exceptions::MisuseException, "group committer is closed" if @closed
+        @queue << pending
+        @waiting.signal
+      end
+      pending
+    end
+
+    # Queues the given statement, waits for its batch to be committed, and
+    # returns its rows (or raises its exception).
+    def execute( sql, *bind_vars )
+      submit( sql, *bind_vars ).value
+    end
+
+    # Executes any statements still queued, and stops the committer's
+    # thread. Statements may not be submitted after this.
+    def close
+      @mutex.synchronize do
+        @closed = true
+        @waiting.signal
+      end
+      @thread.join
+      nil
+    end
+
+    # The body of the committer's thread. Should anything go wrong outside
+    # of a batch, the committer is closed and every statement still waiting
+    # is given the exception, so that no caller waits forever.
+    def run
+      batch = nil
+      while batch = next_batch
+        begin
+          execute_batch( batch )
+        rescue Exception => error
+          # the transaction could not even be started
+          batch.each { |pending| pending.finish( nil, error ) unless pending.done? }
+        end
+      end
+    rescue Exception => error
+      stranded = batch || []
+      @mutex.synchronize do
+        @closed = true
+        stranded += @queue.slice!( 0, @queue.length )
+      end
+      stranded.each { |pending| pending.finish( nil, error ) unless pending.done? }
+    end
+    private :run
+
+    # Waits for statements to be queued, and returns the next batch of
+    # them, or +nil+ once the committer has been closed and the queue is
+    # empty.
+    def next_batch
+      @mutex.synchronize do
+        @waiting.wait( @mutex ) while @queue.empty? && !@closed
+        return nil if @queue.empty?
+      end
+
+      deadline = Time.now + @max_delay
+      loop do
+        @mutex.synchronize do
+          if @queue.length >= @max_batch || @closed || Time.now >= deadline
+            return @queue.slice!( 0, @max_batch )
+          end
+        end
+        # the deadline may pass between the check above and this
+        sleep( [ [ deadline - Time.now, 0.001 ].min, 0 ].max )
+      end
+    end
+    private :next_batch
+
+    # Executes the given statements in a single transaction. A statement
+    # that fails is taken out of the batch (the transaction is rolled back,
+    # so that its partial effects are undone) and the rest are executed
+    # again without it. If the commit itself fails, each statement is
+    # executed in a transaction of its own, so that each has its own
+    # outcome.
+    def execute_batch( batch )
+      until batch.empty?
+        results = []
+        failed = error = nil
+
+        @db.transaction
+        batch.each do |pending|
+          begin
+            results << @db.execute( pending.sql, *pending.bind_vars )
+          rescue Exception => error
+            failed = pending
+            break
+          end
+        end
+
+        if failed
+          @db.rollback rescue nil
+          failed.finish( nil, error )
+          batch = batch - [ failed ]
+          next
+        end
+
+        begin
+          @db.commit
+        rescue Exception
+          @db.rollback rescue nil
+          batch.each { |pending| execute_alone( pending ) }
+          return
+        end
+
+        batch.each_with_index do |pending, index|
+          pending.finish( results[ index ], nil )
+        end
+        return
+      end
+    end
+    private :execute_batch
+
+    # Executes a single statement in a transaction of its own.
+    def execute_alone( pending )
+      result = nil
+      @db.transaction do
+        result = @db.execute( pending.sql, *pending.bind_vars )
+      end
+      pending.finish( result, nil )
+    rescue Exception => error
+      pending.finish( nil, error )
+    end
+    private :execute_alone
+
+  end
+
+end
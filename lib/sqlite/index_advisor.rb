@@ -0,0 +1,215 @@
+require 'sqlite_api'
+
+module SQLite
+
+  # The IndexAdvisor looks at a recorded workload (see
+  # Database#record_workload=) and proposes indexes for it. It will rarely be
+  # used directly; see Database#suggest_indexes.
+  #
+  # The queries of the workload are analyzed (quite simply, by matching
+  # patterns in the SQL text) for the columns they compare in their WHERE
+  # clauses and the columns they sort by. Equality comparisons come first in
+  # a candidate index, then at most one range comparison, then the ORDER BY
+  # columns. Candidates already covered by an existing index are dropped.
+  #
+  # Each remaining candidate is then tried out on a scratch (in-memory) copy
+  # of the database: the queries it could help are replayed with and without
+  # the index, and the benefit is the number of VDBE instructions saved,
+  # multiplied by the number of times each query appeared in the workload.
+  class IndexAdvisor
+
+    # A proposed index. +benefit+ is the estimated number of VDBE
+    # instructions the index would have saved over the recorded workload.
+    Suggestion = Struct.new( :sql, :table, :columns, :benefit, :queries )
+
+    # A comparison of a (possibly qualified) column in a WHERE clause.
+    COMPARISON = /(?:(\w+)\.)?(\w+)\s*(==|=|<=|>=|<>|!=|<|>|\bIN\b|\bIS\b|\bBETWEEN\b|\bLIKE\b)/i
+
+    # The operators recognized as "equality" comparisons.
+    EQUALITY = /\A(=|==|IN|IS)\z/i
+
+    # The operators recognized as range comparisons.
+    RANGE = /\A(<|>|<=|>=|BETWEEN|LIKE)\z/i
+
+    # Create a new advisor for the given database and workload (an array of
+    # Database::WorkloadEntry objects).
+    def initialize( db, workload )
+      @db = db
+      @workload = workload.select { |entry| entry.sample =~ /\A\s*select\b/i }
+    end
+
+    # Returns the suggested indexes, most beneficial first. Only indexes that
+    # actually reduced the work done by at least one query are returned.
+    def suggestions
+      return [] if @workload.empty?
+
+      scratch = Database.new( ":memory:" )
+      begin
+        API.copy_database( @db.handle, scratch.handle )
+        @schema = read_schema( scratch )
+
+        candidates.map { |candidate| try( scratch, *candidate ) }.
+          compact.sort_by { |suggestion| -suggestion.benefit }
+      ensure
+        scratch.close
+      end
+    end
+
+    # Returns a hash describing each table: its columns (in lower case), and
+    # the columns of each of its indexes (the rowid alias of a table counts
+    # as an index on that column).
+    def read_schema( db )
+      schema = {}
+
+      db.execute( "select name from sqlite_master where type='table'" ).
+        each do |table,|
+          columns = []
+          indexes = []
+
+          db.table_info( table ) do |cid, name, type, notnull, dflt, pk|
+            columns << name.downcase
+            if pk.to_i != 0 && type =~ /\Ainteger\z/i
+              indexes << [ name.downcase ]
+            end
+          end
+
+          db.index_list( table ) do |seq, index, unique|
+            indexes << db.index_info( index ).map { |row| row[2].downcase }
+          end
+
+          schema[ table.downcase ] = { :name => table, :columns => columns,
+            :indexes => indexes }
+        end
+
+      schema
+    end
+    private :read_schema
+
+    # Returns an array of [ table, columns, entries ] triples, one for each
+    # candidate index, where +entries+ are the workload entries that might
+    # benefit from it.
+    def candidates
+      found = Hash.new { |h,k| h[k] = [] }
+
+      @workload.each do |entry|
+        analyze( entry.sample ).each do |table, columns|
+          next if columns.empty? || covered?( table, columns )
+          found[ [ table, columns ] ] << entry
+        end
+      end
+
+      found.to_a.map { |(table, columns), entries| [ table, columns, entries ] }
+    end
+    private :candidates
+
+    # Returns whether an existing index of the table begins with the given
+    # columns.
+    def covered?( table, columns )
+      @schema[ table ][ :indexes ].any? do |index|
+        index[ 0, columns.length ] == columns
+      end
+    end
+    private :covered?
+
+    # Works out, for each table in the FROM clause of the query, the columns
+    # an index would need to help the query. Returns an array of
+    # [ table, columns ] pairs.
+    def analyze( sql )
+      sql = sql.gsub( /'(?:[^']|'')*'/, "?" ).gsub( /\s+/, " " )
+
+      from = sql[ /\bfrom (.*?)(?: where | group by | order by | limit |\z)/i,
+        1 ] or return []
+      where = sql[ /\bwhere (.*?)(?: group by | order by | limit |\z)/i, 1 ]
+      order = sql[ /\border by (.*?)(?: limit |\z)/i, 1 ]
+
+      aliases = {}
+      from.split( /,|\bjoin\b/i ).each do |item|
+        item = item.sub( /\bon\b.*\z/i, "" ).strip
+        next unless item =~ /\A(\w+)(?:\s+(?:as\s+)?(\w+))?/i
+        next unless @schema[ $1.downcase ]
+        aliases[ ( $2 || $1 ).downcase ] = $1.downcase
+        aliases[ $1.downcase ] = $1.downcase
+      end
+      return [] if aliases.empty?
+
+      equal = Hash.new { |h,k| h[k] = [] }
+      range = {}
+      sorted = Hash.new { |h,k| h[k] = [] }
+
+      ( where || "" ).scan( COMPARISON ) do |prefix, column, op|
+        table = owner( aliases, prefix, column ) or next
+        if op =~ EQUALITY
+          equal[ table ] << column.downcase
+        elsif op =~ RANGE
+          range[ table ] ||= column.downcase
+        end
+      end
+
+      ( order || "" ).split( "," ).each do |term|
+        next unless term.strip =~ /\A(?:(\w+)\.)?(\w+)/
+        table = owner( aliases, $1, $2 ) or next
+        sorted[ table ] << $2.downcase
+      end
+
+      aliases.values.uniq.map do |table|
+        columns = equal[ table ].uniq
+        columns << range[ table ] if range[ table ]
+        sorted[ table ].each { |column| columns << column }
+        [ table, columns.uniq ]
+      end
+    end
+    private :analyze
+
+    # Returns the table (named or aliased by +prefix+, if given) that has the
+    # given column, or +nil+ if there is no such table.
+    def owner( aliases, prefix, column )
+      column = column.downcase
+
+      if prefix
+        table = aliases[ prefix.downcase ]
+        return table if table && @schema[ table ][ :columns ].include?( column )
+        return nil
+      end
+
+      aliases.values.uniq.find do |table|
+        @schema[ table ][ :columns ].include?( column )
+      end
+    end
+    private :owner
+
+    # Creates the candidate index on the scratch database, replays the
+    # queries that might benefit from it, and drops it again. Returns a
+    # Suggestion, or +nil+ if the index did not help.
+    def try( scratch, table, columns, entries )
+      table_name = @schema[ table ][ :name ]
+      name = "#{table_name}_#{columns.join( '_' )}_idx"
+      sql = "CREATE INDEX #{name} ON #{table_name}( #{columns.join( ', ' )} )"
+
+      before = entries.map { |entry| cost( scratch, entry.sample ) }
+      scratch.execute( sql )
+      begin
+        after = entries.map { |entry| cost( scratch, entry.sample ) }
+      ensure
+        scratch.execute( "DROP INDEX #{name}" )
+      end
+
+      benefit = 0
+      entries.each_with_index do |entry, index|
+        benefit += ( before[index] - after[index] ) * entry.count
+      end
+
+      return nil unless benefit > 0
+      Suggestion.new( sql, table_name, columns, benefit,
+        entries.map { |entry| entry.sql } )
+    end
+    private :try
+
+    # The number of VDBE instructions executed by the given query.
+    def cost( scratch, sql )
+      API.profile( scratch.handle, sql )[0]
+    end
+    private :cost
+
+  end
+
+end
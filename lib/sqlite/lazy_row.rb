@@ -0,0 +1,89 @@
+require 'sqlite_api'
+
+module SQLite
+
+  # A LazyRow is the row returned by ResultSet#next when the result set was
+  # created with the <tt>:lazy</tt> option. It keeps the raw text of the row,
+  # and only creates (and translates) the value of a column the first time
+  # that column is accessed, so that the cost of a wide row depends on the
+  # columns that are actually used rather than on the columns selected.
+  #
+  # Columns may be accessed by index or by name:
+  #
+  #   db.prepare( "select * from orders", :lazy => true ).execute do |rs|
+  #     rs.each { |row| puts row["status"] }
+  #   end
+  class LazyRow
+    include Enumerable
+
+    # An array of the column names of the row.
+    attr_reader :fields
+
+    # An array of the column types of the row.
+    attr_reader :types
+
+    # Create a new LazyRow around the given API::RawRow. +indexes+ maps each
+    # column name to its index. If +translator+ is not +nil+, values are
+    # translated according to their types as they are accessed.
+    def initialize( raw, fields, types, indexes, translator )
+      @raw = raw
+      @fields = fields
+      @types = types
+      @indexes = indexes
+      @translator = translator
+      @values = {}
+    end
+
+    # Returns the value of the given column, which may be an index or a
+    # column name. Returns +nil+ if there is no such column.
+    def []( key )
+      index = key.is_a?( Integer ) ? key : @indexes[ key ]
+      return nil unless index
+
+      index += length if index < 0
+      return nil if index < 0 || index >= length
+
+      @values.fetch( index ) { @values[ index ] = value_at( index ) }
+    end
+
+    # Returns the values of the given columns.
+    def values_at( *keys )
+      keys.map { |key| self[ key ] }
+    end
+
+    # The number of columns in the row.
+    def length
+      @raw.length
+    end
+    alias :size :length
+
+    # Iterates over the values of the row, in column order.
+    def each
+      length.times { |index| yield self[ index ] }
+    end
+
+    # Returns all of the values of the row as an array.
+    def to_a
+      map { |value| value }
+    end
+
+    # Returns a hash of column names to values.
+    def to_hash
+      hash = {}
+      @fields.each_with_index { |field, index| hash[ field ] = self[ index ] }
+      hash
+    end
+
+    # Creates (and translates, if required) the value at the given index.
+    def value_at( index )
+      value = @raw[ index ]
+      if @translator && value.is_a?( String )
+        value = @translator.translate( @types[ index ], value )
+      end
+      value
+    end
+    private :value_at
+
+  end
+
+end
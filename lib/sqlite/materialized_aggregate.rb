@@ -0,0 +1,221 @@
+module SQLite
+
+  # A MaterializedAggregate is a summary table holding the result of a
+  # <tt>GROUP BY</tt> query over another (source) table, kept up to date by
+  # triggers on the source table, so that the summary can be read without
+  # scanning the source at all. It will usually be created with
+  # Database#create_materialized_aggregate:
+  #
+  #   sales = db.create_materialized_aggregate( "sales_by_region", "orders",
+  #     :group_by => [ "region" ],
+  #     :aggregates => { "orders" => "count(*)", "revenue" => "sum(total)",
+  #                      "largest" => "max(total)" } )
+  #
+  #   db.execute( "select region, revenue from sales_by_region" )
+  #
+  # Counts and sums are adjusted by the triggers for every row inserted,
+  # updated or deleted. A minimum or maximum is adjusted in the same way when
+  # a row is inserted; when the row holding the current minimum (or maximum)
+  # of a group is deleted or changed, the minimum of that group alone is
+  # computed again from the source table.
+  #
+  # Besides the grouping and aggregate columns, the summary table has a
+  # column named <tt>_rows</tt>, holding the number of source rows in each
+  # group; a group's row is deleted when this drops to zero.
+  class MaterializedAggregate
+
+    # The aggregate functions that can be maintained by the triggers.
+    AGGREGATE = /\A\s*(count|sum|total|min|max)\s*\(\s*(\*|\w+)\s*\)\s*\z/i
+
+    # The name of the summary table.
+    attr_reader :name
+
+    # The name of the table being summarized.
+    attr_reader :source
+
+    # The names of the grouping columns.
+    attr_reader :group_by
+
+    # The aggregate columns, as an array of [ column, function, argument ]
+    # triples (such as <tt>[ "revenue", "sum", "total" ]</tt>).
+    attr_reader :aggregates
+
+    # Create a new MaterializedAggregate object for the summary table +name+
+    # of the table +source+ in the given Database. This does not create the
+    # table or its triggers (see #create); it may also be used to get hold of
+    # a summary that was created earlier, given the same options. The
+    # options are:
+    #
+    # <tt>:group_by</tt>::   the name of the grouping column, or an array of
+    #                        them (default none, which summarizes the whole
+    #                        table in a single row).
+    # <tt>:aggregates</tt>:: a hash (or an array of pairs) mapping the name
+    #                        of each aggregate column to its expression,
+    #                        which must be a +count+, +sum+, +total+, +min+ or
+    #                        +max+ of a single column (or <tt>count(*)</tt>).
+    def initialize( db, name, source, options={} )
+      @db = db
+      @name = name
+      @source = source
+      @group_by = [ options[:group_by] || [] ].flatten
+
+      aggregates = options[:aggregates] or
+        raise ArgumentError, "no aggregates given"
+      aggregates = aggregates.sort if aggregates.is_a?( Hash )
+      raise ArgumentError, "no aggregates given" if aggregates.empty?
+
+      @aggregates = aggregates.map do |column, expression|
+        expression =~ AGGREGATE or
+          raise ArgumentError, "cannot maintain #{expression.inspect} incrementally"
+        function = $1.downcase
+        function = "sum" if function == "total"
+        if $2 == "*" && function != "count"
+          raise ArgumentError, "#{function}(*) is not an aggregate"
+        end
+        [ column.to_s, function, $2 ]
+      end
+    end
+
+    # Creates the summary table, its index and the triggers on the source
+    # table, and fills the summary table (see #refresh!). Returns +self+.
+    def create
+      @db.transaction_active? ? create_objects : @db.transaction { create_objects }
+      self
+    end
+
+    # Drops the triggers and the summary table.
+    def drop
+      %w{insert update delete}.each do |event|
+        @db.execute "DROP TRIGGER #{@name}_#{event}"
+      end
+      @db.execute "DROP TABLE #{@name}"
+    end
+
+    # Rebuilds the contents of the summary table from scratch, by running the
+    # <tt>GROUP BY</tt> query over the whole source table. This is only
+    # needed if the source table was changed while the triggers did not
+    # exist.
+    def refresh!
+      if @db.transaction_active?
+        rebuild
+      else
+        @db.transaction { rebuild }
+      end
+      self
+    end
+
+    # Creates the table, index and triggers, and fills the table.
+    def create_objects
+      columns = @group_by + @aggregates.map { |column,| column } + [ "_rows" ]
+      @db.execute "CREATE TABLE #{@name} ( #{columns.join( ', ' )} )"
+      unless @group_by.empty?
+        @db.execute "CREATE UNIQUE INDEX #{@name}_groups " +
+          "ON #{@name} ( #{@group_by.join( ', ' )} )"
+      end
+
+      @db.execute trigger( "insert", added( "new" ) )
+      @db.execute trigger( "delete", removed( "old" ) )
+      @db.execute trigger( "update", removed( "old" ) + added( "new" ) )
+
+      rebuild
+    end
+    private :create_objects
+
+    # Empties the summary table and fills it again from the source table.
+    def rebuild
+      values = @group_by + @aggregates.map do |column, function, argument|
+        case function
+          when "sum" then "coalesce( sum(#{argument}), 0 )"
+          else "#{function}(#{argument})"
+        end
+      end
+
+      @db.execute "DELETE FROM #{@name}"
+      sql = "INSERT INTO #{@name} SELECT #{values.join( ', ' )}, count(*) " +
+        "FROM #{@source}"
+      sql << " GROUP BY #{@group_by.join( ', ' )}" unless @group_by.empty?
+      @db.execute sql
+      @db.execute "DELETE FROM #{@name} WHERE _rows = 0"
+    end
+    private :rebuild
+
+    # Returns the CREATE TRIGGER statement for the given event, with the
+    # given statements as its body. (The statements avoid CASE expressions,
+    # since the END of a CASE would be taken for the end of the body when the
+    # trigger is parsed.)
+    def trigger( event, statements )
+      "CREATE TRIGGER #{@name}_#{event} AFTER #{event.upcase} ON #{@source} " +
+        "BEGIN #{statements.map { |sql| sql + ';' }.join( ' ' )} END"
+    end
+    private :trigger
+
+    # The statements that add the row +row+ (+new+) to its group: the group's
+    # row is created if there is none, and then adjusted.
+    def added( row )
+      initial = @group_by.map { |column| "#{row}.#{column}" } +
+        @aggregates.map { |column, function| function =~ /count|sum/ ? "0" : "NULL" }
+
+      changes = [ "_rows = _rows + 1" ] + @aggregates.map do |column, function, argument|
+        value = "#{row}.#{argument}"
+        case function
+          when "count"
+            argument == "*" ? "#{column} = #{column} + 1" :
+              "#{column} = #{column} + ( #{value} NOTNULL )"
+          when "sum"
+            "#{column} = #{column} + coalesce( #{value}, 0 )"
+          else
+            "#{column} = #{function}( coalesce( #{column}, #{value} ), " +
+              "coalesce( #{value}, #{column} ) )"
+        end
+      end
+
+      [ "INSERT INTO #{@name} SELECT #{initial.join( ', ' )}, 0 " +
+          "WHERE ( SELECT count(*) FROM #{@name} WHERE #{match( @name, row )} ) = 0",
+        "UPDATE #{@name} SET #{changes.join( ', ' )} WHERE #{match( @name, row )}" ]
+    end
+    private :added
+
+    # The statements that take the row +row+ (+old+) out of its group: the
+    # group's counts and sums are adjusted, its minimums and maximums are
+    # computed again if +row+ held them, and the group's row is deleted once
+    # it is empty.
+    def removed( row )
+      changes = [ "_rows = _rows - 1" ]
+      extremes = []
+
+      @aggregates.each do |column, function, argument|
+        value = "#{row}.#{argument}"
+        case function
+          when "count"
+            changes << ( argument == "*" ? "#{column} = #{column} - 1" :
+              "#{column} = #{column} - ( #{value} NOTNULL )" )
+          when "sum"
+            changes << "#{column} = #{column} - coalesce( #{value}, 0 )"
+          else
+            extremes << "UPDATE #{@name} SET #{column} = " +
+              "( SELECT #{function}(#{argument}) FROM #{@source} " +
+              "WHERE #{match( @source, row )} ) " +
+              "WHERE #{match( @name, row )} AND #{column} = #{value}"
+        end
+      end
+
+      [ "UPDATE #{@name} SET #{changes.join( ', ' )} WHERE #{match( @name, row )}" ] +
+        extremes +
+        [ "DELETE FROM #{@name} WHERE #{match( @name, row )} AND _rows <= 0" ]
+    end
+    private :removed
+
+    # The condition matching the grouping columns of +table+ to those of
+    # +row+, treating NULLs as equal (as GROUP BY does).
+    def match( table, row )
+      return "1" if @group_by.empty?
+      @group_by.map do |column|
+        "( #{table}.#{column} = #{row}.#{column} OR " +
+          "( #{table}.#{column} ISNULL AND #{row}.#{column} ISNULL ) )"
+      end.join( " AND " )
+    end
+    private :match
+
+  end
+
+end
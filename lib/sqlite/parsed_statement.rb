@@ -50,25 +50,38 @@ module SQLite
       # parameter must be a hash, and the value bound to this token is the
       # element with the key given to this token when it was created. If that
       # element is +nil+, this will return the string "NULL". If the element
-      # is a String, then it will be quoted and escaped and returned.
-      # Otherwise, the "to_s" method of the element will be called and the
-      # result returned.
+      # is a String, then it will be quoted and escaped and returned. If the
+      # element is an Array, each of its elements is converted in the same
+      # way, and the results are joined with commas (so that the array may be
+      # bound to the placeholder in <tt>IN (?)</tt>); an empty array becomes
+      # "NULL", which matches nothing. Otherwise, the "to_s" method of the
+      # element will be called and the result returned.
       def to_s( vars=nil )
         if vars.nil?
           ":#{@name}"
         else
           var = vars[ @name ]
-          case var
-            when nil
-              "NULL"
-            when String
-              "'#{var.gsub(/'/,"''")}'"
-            else
-              var.to_s
+          if var.is_a?( Array ) && !var.empty?
+            var.map { |item| quote( item ) }.join( "," )
+          else
+            quote( var.is_a?( Array ) ? nil : var )
           end
         end
       end
 
+      # Converts a single value to its SQL representation.
+      def quote( var )
+        case var
+          when nil
+            "NULL"
+          when String
+            "'#{var.gsub(/'/,"''")}'"
+          else
+            var.to_s
+        end
+      end
+      private :quote
+
     end
 
     # The text trailing the first recognized SQL statement that was parsed from
@@ -60,6 +60,30 @@ module SQLite
     end
     private :get_query_pragma
 
+    # Returns (or yields) copies of the given rows, taken from the schema
+    # catalog, in the form #execute would have returned them: as hashes if
+    # #results_as_hash is set, and as arrays otherwise.
+    def get_catalog_pragma( rows, &block ) # :yields: row
+      rows = rows.map do |row|
+        if results_as_hash
+          copy = {}
+          row.fields.each_with_index do |field, index|
+            copy[ field ] = copy[ index ] = row[ index ]
+          end
+        else
+          copy = row.dup
+          copy.extend ResultSet::FieldsContainer
+          copy.fields = row.fields
+        end
+        copy
+      end
+
+      return rows unless block
+      rows.each( &block )
+      nil
+    end
+    private :get_catalog_pragma
+
     # Return the value of the given pragma.
     def get_enum_pragma( name )
       get_first_value( "PRAGMA #{name}" )
@@ -187,16 +211,19 @@ module SQLite
       get_query_pragma "foreign_key_list", table, &block
     end
 
+    # The index_info, index_list and table_info pragmas are answered from the
+    # database's SchemaCatalog, rather than by querying the database.
+
     def index_info( index, &block ) # :yields: row
-      get_query_pragma "index_info", index, &block
+      get_catalog_pragma catalog.index_info( index ), &block
     end
 
     def index_list( table, &block ) # :yields: row
-      get_query_pragma "index_list", table, &block
+      get_catalog_pragma catalog.index_list( table ), &block
     end
 
     def table_info( table, &block ) # :yields: row
-      get_query_pragma "table_info", table, &block
+      get_catalog_pragma catalog.table_info( table ), &block
     end
   
   end
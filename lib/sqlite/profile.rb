@@ -0,0 +1,79 @@
+module SQLite
+
+  # The result of profiling one execution of a statement with
+  # Database#profile. It records how many times each instruction of the
+  # statement's VDBE program ran, and how long it took. Its string form is a
+  # short hot-spot summary:
+  #
+  #   puts db.profile( "select * from A where name like 'J%'" )
+  class Profile
+
+    # A single instruction of the program, with the number of times it was
+    # executed and the total time (in milliseconds) spent in it.
+    Entry = Struct.new( :addr, :opcode, :p1, :p2, :p3, :count, :time )
+
+    # The SQL text that was profiled.
+    attr_reader :sql
+
+    # The total number of instructions executed.
+    attr_reader :instructions
+
+    # The total time taken, in milliseconds.
+    attr_reader :time
+
+    # An array of Entry objects, one for each instruction that was executed
+    # at least once, in address order. This is empty if the SQLite library
+    # does not support the +vdbe_trace+ pragma.
+    attr_reader :entries
+
+    # Create a new Profile from the result of API.profile. +program+ is the
+    # result of Database#explain for the same statement, and is used to fill
+    # in the operands of each instruction.
+    def initialize( sql, result, program )
+      @sql = sql
+      @instructions, @time, entries = result
+
+      @entries = entries.map do |addr, opcode, count, time|
+        op = program[ addr ]
+        Entry.new( addr, opcode, op && op.p1, op && op.p2, op && op.p3,
+          count, time )
+      end
+    end
+
+    # Returns the +count+ entries on which the most time was spent, most
+    # expensive first.
+    def hot_spots( count=10 )
+      @entries.sort_by { |entry| -entry.time }.first( count )
+    end
+
+    # Returns a hash of each opcode to the [ count, time ] spent in all of
+    # the instructions with that opcode.
+    def by_opcode
+      totals = Hash.new { |h,k| h[k] = [ 0, 0.0 ] }
+      @entries.each do |entry|
+        totals[ entry.opcode ][0] += entry.count
+        totals[ entry.opcode ][1] += entry.time
+      end
+      totals
+    end
+
+    # Returns the hot-spot summary of the profile.
+    def to_s
+      total = ( @time > 0 ? @time : 1.0 )
+      lines = [ "#{@sql}",
+        "  #{@instructions} instructions in #{format( '%.3f', @time )} ms" ]
+
+      unless @entries.empty?
+        lines << "  addr  opcode          count        ms      %"
+        hot_spots.each do |entry|
+          lines << format( "  %4d  %-12s %8d %9.3f %6.1f", entry.addr,
+            entry.opcode, entry.count, entry.time, entry.time * 100 / total )
+        end
+      end
+
+      lines.join( "\n" )
+    end
+
+  end
+
+end
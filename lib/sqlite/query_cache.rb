@@ -0,0 +1,193 @@
+require 'sqlite_api'
+
+module SQLite
+
+  # A cache of query results, for read-mostly data that is queried over and
+  # over with the same SQL and the same bound values. It will rarely be used
+  # directly; see Database#enable_query_cache.
+  #
+  # Results are keyed by the text of the query with its values bound (and
+  # with runs of whitespace outside of string literals collapsed), and are
+  # frozen when they are cached, since the same rows are handed out to every
+  # caller. The cache is bounded by an estimate of the memory its results
+  # use; the least recently used results are discarded first.
+  #
+  # Every cached result is discarded when:
+  #
+  # * the connection executes anything other than a query (or a BEGIN,
+  #   COMMIT, END, EXPLAIN or PRAGMA statement) through Database#execute;
+  # * the connection's last insert row id or change count differ from when
+  #   the cache was last checked, which means something was written by some
+  #   other means (such as Database#execute_batch or a trigger);
+  # * the modification time or size of the database file has changed, which
+  #   means that another process (or connection) has written to it;
+  # * the shape of the rows changes, through Database#results_as_hash=,
+  #   Database#type_translation= or Translator#add_translator.
+  class QueryCache
+
+    # The statements that neither read nor write cached data.
+    NEUTRAL = /\A\s*(begin|commit|end|explain|pragma)\b/i
+
+    # The statements whose results are cached.
+    QUERY = /\A\s*select\b/i
+
+    # A cached result. The entries form a doubly linked list, ordered from the
+    # least to the most recently used, so that finding the result to evict
+    # and marking a result as used are both constant-time.
+    Entry = Struct.new( :key, :rows, :size, :prev, :next )
+
+    # The maximum (estimated) number of bytes the cached results may use.
+    attr_reader :max_bytes
+
+    # Create a new cache for the given Database. +file_name+ is the name of
+    # the database's file, which is watched for changes made by other
+    # writers (it is ignored for <tt>":memory:"</tt> databases).
+    def initialize( db, file_name, max_bytes )
+      @db = db
+      @file_name = ( file_name == ":memory:" ? nil : file_name )
+      @max_bytes = max_bytes
+      @hits = @misses = @evictions = @invalidations = 0
+      clear
+    end
+
+    # Executes the given (bound) SQL, via the block, unless its result is
+    # already cached. The block must return the rows of the result.
+    def fetch( sql )
+      if sql !~ QUERY
+        begin
+          return yield
+        ensure
+          invalidate unless sql =~ NEUTRAL
+        end
+      end
+
+      validate
+      key = sql.gsub( /('(?:[^']|'')*')|\s+/ ) { $1 || " " }.strip
+
+      if ( entry = @entries[ key ] )
+        @hits += 1
+        unlink( entry )
+        append( entry )
+        return entry.rows
+      end
+
+      @misses += 1
+      rows = freeze_rows( yield )
+      store( key, rows )
+      rows
+    end
+
+    # Discards every cached result.
+    def invalidate
+      @invalidations += 1 unless @entries.empty?
+      clear
+    end
+
+    # Returns a hash of statistics for the cache, with the keys
+    # <tt>:hits</tt>, <tt>:misses</tt>, <tt>:hit_rate</tt> (the fraction of
+    # lookups that were hits), <tt>:evictions</tt>, <tt>:invalidations</tt>,
+    # <tt>:entries</tt>, <tt>:bytes</tt> and <tt>:max_bytes</tt>.
+    def stats
+      lookups = @hits + @misses
+      { :hits => @hits, :misses => @misses,
+        :hit_rate => ( lookups > 0 ? @hits.to_f / lookups : 0.0 ),
+        :evictions => @evictions, :invalidations => @invalidations,
+        :entries => @entries.size, :bytes => @bytes,
+        :max_bytes => @max_bytes }
+    end
+
+    # Empties the cache, and takes a new snapshot of the things that are
+    # watched for writes.
+    def clear
+      @entries = {}
+      @head = Entry.new
+      @head.prev = @head.next = @head
+      @bytes = 0
+      @snapshot = snapshot
+    end
+    private :clear
+
+    # Empties the cache if anything has been written since the last snapshot.
+    def validate
+      if snapshot != @snapshot
+        @invalidations += 1 unless @entries.empty?
+        clear
+      end
+    end
+    private :validate
+
+    # Returns the current state of the things that are watched for writes,
+    # and of the settings that decide the shape of the rows.
+    def snapshot
+      state = [ API.last_insert_row_id( @db.handle ), API.changes( @db.handle ),
+                @db.results_as_hash, @db.type_translation ]
+      state << @db.translator.revision if @db.type_translation
+      if @file_name && File.exist?( @file_name )
+        stat = File.stat( @file_name )
+        state << stat.mtime << stat.size
+      end
+      state
+    end
+    private :snapshot
+
+    # Adds the given result to the cache, evicting the least recently used
+    # results to make room for it. Results that would not fit at all are not
+    # cached.
+    def store( key, rows )
+      size = key.length + estimate( rows )
+      return if size > @max_bytes
+
+      while @bytes + size > @max_bytes
+        oldest = @head.next
+        unlink( oldest )
+        @entries.delete( oldest.key )
+        @bytes -= oldest.size
+        @evictions += 1
+      end
+
+      append( @entries[ key ] = Entry.new( key, rows, size ) )
+      @bytes += size
+    end
+    private :store
+
+    # Takes the given entry out of the list of entries.
+    def unlink( entry )
+      entry.prev.next = entry.next
+      entry.next.prev = entry.prev
+    end
+    private :unlink
+
+    # Adds the given entry to the end (the most recently used end) of the
+    # list of entries.
+    def append( entry )
+      entry.prev = @head.prev
+      entry.next = @head
+      @head.prev.next = entry
+      @head.prev = entry
+    end
+    private :append
+
+    # An estimate of the number of bytes used by the given rows.
+    def estimate( rows )
+      rows.inject( 40 ) do |total, row|
+        values = ( row.is_a?( Hash ) ? row.values : row )
+        values.inject( total + 40 ) do |sum, value|
+          sum + ( value.is_a?( String ) ? 24 + value.length : 16 )
+        end
+      end
+    end
+    private :estimate
+
+    # Freezes the given rows, and the values in them.
+    def freeze_rows( rows )
+      rows.each do |row|
+        ( row.is_a?( Hash ) ? row.values : row ).each { |value| value.freeze }
+        row.freeze
+      end
+      rows.freeze
+    end
+    private :freeze_rows
+
+  end
+
+end
@@ -1,4 +1,5 @@
 require 'sqlite_api'
+require 'sqlite/lazy_row'
 
 module SQLite
 
@@ -25,11 +26,36 @@ module SQLite
     # An array of the column types for this result set (may be empty)
     attr_reader :types
 
+    # The untranslated values of the row last returned by #next, if the
+    # result set was created with the <tt>:keep_raw</tt> option.
+    attr_reader :raw_row
+
     # Create a new ResultSet attached to the given database, using the
-    # given sql text.
-    def initialize( db, sql )
+    # given sql text. The +options+ hash may contain:
+    #
+    # <tt>:intern</tt>:: if +true+, text columns found to hold only a few
+    #                    distinct values are interned, so that each repeated
+    #                    value is returned as the same frozen String. This
+    #                    may also be an array of the column names or indexes
+    #                    to intern.
+    # <tt>:lazy</tt>::   if +true+, rows are returned as LazyRow objects,
+    #                    which only create the values of the columns that
+    #                    are accessed.
+    # <tt>:keep_raw</tt>:: if +true+, the values of each row are also kept as
+    #                    they were read, before any type translation (see
+    #                    #raw_row). Values are then never converted
+    #                    natively, only by the translator.
+    # <tt>:read_ahead</tt>:: if +true+ (or a number of rows, 64 by default),
+    #                    the statement is stepped by a native thread that
+    #                    keeps that many rows buffered ahead of the caller,
+    #                    so that SQLite's work overlaps with the caller's
+    #                    processing of each row. The database may not be
+    #                    used for anything else until the result set has
+    #                    been read to the end or closed. See API.read_ahead.
+    def initialize( db, sql, options={} )
       @db = db
       @sql = sql
+      @options = options
       commence
     end
 
@@ -38,6 +64,17 @@ module SQLite
     def commence
       @vm, = API.compile( @db.handle, @sql )
 
+      if @db.type_translation && !@options[:keep_raw]
+        API.set_conversions( @vm, @db.translator.native_conversions )
+      end
+
+      API.intern_strings( @vm, @options[:intern] ) if @options[:intern]
+      API.set_lazy_rows( @vm, true ) if @options[:lazy]
+
+      if ( read_ahead = @options[:read_ahead] )
+        API.read_ahead( @vm, read_ahead == true ? 64 : read_ahead )
+      end
+
       @current_row = API.step( @vm )
 
       @columns = @current_row[ :columns ]
@@ -86,6 +123,9 @@ module SQLite
     #
     # For hashes, the column names are the keys of the hash, and the column
     # types are accessible via the +types+ property.
+    #
+    # If the result set was created with the <tt>:lazy</tt> option, the
+    # returned value is a LazyRow instead.
     def next
       return nil if @eof
 
@@ -97,10 +137,17 @@ module SQLite
       end
 
       unless @eof
+        @db.row_read
         row = result[:row]
+        return lazy_row( row ) if row.is_a?( API::RawRow )
+        @raw_row = row.dup if @options[:keep_raw]
 
         if @db.type_translation
+          # values that were converted natively (see
+          # Translator#native_conversions) are no longer strings, and are
+          # passed through as they are
           row = @types.zip( row ).map do |type, value|
+            next value unless value.is_a?( String )
             @db.translator.translate( type, value )
           end
         end
@@ -123,6 +170,18 @@ module SQLite
       nil
     end
 
+    # Wraps the given API::RawRow in a LazyRow.
+    def lazy_row( raw )
+      unless @indexes
+        @indexes = {}
+        @columns.each_with_index { |name, index| @indexes[ name ] = index }
+      end
+
+      translator = ( @db.type_translation ? @db.translator : nil )
+      LazyRow.new( raw, @columns, @types, @indexes, translator )
+    end
+    private :lazy_row
+
     # Required by the Enumerable mixin. Provides an internal iterator over the
     # rows of the result set.
     def each
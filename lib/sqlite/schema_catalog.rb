@@ -0,0 +1,142 @@
+require 'sqlite_api'
+require 'sqlite/resultset'
+
+module SQLite
+
+  # A SchemaCatalog holds an in-memory copy of a database's schema: the
+  # contents of +sqlite_master+, and (loaded as each table is first asked
+  # about) the +table_info+, +index_list+ and +index_info+ pragmas. Each
+  # Database has one, obtained via Database#catalog, which the pragma helpers
+  # consult instead of querying the database each time.
+  #
+  # The catalog is discarded whenever the connection executes a CREATE or
+  # DROP statement, encounters a SchemaChangedException, or loads data by
+  # other means (such as Database#restore). Changes made by
+  # other connections are noticed by comparing a "cookie" (a summary of
+  # +sqlite_master+) with the one taken when the catalog was loaded; this is
+  # done at most once every #check_interval seconds.
+  class SchemaCatalog
+
+    # The summary of +sqlite_master+ used to detect schema changes.
+    COOKIE_SQL = "select count(*), max(rowid), sum(length(sql)) " +
+      "from sqlite_master"
+
+    # The number of seconds between checks of the schema cookie (default 1).
+    # Set it to 0 to check on every lookup.
+    attr_accessor :check_interval
+
+    # Create a new, empty catalog for the given Database.
+    def initialize( db )
+      @db = db
+      @check_interval = 1
+      invalidate!
+    end
+
+    # Discards everything in the catalog, so that it is reloaded from the
+    # database when it is next consulted.
+    def invalidate!
+      @master = nil
+      @pragmas = {}
+      @cookie = nil
+      @checked_at = nil
+    end
+
+    # Returns the names of the tables in the database.
+    def tables
+      master.select { |row| row[0] == "table" }.map { |row| row[1] }
+    end
+
+    # Returns the names of the indexes in the database.
+    def indexes
+      master.select { |row| row[0] == "index" }.map { |row| row[1] }
+    end
+
+    # Returns the SQL text that created the named table or index, or +nil+ if
+    # there is no such object (or it was created implicitly).
+    def sql( name )
+      row = master.find { |entry| entry[1].downcase == name.to_s.downcase }
+      row && row[3]
+    end
+
+    # Returns the rows of <tt>PRAGMA table_info</tt> for the given table.
+    def table_info( table )
+      pragma( "table_info", table )
+    end
+
+    # Returns the rows of <tt>PRAGMA index_list</tt> for the given table.
+    def index_list( table )
+      pragma( "index_list", table )
+    end
+
+    # Returns the rows of <tt>PRAGMA index_info</tt> for the given index.
+    def index_info( index )
+      pragma( "index_info", index )
+    end
+
+    # Returns the names of the columns of the given table.
+    def columns( table )
+      table_info( table ).map { |row| row[1] }
+    end
+
+    # Returns the declared types of the columns of the given table.
+    def types( table )
+      table_info( table ).map { |row| row[2] }
+    end
+
+    # Returns the (cached) rows of +sqlite_master+, as
+    # [ type, name, tbl_name, sql ].
+    def master
+      check
+      @master ||= rows( "select type, name, tbl_name, sql from sqlite_master" )
+    end
+    private :master
+
+    # Returns the (cached) rows of the given pragma.
+    def pragma( name, argument )
+      check
+      key = "#{name} #{argument.to_s.downcase}"
+      @pragmas[ key ] ||=
+        rows( "PRAGMA #{name}( '#{argument.to_s.gsub( /'/, "''" )}' )" )
+    end
+    private :pragma
+
+    # Compares the schema cookie with the one taken when the catalog was
+    # loaded (unless that was done within the last #check_interval seconds),
+    # and discards the catalog if they differ.
+    def check
+      now = Time.now
+      return if @checked_at && now - @checked_at < @check_interval
+
+      cookie = rows( COOKIE_SQL ).first.join( "," )
+      invalidate! if @cookie && cookie != @cookie
+
+      @cookie = cookie
+      @checked_at = now
+    end
+    private :check
+
+    # Executes the given SQL directly through the API, so that the rows are
+    # neither translated nor turned into hashes, and returns them frozen.
+    def rows( sql )
+      vm, = API.compile( @db.handle, sql )
+      rows = []
+      begin
+        loop do
+          result = API.step( vm )
+          break unless result.has_key?( :row )
+
+          row = result[ :row ]
+          row.extend ResultSet::FieldsContainer
+          row.fields = result[ :columns ]
+          rows << row.freeze
+        end
+      ensure
+        API.finalize( vm )
+      end
+      rows.freeze
+    end
+    private :rows
+
+  end
+
+end
@@ -0,0 +1,330 @@
+require 'thread'
+require 'sqlite/database'
+
+module SQLite
+
+  # A ShardSet holds one Database for each of a number of files that share
+  # a schema (a dataset split up by tenant or by date, for instance), and
+  # runs queries on all of them at once, merging the results.
+  #
+  #   shards = SQLite::ShardSet.new( Dir["data/*.db"] )
+  #   shards.execute( "select name, total from orders order by total desc" )
+  #   shards.execute( "select count(*), max(total) from orders" )
+  #   shards.close
+  #
+  # Each shard is queried in a thread of its own. When the query has an
+  # ORDER BY clause, the (already sorted) results of the shards are merged as
+  # they arrive, so #each can start yielding rows before every shard has
+  # finished. A LIMIT clause (with or without an OFFSET) is applied to the
+  # merged result: each shard is asked for at most the limit plus the offset
+  # rows, and the offset is skipped after merging.
+  #
+  # A query whose result columns include the aggregates +count+, +sum+,
+  # +min+ or +max+ is combined instead: the rows of all the shards with the
+  # same values in the other (grouping) columns are folded into one, by
+  # adding up the counts and sums and taking the least (or greatest) of the
+  # minimums (or maximums). Other aggregates, such as +avg+, cannot be
+  # combined this way, and cause an ArgumentError.
+  class ShardSet
+
+    # The number of rows a shard may get ahead of the merge.
+    QUEUE_SIZE = 256
+
+    # The kinds of aggregate that can be combined across shards.
+    AGGREGATE = /\A(count|sum|min|max|avg|total)\s*\(/i
+
+    # A LIMIT clause at the end of a query, in any of the forms
+    # <tt>LIMIT n</tt>, <tt>LIMIT n OFFSET m</tt> and <tt>LIMIT m, n</tt>.
+    LIMIT = /\blimit\s+(\d+)(?:\s*(,|\s+offset\s+)\s*(\d+))?\s*\z/i
+
+    # A string holding a number.
+    NUMERIC = /\A\s*-?(\d+(\.\d*)?|\.\d+)([eE][-+]?\d+)?\s*\z/
+
+    # The Database objects of the shards.
+    attr_reader :shards
+
+    # Create a new ShardSet. Each element of +sources+ may be the name of a
+    # database file (which is opened) or an open Database. Rows are merged
+    # as arrays, so the databases may not have Database#results_as_hash set.
+    def initialize( sources )
+      @shards = sources.map do |source|
+        source.is_a?( Database ) ? source : Database.new( source )
+      end
+
+      if @shards.any? { |db| db.results_as_hash }
+        raise ArgumentError, "shards may not return results as hashes"
+      end
+    end
+
+    # Closes every shard.
+    def close
+      @shards.each { |db| db.close }
+    end
+
+    # Runs the given query on every shard, and returns all the (merged or
+    # combined) rows as an array.
+    def execute( sql, *bind_vars )
+      rows = []
+      each( sql, *bind_vars ) { |row| rows << row }
+      rows
+    end
+
+    # Runs the given query on every shard, and yields each of the (merged or
+    # combined) rows.
+    def each( sql, *bind_vars, &block )
+      sql = ParsedStatement.new( sql ).bind_params( *bind_vars ).to_s
+      order = order_by( sql )
+      limit, offset = limit_clause( sql )
+      offset ||= 0
+      sql = sql.sub( LIMIT, "" ) if limit
+
+      if ( aggregates = aggregates( sql ) )
+        # every shard's groups are needed before any can be combined
+        rows = combine( aggregates, gather( sql ) )
+        rows = rows.sort { |a,b| compare( order, a, b ) } if order
+        rows = rows[ offset, limit ] || [] if limit
+        rows.each( &block )
+      else
+        # no shard can contribute more than limit+offset rows to the result
+        sql = "#{sql} LIMIT #{limit + offset}" if limit
+        scatter( sql, order, limit, offset, &block )
+      end
+
+      nil
+    end
+
+    # Returns the row count and offset of the query's LIMIT clause, or
+    # +nil+ if it has none.
+    def limit_clause( sql )
+      return nil unless sql =~ LIMIT
+      return [ $1.to_i, 0 ] unless $2
+      $2 == "," ? [ $3.to_i, $1.to_i ] : [ $1.to_i, $3.to_i ]
+    end
+    private :limit_clause
+
+    # Returns the terms of the query's ORDER BY clause, as an array of
+    # [ column, descending ] pairs, where +column+ is either a column name or
+    # a (zero-based) column index. Returns +nil+ if there is no ORDER BY.
+    def order_by( sql )
+      clause = sql[ /\border\s+by\s+(.*?)(?:\blimit\b.*)?\z/im, 1 ] or
+        return nil
+
+      clause.split( "," ).map do |term|
+        term = term.strip
+        descending = !!( term =~ /\s+desc\z/i )
+        column = term.sub( /\s+(asc|desc)\z/i, "" ).sub( /\A\w+\./, "" )
+        column = column.to_i - 1 if column =~ /\A\d+\z/
+        [ column, descending ]
+      end
+    end
+    private :order_by
+
+    # Returns the kind of each result column of the query (the name of the
+    # aggregate function, in lower case, or +nil+ for a grouping column) if
+    # any of them is an aggregate, or +nil+ if none is.
+    def aggregates( sql )
+      list = sql[ /\A\s*select\s+(.*?)\s+from\b/im, 1 ] or return nil
+
+      # split the list at the commas that are not within parentheses
+      items = [ "" ]
+      depth = 0
+      list.scan( /[(),]|[^(),]+/ ) do |token|
+        depth += 1 if token == "("
+        depth -= 1 if token == ")"
+        if token == "," && depth == 0
+          items << ""
+        else
+          items.last << token
+        end
+      end
+
+      kinds = items.map { |item| item.strip[ AGGREGATE, 1 ] }
+      return nil if kinds.compact.empty?
+
+      kinds.map do |kind|
+        next nil unless kind
+        kind = kind.downcase
+        kind = "sum" if kind == "total"
+        raise ArgumentError, "#{kind}() cannot be combined across shards" if
+          kind == "avg"
+        kind
+      end
+    end
+    private :aggregates
+
+    # Runs the query on every shard, in parallel, and returns all of the rows.
+    def gather( sql )
+      threads = @shards.map do |db|
+        Thread.new { db.execute( sql ) }
+      end
+      threads.inject( [] ) { |rows, thread| rows.concat( thread.value ) }
+    end
+    private :gather
+
+    # Folds together the rows that have the same values in their grouping
+    # columns.
+    def combine( kinds, rows )
+      groups = {}
+      order = []
+
+      rows.each do |row|
+        key = []
+        kinds.each_with_index { |kind, i| key << row[i] unless kind }
+
+        unless ( combined = groups[ key ] )
+          groups[ key ] = row
+          order << key
+          next
+        end
+
+        totals = combined.dup
+        kinds.each_with_index do |kind, i|
+          next unless kind
+          a, b = totals[i], row[i]
+          # like SQL's min and max, ignore NULLs (from an empty shard, say)
+          totals[i] = if a.nil? || b.nil?
+            a.nil? ? b : a
+          else
+            case kind
+              when "min" then ( compare_values( a, b ) <= 0 ? a : b )
+              when "max" then ( compare_values( a, b ) >= 0 ? a : b )
+              else add( a, b )
+            end
+          end
+        end
+
+        totals.extend ResultSet::FieldsContainer
+        totals.fields = row.fields if row.respond_to?( :fields )
+        totals.extend ResultSet::TypesContainer
+        totals.types = row.types if row.respond_to?( :types )
+        groups[ key ] = totals
+      end
+
+      order.map { |key| groups[ key ] }
+    end
+    private :combine
+
+    # Adds two values (either of which may be +nil+) that may be numbers or
+    # strings holding numbers; the result has the same form as the values.
+    def add( a, b )
+      return a if b.nil?
+      return b if a.nil?
+      return a + b unless a.is_a?( String )
+
+      sum = number( a ) + number( b )
+      sum.to_s
+    end
+    private :add
+
+    # Converts a string holding a number to an Integer or a Float.
+    def number( value )
+      value =~ /\A\s*-?\d+\s*\z/ ? value.to_i : value.to_f
+    end
+    private :number
+
+    # Runs the query on every shard in parallel, yielding the rows as they
+    # arrive (merged in order, if there is an ORDER BY clause), skipping the
+    # first +offset+ of them and stopping after +limit+.
+    def scatter( sql, order, limit, offset )
+      stop = false
+      queues = @shards.map { SizedQueue.new( QUEUE_SIZE ) }
+      threads = []
+
+      @shards.each_with_index do |db, i|
+        threads << Thread.new( db, queues[i] ) do |shard, queue|
+          begin
+            shard.execute( sql ) do |row|
+              break if stop
+              queue << [ :row, row ]
+            end
+            queue << [ :done ]
+          rescue Exception => error
+            queue << [ :error, error ]
+          end
+        end
+      end
+
+      begin
+        count = 0
+        heads = queues.map { |queue| next_row( queue ) }
+
+        loop do
+          index = nil
+          heads.each_with_index do |row, i|
+            next if row.nil?
+            index = i if index.nil? ||
+              ( order && compare( order, row, heads[index] ) < 0 )
+            break if index && !order
+          end
+          break if index.nil?
+          break if limit && count >= limit + offset
+
+          yield heads[index] if count >= offset
+          count += 1
+          heads[index] = next_row( queues[index] )
+        end
+      ensure
+        stop = true
+        threads.each_with_index do |thread, i|
+          while thread.alive?
+            queues[i].pop( true ) rescue Thread.pass
+          end
+        end
+      end
+    end
+    private :scatter
+
+    # Returns the next row from a shard's queue, or +nil+ if the shard has
+    # no more rows. Raises the shard's exception if its query failed.
+    def next_row( queue )
+      kind, value = queue.pop
+      raise value if kind == :error
+      ( kind == :row ? value : nil )
+    end
+    private :next_row
+
+    # Compares two rows according to the given ORDER BY terms.
+    def compare( order, a, b )
+      order.each do |column, descending|
+        result = compare_values( value_of( a, column ), value_of( b, column ) )
+        result = -result if descending
+        return result unless result == 0
+      end
+      0
+    end
+    private :compare
+
+    # Returns the value of the given column (a name or an index) of a row.
+    def value_of( row, column )
+      return row[ column ] if column.is_a?( Integer )
+      index = row.fields.index( column ) ||
+        row.fields.index( row.fields.find { |f| f.downcase == column.downcase } )
+      index ? row[ index ] : nil
+    end
+    private :value_of
+
+    # Compares two values as SQLite does: NULLs first, then numbers
+    # (including strings that hold numbers) in numeric order, then strings.
+    def compare_values( a, b )
+      return 0 if a.nil? && b.nil?
+      return -1 if a.nil?
+      return 1 if b.nil?
+
+      a = number( a ) if a.is_a?( String ) && a =~ NUMERIC
+      b = number( b ) if b.is_a?( String ) && b =~ NUMERIC
+
+      if a.is_a?( Numeric ) && b.is_a?( Numeric )
+        a <=> b
+      elsif a.is_a?( Numeric )
+        -1
+      elsif b.is_a?( Numeric )
+        1
+      else
+        a.to_s <=> b.to_s
+      end
+    end
+    private :compare_values
+
+  end
+
+end
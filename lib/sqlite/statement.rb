@@ -18,8 +18,11 @@ module SQLite
     # encapsulates the given SQL text. If the text contains more than one
     # statement (i.e., separated by semicolons), then the #remainder property
     # will be set to the trailing text.
-    def initialize( db, sql )
+    #
+    # The +options+ are passed to each ResultSet created by #execute.
+    def initialize( db, sql, options={} )
       @db = db
+      @options = options
       @statement = ParsedStatement.new( sql )
       @remainder = @statement.trailing.strip
       @sql = @statement.to_s
@@ -51,6 +54,12 @@ module SQLite
       @statement.bind_param( param, value )
     end
 
+    # Returns the SQL text of the statement, with the values of any bound
+    # parameters substituted in.
+    def to_s
+      @statement.to_s
+    end
+
     # Execute the statement. This creates a new ResultSet object for the
     # statement's virtual machine. If a block was given, the new ResultSet will
     # be yielded to it and then closed; otherwise, the ResultSet will be
@@ -69,7 +78,13 @@ module SQLite
     # See also #bind_params, #execute!.
     def execute( *bind_vars )
       bind_params *bind_vars unless bind_vars.empty?
-      results = ResultSet.new( @db, @statement.to_s )
+      begin
+        results = ResultSet.new( @db, @statement.to_s, @options )
+      rescue Exceptions::SchemaChangedException
+        @db.schema_changed
+        raise
+      end
+      @db.schema_changed if @statement.to_s =~ /\A\s*(create|drop)\b/i
 
       if block_given?
         begin
@@ -16,9 +16,15 @@ module SQLite
     # translators for most SQL data types.
     def initialize
       @translators = Hash.new( proc { |type,value| value } )
+      @native_conversions = Hash.new
+      @revision = 0
       register_default_translators
     end
 
+    # The number of times #add_translator has been called; QueryCache uses
+    # this to notice that cached rows were translated differently.
+    attr_reader :revision
+
     # Add a new translator block, which will be invoked to process type
     # translations to the given type. The type should be an SQL datatype, and
     # may include parentheses (i.e., "VARCHAR(30)"). However, any parenthetical
@@ -33,7 +39,21 @@ module SQLite
     #
     # The block should return the translated value.
     def add_translator( type, &block ) # :yields: type, value
+      @native_conversions.delete( type_name( type ) )
       @translators[ type_name( type ) ] = block
+      @revision += 1
+    end
+
+    # Returns a hash of the type names whose values may be converted by the
+    # extension library itself, as the rows are read, instead of by a
+    # translator block. Each type name maps to the kind of conversion
+    # (<tt>:integer</tt>, <tt>:float</tt> or <tt>:time</tt>). Only types that
+    # still use a default translator are included; replacing a translator via
+    # #add_translator removes its type from this hash.
+    #
+    # This is used by ResultSet, via API.set_conversions.
+    def native_conversions
+      @native_conversions
     end
 
     # Translate the given string value to a value of the given type. In the
@@ -47,10 +67,12 @@ module SQLite
     end
 
     # A convenience method for working with type names. This returns the "base"
-    # type name, without any parenthetical data.
+    # type name, without any parenthetical data or surrounding whitespace
+    # (so "decimal (10,2)" becomes "DECIMAL"). The extension library
+    # normalizes type names in the same way.
     def type_name( type )
       type = $1 if type =~ /^(.*?)\(/
-      type.upcase
+      type.strip.upcase
     end
     private :type_name
 
@@ -59,7 +81,10 @@ module SQLite
     def register_default_translators
       [ "date",
         "datetime",
-        "time" ].each { |type| add_translator( type ) { |t,v| Time.parse( v ) } }
+        "time" ].each do |type|
+        add_translator( type ) { |t,v| Time.parse( v ) }
+        @native_conversions[ type_name( type ) ] = :time
+      end
 
       [ "decimal",
         "float",
@@ -67,13 +92,19 @@ module SQLite
         "double",
         "real",
         "dec",
-        "fixed" ].each { |type| add_translator( type ) { |t,v| v.to_f } }
+        "fixed" ].each do |type|
+        add_translator( type ) { |t,v| v.to_f }
+        @native_conversions[ type_name( type ) ] = :float
+      end
 
       [ "integer",
         "smallint",
         "mediumint",
         "int",
-        "bigint" ].each { |type| add_translator( type ) { |t,v| v.to_i } }
+        "bigint" ].each do |type|
+        add_translator( type ) { |t,v| v.to_i }
+        @native_conversions[ type_name( type ) ] = :integer
+      end
 
       [ "bit",
         "bool",
@@ -58,6 +58,50 @@ class TC_APICore < Test::Unit::TestCase
     API.close( db )
   end
 
+  def test_close_finalizes_statements
+    db = API.open( "db/fixtures.db", 0 )
+    vm, rest = API.compile( db, "select name from A" )
+    API.step( vm )
+    assert_equal 1, API.open_statements( db ).length
+
+    API.close( db )
+    assert_raise( SQLite::Exceptions::MisuseException ) do
+      API.step( vm )
+    end
+    assert_nil API.finalize( vm )
+  end
+
+  def test_read_ahead
+    db = API.open( "db/fixtures.db", 0 )
+    vm, = API.compile( db, "select name, age from A order by name" )
+
+    if API.read_ahead( vm, 2 )
+      assert_raise( SQLite::Exceptions::MisuseException ) do
+        API.compile( db, "select count(*) from A" )
+      end
+    end
+
+    names = []
+    loop do
+      result = API.step( vm )
+      break unless result.has_key?( :row )
+      names << result[:row][0]
+    end
+    assert_equal [ nil, "Amber", "Cinnamon", "Juniper", "Timothy", "Zephyr" ],
+      names
+
+    vm2, = API.compile( db, "select count(*) from A" )
+    assert_equal "6", API.step( vm2 )[:row][0]
+    API.finalize( vm2 )
+    API.finalize( vm )
+
+    vm, = API.compile( db, "select name from A" )
+    API.read_ahead( vm, 1 )
+    API.step( vm )
+    API.finalize( vm )
+    API.close( db )
+  end
+
   def test_bad_compile
     db = API.open( "db/fixtures.db", 0 )
     assert_raise( SQLite::Exceptions::SQLException ) do
@@ -1,6 +1,7 @@
 $:.unshift "lib"
 
 require 'sqlite'
+require 'stringio'
 require 'test/unit'
 
 class TC_Database < Test::Unit::TestCase
@@ -61,6 +62,59 @@ class TC_Database < Test::Unit::TestCase
     assert_equal [], rows
   end
 
+  def test_bind_array
+    names = [ "Amber", "Juniper", "Zephyr", "Timothy", "nobody" ]
+    rows = @db.execute( "select name from A where name in (?) order by name",
+      names )
+    assert_equal [ "Amber", "Juniper", "Timothy", "Zephyr" ], rows.flatten
+
+    @db.in_list_limit = 2
+    rows = @db.execute( "select name from A where name in (?)", names )
+    assert_equal [ "Amber", "Juniper", "Timothy", "Zephyr" ], rows.flatten.sort
+
+    yielded = []
+    @db.execute( "select name from A where name in (?) and age > ?",
+      names, 4 ) { |row| yielded << row[0] }
+    assert_equal [ "Amber" ], yielded
+
+    rows = @db.execute( "select name from A where name in (?) or age = ?",
+      names, 5 )
+    assert_equal [ "Amber", "Juniper", "Timothy", "Zephyr" ], rows.flatten.sort
+  end
+
+  def test_each_page
+    pages = []
+    @db.each_page( "select * from A", :key => "age", :page_size => 4 ) do |rows|
+      pages << rows.map { |row| row[1] }
+    end
+    assert_equal [ [ "1", "2", "3", "4" ], [ "5", "6" ] ], pages
+
+    pages = []
+    @db.each_page( "select name, age from A where age > ?",
+        { :key => [ "age", "name" ], :page_size => 2 }, 1 ) do |rows|
+      pages << rows.map { |row| row[0] }
+    end
+    assert_equal [ [ "Timothy", "Juniper" ], [ "Cinnamon", "Amber" ], [ nil ] ],
+      pages
+
+    assert_raise( ArgumentError ) do
+      @db.each_page( "select * from A", :page_size => 2 ) { }
+    end
+
+    memory = SQLite::Database.new( ":memory:" )
+    memory.execute( "create table T ( day DATE, n INTEGER )" )
+    (1..5).each do |n|
+      memory.execute( "insert into T values ( ?, ? )", "2005-01-0#{n}", n )
+    end
+    memory.type_translation = true
+    pages = []
+    memory.each_page( "select * from T", :key => "day", :page_size => 2 ) do |rows|
+      pages << rows.map { |row| row[1] }
+    end
+    assert_equal [ [ 1, 2 ], [ 3, 4 ], [ 5 ] ], pages
+    memory.close
+  end
+
   def test_result_hash
     @db.results_as_hash = true
     rows = @db.execute( "select * from A where name = ?", "Amber" )
@@ -161,6 +215,556 @@ class TC_Database < Test::Unit::TestCase
     @db.get_first_value( "select barf3(name) from A where name='Amber'" )
   end
 
+  def test_regexp
+    @db.enable_regexp( 2 )
+
+    rows = @db.execute( "select name from A where regexp( ?, name ) order by name",
+      "^[A-J]" )
+    assert_equal [ [ "Amber" ], [ "Cinnamon" ], [ "Juniper" ] ], rows
+
+    @db.get_first_value( "select regexp( 'er$', name ) from A" )
+    @db.get_first_value( "select regexp( 'y', name ) from A" )
+
+    stats = @db.regexp_cache_stats
+    assert_equal 2, stats[:size]
+    assert_equal 2, stats[:capacity]
+    assert_equal 1, stats[:evictions]
+    assert stats[:hits] > 0
+
+    assert_raise( SQLite::Exceptions::SQLException ) do
+      @db.get_first_value( "select regexp( '(', name ) from A" )
+    end
+  end
+
+  def test_load_into_memory_and_save_to
+    memory = SQLite::Database.new( ":memory:" )
+    memory.load_into_memory( "db/fixtures.db" )
+    assert_equal @db.execute( "select * from A order by name" ),
+      memory.execute( "select * from A order by name" )
+    assert_equal 1, memory.execute(
+      "select * from sqlite_master where name='B_idx'" ).length
+
+    memory.execute( "insert into B values ( 1, 'Hazel' )" )
+    memory.execute( "create table R ( name )" )
+    %w{ a b c }.each { |n| memory.execute( "insert into R values ( ? )", n ) }
+    memory.execute( "delete from R where name = 'b'" )
+    memory.save_to( "db/dummy.db" )
+    memory.close
+
+    copy = SQLite::Database.open( "db/dummy.db" )
+    assert_equal [ [ "1", "Hazel" ] ], copy.execute( "select * from B" )
+    assert_equal "6", copy.get_first_value( "select count(*) from A" )
+    assert_equal [ [ "1", "a" ], [ "3", "c" ] ],
+      copy.execute( "select rowid, name from R order by rowid" )
+    copy.close
+  ensure
+    File.delete( "db/dummy.db" ) if File.exist?( "db/dummy.db" )
+  end
+
+  def test_dump_and_restore
+    @db.execute( "insert into B values ( 1, 'it''s; here' )" )
+    @db.execute( "insert into B values ( 2, NULL )" )
+
+    dump = StringIO.new
+    @db.dump( dump )
+    assert_match( /^INSERT INTO 'B' VALUES\(1,'it''s; here'\);$/, dump.string )
+    assert_match( /^INSERT INTO 'B' VALUES\(2,NULL\);$/, dump.string )
+
+    copy = SQLite::Database.new( ":memory:" )
+    dump.rewind
+    assert_equal 12, copy.restore( dump, 5 )
+    assert_equal @db.execute( "select * from B order by id" ),
+      copy.execute( "select * from B order by id" )
+    assert_equal @db.execute( "select * from A order by name" ),
+      copy.execute( "select * from A order by name" )
+    copy.close
+  ensure
+    @db.execute( "delete from B" )
+  end
+
+  def test_import_and_export_csv
+    memory = SQLite::Database.new( ":memory:" )
+    memory.execute( "create table T ( id INTEGER, name, note )" )
+
+    input = StringIO.new( "note,id,name\r\n" +
+      "\"says \"\"hi\"\"\",1,Amber\r\n" +
+      "\"two\nlines\",2,\n" +
+      "\"\",3,\"a, b\"" )
+    assert_equal 3, memory.import_csv( "T", input, :header => true,
+      :batch_size => 2 )
+    assert_equal [ [ "1", "Amber", "says \"hi\"" ], [ "2", nil, "two\nlines" ],
+      [ "3", "a, b", "" ] ], memory.execute( "select * from T order by id" )
+
+    output = StringIO.new
+    assert_equal 3, memory.export_csv( "select * from T order by id", output,
+      :header => true )
+    assert_equal "id,name,note\n1,Amber,\"says \"\"hi\"\"\"\n" +
+      "2,,\"two\nlines\"\n3,\"a, b\",\"\"\n", output.string
+
+    output = StringIO.new
+    memory.export_csv( "select * from T where id > ?", output,
+      { :separator => "\t" }, 1 )
+    assert_equal "2\t\t\"two\nlines\"\n3\ta, b\t\"\"\n", output.string
+
+    memory.execute( "delete from T" )
+    assert_equal 2, memory.import_csv( "T", StringIO.new( output.string ),
+      :separator => "\t" )
+    assert_equal [ [ "2", nil, "two\nlines" ], [ "3", "a, b", "" ] ],
+      memory.execute( "select * from T order by id" )
+
+    assert_raise( SQLite::Exceptions::DatabaseException ) do
+      memory.import_csv( "T", StringIO.new( "4,x,y\n5\n" ) )
+    end
+    assert_equal "2", memory.get_first_value( "select count(*) from T" )
+
+    memory.execute( "create table U ( note )" )
+    memory.execute( "insert into U values ( NULL )" )
+    memory.execute( "insert into U values ( 'x' )" )
+    output = StringIO.new
+    memory.export_csv( "select * from U", output )
+    memory.execute( "delete from U" )
+    assert_equal 2, memory.import_csv( "U", StringIO.new( output.string ) )
+    assert_equal [ [ nil ], [ "x" ] ],
+      memory.execute( "select * from U order by note" )
+
+    memory.transaction
+    assert_equal 2, memory.import_csv( "T", StringIO.new( "4,x,y\n5,x,y\n" ),
+      :batch_size => 1 )
+    memory.rollback
+    assert_equal "2", memory.get_first_value( "select count(*) from T" )
+    memory.close
+  end
+
+  def test_execute_columnar
+    names, ages = @db.execute_columnar( "select * from A order by name limit 3" )
+    assert_equal [ nil, "Amber", "Cinnamon" ], names
+    assert_equal [ "6", "5", "4" ], ages
+
+    data = @db.execute_columnar( "select * from A where age > ?", 10 )
+    assert_equal [ [], [] ], data
+    assert_equal [ "name", "age" ], data.fields
+  end
+
+  def test_execute_undecorated
+    expected = @db.execute( "select * from A order by name" )
+    @db.decorate_rows = false
+    rows = @db.execute( "select * from A order by name" )
+    assert_equal expected, rows
+    assert !rows.first.respond_to?( :fields )
+
+    yielded = []
+    @db.execute( "select age from A where name = 'Amber'" ) { |row| yielded << row }
+    assert_equal [ [ "5" ] ], yielded
+
+    rows = @db.execute( "select * from A where name = ?", "Amber" )
+    assert_equal [ "name", "age" ], rows.first.fields
+
+    assert_raise( SQLite::Exceptions::SQLException ) do
+      @db.execute( "select * from nonexistent" )
+    end
+  ensure
+    @db.decorate_rows = true
+  end
+
+  def test_execute_packed
+    names, ages = @db.execute_packed( "select * from A order by name limit 3" )
+    assert_equal [ nil, "Amber", "Cinnamon" ], names
+    assert_equal [ 6, 5, 4 ], ages.unpack( "q*" )
+
+    memory = SQLite::Database.new( ":memory:" )
+    memory.execute( "create table T ( n INTEGER, x REAL )" )
+    memory.execute( "insert into T values ( 1, NULL )" )
+    n, x = memory.execute_packed( "select * from T" )
+    assert_equal [ 1 ], n.unpack( "q*" )
+    assert x.unpack( "d*" )[0].nan?
+
+    memory.execute( "insert into T values ( '3.7', 2.5 )" )
+    assert_raise( SQLite::Exceptions::MismatchException ) do
+      memory.execute_packed( "select * from T" )
+    end
+    memory.execute( "update T set n = NULL where x = 2.5" )
+    assert_raise( SQLite::Exceptions::MismatchException ) do
+      memory.execute_packed( "select * from T" )
+    end
+    memory.close
+
+    assert_equal 1.5, SQLite::Translator.new.translate( "decimal (10,2)", "1.5" )
+  end
+
+  def test_intern_strings
+    memory = SQLite::Database.new( ":memory:" )
+    memory.execute( "create table T ( id INTEGER, status VARCHAR(10) )" )
+    memory.transaction do
+      100.times do |i|
+        status = ( i % 2 == 0 ? "open" : "closed" )
+        memory.execute( "insert into T values ( ?, ? )", i, status )
+      end
+    end
+
+    rows = memory.prepare( "select * from T", :intern => true ).execute!
+    assert rows[0][1].frozen?
+    assert_same rows[0][1], rows[98][1]
+    assert_same rows[1][1], rows[99][1]
+    assert_not_same rows[0][0], rows[1][0]
+    assert !rows[99][0].frozen?
+
+    rows = memory.prepare( "select * from T", :intern => [ "id" ] ).execute!
+    assert rows[0][0].frozen?
+    assert_not_same rows[0][1], rows[2][1]
+    memory.close
+  end
+
+  def test_open_statements
+    @db.statement_backtraces = true
+    rs = @db.query( "select * from A" )
+    statements = @db.open_statements
+    assert_equal 1, statements.length
+    assert_equal "select * from A", statements[0].sql
+    assert statements[0].backtrace.any? { |line| line =~ /tc_database/ }
+    assert_kind_of Integer, statements[0].lock_held
+
+    rs.close
+    assert_equal [], @db.open_statements
+  end
+
+  def test_explain
+    program = @db.explain( "select * from A where name=?", "Amber" )
+    assert_equal 0, program.first.addr
+    assert_equal "Halt", program.last.opcode
+    assert program.any? { |op| op.opcode == "ColumnName" && op.p3 == "name" }
+  end
+
+  def test_profile
+    profile = @db.profile( "select * from A where age > ?", 3 )
+    assert profile.instructions > 0
+    assert profile.time >= 0
+    profile.entries.each do |entry|
+      assert_equal @db.explain( profile.sql )[ entry.addr ].opcode, entry.opcode
+    end
+    assert_match( /instructions in/, profile.to_s )
+  end
+
+  def test_suggest_indexes
+    memory = SQLite::Database.new( ":memory:" )
+    memory.execute( "create table T ( id INTEGER PRIMARY KEY, code, rank )" )
+    memory.transaction do
+      200.times do |i|
+        memory.execute( "insert into T values ( ?, ?, ? )", i, "c#{i}", i % 7 )
+      end
+    end
+
+    memory.record_workload = true
+    3.times { |i| memory.execute( "select * from T where code = ?", "c#{i}" ) }
+    memory.execute( "select * from T where id = 5" )
+    assert_equal 2, memory.workload.length
+    assert_equal 3, memory.workload.find { |e| e.sql =~ /code/ }.count
+
+    suggestions = memory.suggest_indexes
+    assert_equal 1, suggestions.length
+    assert_equal [ "code" ], suggestions[0].columns
+    assert_match( /\ACREATE INDEX \w+ ON T\( code \)\z/, suggestions[0].sql )
+    assert suggestions[0].benefit > 0
+    memory.close
+  end
+
+  def test_schema_catalog
+    assert_equal [ "name", "age" ], @db.catalog.columns( "A" )
+    assert_equal [ "VARCHAR(60)", "INTEGER" ], @db.catalog.types( "a" )
+    assert @db.catalog.tables.include?( "B" )
+    assert_equal [ "B_idx" ], @db.catalog.indexes
+
+    stmt = @db.prepare( "select AGE, name from A where age > ?" )
+    assert_equal [ "AGE", "name" ], stmt.columns
+    assert_equal [ "INTEGER", "VARCHAR(60)" ], stmt.types
+
+    @db.restore( StringIO.new( "create table Z ( x TEXT );\n" ) )
+    assert_equal [ "TEXT" ], @db.catalog.types( "Z" )
+    assert_equal "x", @db.table_info( "Z" ).first[1]
+
+    @db.execute( "drop table Z" )
+    assert_equal [], @db.catalog.columns( "Z" )
+  ensure
+    @db.execute( "drop table Z" ) if @db.catalog.tables.include?( "Z" )
+  end
+
+  def test_query_cache
+    @db.enable_query_cache
+    first = @db.execute( "select * from A where age > ?", 3 )
+    second = @db.execute( "select   * from A where age > ?", 3 )
+    assert_same first, second
+    assert first.frozen?
+    assert first[0][0].frozen?
+
+    @db.execute( "select * from A where age > ?", 4 )
+    stats = @db.query_cache_stats
+    assert_equal 1, stats[:hits]
+    assert_equal 2, stats[:misses]
+    assert_equal 2, stats[:entries]
+    assert stats[:bytes] > 0
+
+    @db.execute( "insert into B values ( 1, 'Hazel' )" )
+    assert_equal 0, @db.query_cache_stats[:entries]
+    assert_not_same first, @db.execute( "select * from A where age > ?", 3 )
+
+    assert_equal 1, @db.execute( "select * from B" ).length
+    vm, = SQLite::API.compile( @db.handle, "insert into B values ( 2, 'Ivy' )" )
+    SQLite::API.step( vm )
+    SQLite::API.finalize( vm )
+    assert_equal 2, @db.execute( "select * from B" ).length
+
+    assert_equal "2", @db.execute( "select * from B where id = 2" )[0][0]
+    @db.results_as_hash = true
+    assert_equal "Ivy", @db.execute( "select * from B where id = 2" )[0]["name"]
+    @db.results_as_hash = false
+    @db.type_translation = true
+    assert_equal 2, @db.execute( "select * from B where id = 2" )[0][0]
+  ensure
+    @db.disable_query_cache
+    @db.results_as_hash = false
+    @db.type_translation = false
+    @db.execute( "delete from B" )
+  end
+
+  def test_group_committer
+    committer = SQLite::GroupCommitter.new( @db, :max_delay => 0.05 )
+    threads = (1..5).map do |n|
+      Thread.new do
+        committer.submit( "insert into B values ( ?, ? )", n, "name #{n}" )
+      end
+    end
+    handles = threads.map { |thread| thread.value }
+    duplicate = committer.submit( "insert into B values ( 1, 'again' )" )
+    committer.close
+
+    handles.each { |handle| assert_nil handle.error }
+    assert_kind_of SQLite::Exceptions::DatabaseException, duplicate.error
+    assert_equal "5", @db.get_first_value( "select count(*) from B" )
+  ensure
+    @db.execute( "delete from B" )
+  end
+
+  def test_cooperation
+    calls = Hash.new( 0 )
+    scheduler = lambda { |reason| calls[ reason ] += 1 }
+
+    @db.enable_cooperation( :scheduler => scheduler, :instructions => 10,
+        :rows => 2 ) do
+      assert_equal 6, @db.execute( "select * from A order by name" ).length
+    end
+    assert calls[ :progress ] > 0
+    assert_equal 3, calls[ :row ]
+
+    calls.clear
+    @db.execute( "select * from A order by name" )
+    assert calls.empty?
+
+    @db.enable_cooperation( :scheduler => lambda { |reason| raise "stop" },
+      :instructions => 1 )
+    assert_raise( SQLite::Exceptions::AbortException ) do
+      @db.execute( "select * from A" )
+    end
+
+    error = nil
+    scheduler = lambda do |reason|
+      Thread.new do
+        begin
+          @db.execute( "select * from B" )
+        rescue SQLite::Exceptions::MisuseException => error
+        end
+      end.join unless error
+    end
+    @db.enable_cooperation( :scheduler => scheduler, :instructions => 1 ) do
+      assert_equal 6, @db.execute( "select * from A" ).length
+    end
+    assert_kind_of SQLite::Exceptions::MisuseException, error
+  ensure
+    @db.disable_cooperation
+  end
+
+  def test_bulk_load
+    synchronous = @db.synchronous
+    @db.bulk_load( :tables => [ "B" ] ) do |db|
+      assert_equal "0", db.synchronous
+      assert db.transaction_active?
+      assert_equal 0, db.index_list( "B" ).length
+      db.execute( "insert into B values ( 1, 'Hazel' )" )
+    end
+    assert_equal synchronous, @db.synchronous
+    assert !@db.transaction_active?
+    assert_equal [ "B_idx" ], @db.index_list( "B" ).map { |row| row[1] }
+    assert_equal "1", @db.get_first_value( "select count(*) from B" )
+
+    assert_raise( RuntimeError ) do
+      @db.bulk_load( :tables => [ "B" ] ) do |db|
+        db.execute( "insert into B values ( 2, 'Juniper' )" )
+        raise "oops"
+      end
+    end
+    assert_equal synchronous, @db.synchronous
+    assert_equal [ "B_idx" ], @db.index_list( "B" ).map { |row| row[1] }
+    assert_equal "1", @db.get_first_value( "select count(*) from B" )
+  ensure
+    @db.execute( "delete from B" )
+  end
+
+  def test_materialized_aggregate
+    @db.execute( "create table orders ( region, total )" )
+    [ [ "east", 5 ], [ "west", 2 ], [ "east", 9 ] ].each do |row|
+      @db.execute( "insert into orders values ( ?, ? )", *row )
+    end
+
+    summary = @db.create_materialized_aggregate( "sales", "orders",
+      :group_by => "region",
+      :aggregates => { "n" => "count(*)", "revenue" => "sum(total)",
+                       "low" => "min(total)", "high" => "max(total)" } )
+
+    expected = lambda do
+      @db.execute( "select region, count(*), sum(total), min(total), " +
+        "max(total) from orders group by region order by region" ).
+        map { |row| row.map { |value| value.to_s =~ /\A\d/ ? value.to_i : value } }
+    end
+    actual = lambda do
+      @db.execute( "select region, n, revenue, low, high from sales " +
+        "order by region" ).
+        map { |row| row.map { |value| value.to_s =~ /\A\d/ ? value.to_i : value } }
+    end
+
+    assert_equal [ [ "east", 2, 14, 5, 9 ], [ "west", 1, 2, 2, 2 ] ], actual.call
+
+    @db.execute( "insert into orders values ( 'north', 7 )" )
+    @db.execute( "delete from orders where total = 9" )
+    @db.execute( "update orders set total = 1 where region = 'west'" )
+    @db.execute( "update orders set region = 'north' where total = 5" )
+    assert_equal expected.call, actual.call
+    assert_equal [ [ "north", 2, 12, 5, 7 ], [ "west", 1, 1, 1, 1 ] ], actual.call
+
+    @db.execute( "drop trigger sales_insert" )
+    @db.execute( "insert into orders values ( 'south', 3 )" )
+    summary.refresh!
+    assert_equal expected.call, actual.call
+
+    assert_raise( ArgumentError ) do
+      @db.create_materialized_aggregate( "bad", "orders",
+        :aggregates => { "mean" => "avg(total)" } )
+    end
+  ensure
+    @db.execute( "drop table sales" ) rescue nil
+    @db.execute( "drop table orders" ) rescue nil
+  end
+
+  def test_full_text_search
+    @db.execute( "create table tickets ( id integer primary key, subject, body )" )
+    @db.execute( "insert into tickets values ( 1, 'Printer jam', 'The printer jams on every page' )" )
+    @db.execute( "insert into tickets values ( 2, 'Login fails', 'Cannot log in since Monday' )" )
+    @db.create_fts_index( "tickets", "subject", "body" )
+
+    @db.execute( "insert into tickets values ( 3, 'Printer', 'Printer out of toner; printer beeps' )" )
+    assert_equal [ "3", "1" ], @db.search( "tickets", "PRINTER" ).map { |row| row[0] }
+    assert_equal [ "1" ], @db.search( "tickets", "printer jam" ).map { |row| row[0] }
+    assert_equal [ "3" ], @db.search( "tickets", "printer", :limit => 1 ).map { |row| row[0] }
+    assert_equal [], @db.search( "tickets", "printer monday" )
+    assert_equal [], @db.search( "tickets", "" )
+
+    @db.execute( "update tickets set body = 'Fixed on Monday' where id = 3" )
+    @db.execute( "delete from tickets where id = 1" )
+    assert_equal [ "3" ], @db.search( "tickets", "printer" ).map { |row| row[0] }
+    assert_equal [ "2", "3" ], @db.search( "tickets", "monday" ).map { |row| row[0] }.sort
+    assert_equal "2", @db.get_first_value(
+      "select value from tickets_fts_config where name = 'documents'" )
+
+    scores = []
+    @db.search( "tickets", "monday" ) { |row, score| scores << score }
+    assert scores.all? { |score| score > 0 }
+
+    @db.enable_match
+    assert_equal [ "2" ], @db.execute( "select id from tickets " +
+      "where match( body, 'monday log' )" ).map { |row| row[0] }
+    assert_equal "2", @db.get_first_value(
+      "select match( 'Printer; PRINTER jam', 'printer' )" )
+    assert_equal "0", @db.get_first_value( "select match( 'printer', 'printer jam' )" )
+
+    @db.execute( "update tickets set id = 7 where id = 2" )
+    assert_equal [ "7" ], @db.search( "tickets", "login" ).map { |row| row[0] }
+  ensure
+    @db.drop_fts_index( "tickets" ) rescue nil
+    @db.execute( "drop table tickets" ) rescue nil
+  end
+
+  def test_compression
+    @db.execute( "create table documents ( id integer primary key, body )" )
+    body = "{ \"status\": \"open\" } " * 200
+
+    begin
+      @db.store_compressed( "documents", "id" => 1, "body" => body )
+    rescue NotImplementedError
+      return
+    end
+
+    stored = @db.get_first_value( "select body from documents where id = 1" )
+    assert stored.length < body.length / 4
+    assert_equal body, @db.get_first_value(
+      "select uncompress( body ) from documents where id = 1" )
+
+    @db.execute( "insert into documents values ( 2, compress( ? ) )",
+      SQLite::Database.encode( [ 1, "two", nil ] ) )
+    value = @db.get_first_value( "select uncompress( body ) from documents where id = 2" )
+    assert_equal [ 1, "two", nil ], SQLite::Database.decode( value )
+
+    @db.store_compressed( "documents", :id => 3, "body" => nil )
+    assert_equal [ [ "3", nil ] ],
+      @db.execute( "select * from documents where id = 3" )
+    assert_raise( ArgumentError ) do
+      @db.store_compressed( "documents", "id" => 4, :id => 5 )
+    end
+
+    assert_nil @db.get_first_value( "select compress( NULL )" )
+    assert_equal "", @db.get_first_value( "select uncompress( compress( '' ) )" )
+    assert_raise( SQLite::Exceptions::SQLException ) do
+      @db.get_first_value( "select uncompress( 'plain' )" )
+    end
+  ensure
+    @db.execute( "drop table documents" ) rescue nil
+  end
+
+  def test_shard_set
+    files = [ "db/shard1.db", "db/shard2.db" ]
+    files.each_with_index do |file, n|
+      db = SQLite::Database.new( file )
+      db.execute( "create table orders ( region, total integer )" )
+      [ 1, 4, 5 ].each do |total|
+        db.execute( "insert into orders values ( ?, ? )",
+          ( total.odd? ? "east" : "west" ), total + n )
+      end
+      db.close
+    end
+
+    shards = SQLite::ShardSet.new( files )
+    rows = shards.execute( "select total from orders order by total desc limit 4" )
+    assert_equal [ "6", "5", "5", "4" ], rows.map { |row| row[0] }
+
+    rows = shards.execute( "select total from orders order by total desc limit 2 offset 1" )
+    assert_equal [ "5", "5" ], rows.map { |row| row[0] }
+    rows = shards.execute( "select total from orders order by total desc limit 1, 3" )
+    assert_equal [ "5", "5", "4" ], rows.map { |row| row[0] }
+
+    rows = shards.execute( "select count(*), min(total), max(total) from orders" )
+    assert_equal [ [ "6", "1", "6" ] ], rows
+    rows = shards.execute( "select count(*), min(total), max(total) from orders " +
+      "where total > 5" )
+    assert_equal [ [ "1", "6", "6" ] ], rows
+
+    rows = shards.execute( "select region, count(*), sum(total) from orders " +
+      "group by region order by region" )
+    assert_equal [ [ "east", "4", "14" ], [ "west", "2", "9" ] ], rows
+
+    assert_raise( ArgumentError ) do
+      shards.execute( "select avg(total) from orders" )
+    end
+  ensure
+    shards.close if shards
+    files.each { |file| File.delete( file ) if File.exist?( file ) }
+  end
+
   class LengthsAggregate
     def self.function_type
       :numeric
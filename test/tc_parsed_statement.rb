@@ -102,6 +102,14 @@ class TC_ParsedStatement < Test::Unit::TestCase
     assert_equal "'joe' and 'jane'", stmt.to_s
   end
 
+  def test_bind_array_params
+    sql = %q{select * from A where name in (?) and age in (?) and x in (?)}
+    stmt = SQLite::ParsedStatement.new( sql )
+    stmt.bind_params( [ "Amber", "O'Reilly", nil ], [ 1, 2 ], [] )
+    assert_equal "select * from A where name in ('Amber','O''Reilly',NULL) " +
+      "and age in (1,2) and x in (NULL)", stmt.to_s
+  end
+
   def test_mixed_params
     sql = %q{:name and :spouse: and ?2 and ? and :1 and :2:}
     stmt = SQLite::ParsedStatement.new( sql )
@@ -20,4 +20,51 @@ class TC_TypeTranslation < Test::Unit::TestCase
     assert_equal [ [nil, 6], ["Amber", 5] ], rows
   end
 
+  def test_native_conversion
+    @db.execute( "create table N ( i integer, f real, b bigint(20), t text )" )
+    @db.execute( "insert into N values ( '-42', '2.5e-3', '123456789012345678901', '7' )" )
+    @db.execute( "insert into N values ( NULL, '0.1', '12abc', NULL )" )
+
+    rows = @db.execute( "select * from N" )
+    assert_equal [ -42, 0.0025, 123456789012345678901, "7" ], rows[0]
+    assert_equal [ nil, 0.1, 12, nil ], rows[1]
+
+    @db.translator.add_translator( "integer" ) { |t,v| "int:#{v}" }
+    assert_equal "int:-42", @db.get_first_value( "select i from N" )
+  ensure
+    @db.execute( "drop table N" )
+  end
+
+  def test_lazy_rows
+    @db.translator.add_translator( "varchar" ) { |t,v| v.upcase }
+    rows = @db.prepare( "select * from A order by name limit 2",
+      :lazy => true ).execute!
+
+    assert_instance_of SQLite::LazyRow, rows[1]
+    assert_equal "AMBER", rows[1]["name"]
+    assert_same rows[1][0], rows[1]["name"]
+    assert_equal 5, rows[1][-1]
+    assert_nil rows[1]["missing"]
+    assert_equal [ nil, 6 ], rows[0].to_a
+    assert_equal( { "name" => "AMBER", "age" => 5 }, rows[1].to_hash )
+    assert_equal [ "name", "age" ], rows[1].fields
+  end
+
+  def test_native_time_conversion
+    @db.execute( "create table T ( d date, dt datetime, t time )" )
+    @db.execute( "insert into T values ( '2004-09-08', '2004-09-08 14:09:39.5', '2004-09-08T14:09:39Z' )" )
+    @db.execute( "insert into T values ( 'Sep 8 2004', NULL, '14:09' )" )
+
+    rows = @db.execute( "select * from T" )
+    assert_equal Time.mktime( 2004, 9, 8 ), rows[0][0]
+    assert_equal Time.mktime( 2004, 9, 8, 14, 9, 39, 500000 ), rows[0][1]
+    assert_equal Time.utc( 2004, 9, 8, 14, 9, 39 ), rows[0][2]
+    assert rows[0][2].utc?
+    assert_equal Time.parse( "Sep 8 2004" ), rows[1][0]
+    assert_nil rows[1][1]
+    assert_equal Time.parse( "14:09" ), rows[1][2]
+  ensure
+    @db.execute( "drop table T" )
+  end
+
 end